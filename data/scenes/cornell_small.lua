@@ -4,11 +4,32 @@ root = {
 		maxRayDepth = 4,
 		antiAliasing = 0,
 		incrementalRender = 1,
+		pinThreads = 0,
 
 		-- PHOTON MAPPING PARAMETERS
 		maxPhotonDepth = 4,
 		photonSearchCount = 2000,
 		photonSearchRadius = 5.0,
+		photonSearchEpsilon = 0.0,
+		photonSearchMaxNodes = 0,
+		photonMapFile = "",
+		photonMapOutOfCore = 0,
+		photonMapShared = 0,
+		photonMapSharedPersist = 0,
+		animationMode = 0,
+		adaptivePhotonError = 0,
+		adaptivePhotonMaxRounds = 16,
+		progressiveRender = 0,
+		progressivePasses = 16,
+		progressiveTimeBudget = 0,
+		progressiveAlpha = 0.7,
+		irradianceCacheError = 0.3,
+		irradianceCacheMinRadius = 0.5,
+		irradianceCacheMaxRadius = 10.0,
+		irradianceCacheFile = "",
+		numImportons = 0,
+		numShadowPhotons = 0,
+		shadowPhotonSearchRadius = 1.0,
 	},
 
 	window = {
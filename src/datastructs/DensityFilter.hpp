@@ -0,0 +1,72 @@
+#ifndef KIRAN_DENSITY_FILTER_HDR
+#define KIRAN_DENSITY_FILTER_HDR
+
+#include <algorithm>
+#include <cmath>
+
+#if (SIMD_DENSITY_ESTIMATE == 1 && defined(__SSE__))
+#include <xmmintrin.h>
+#endif
+
+#include "../system/Defines.hpp"
+
+// weight of a photon at squared distance <sqDist> in a density
+// estimate over the disk of squared radius <sqRadius>, for the
+// kernel selected by FILTER_KERNEL (photons beyond the radius
+// are weighted as if they were on its border)
+inline float FilterWeight(float sqDist, float sqRadius) {
+	#if (FILTER_RADIANCE_ESTIMATE == 1)
+	const float s = std::min(1.0f, sqDist / sqRadius);
+
+	#if (FILTER_KERNEL == FILTER_KERNEL_CONE)
+	return (1.0f - sqrtf(s) / FILTER_CONSTANT);
+	#elif (FILTER_KERNEL == FILTER_KERNEL_GAUSSIAN)
+	return (FILTER_GAUSSIAN_ALPHA * (1.0f - (1.0f - expf(-0.5f * FILTER_GAUSSIAN_BETA * s)) / (1.0f - expf(-FILTER_GAUSSIAN_BETA))));
+	#elif (FILTER_KERNEL == FILTER_KERNEL_EPANECHNIKOV)
+	return (1.0f - s);
+	#endif
+	#else
+	sqDist = sqDist;
+	sqRadius = sqRadius;
+	return 1.0f;
+	#endif
+}
+
+#if (SIMD_DENSITY_ESTIMATE == 1 && defined(__SSE__))
+// FilterWeight for four squared distances at once, given the
+// reciprocal of the squared radius; the Gaussian's exponential
+// is approximated by its Taylor-polynomial of degree 7 (on the
+// domain [0, BETA / 2] the relative error stays below 1e-4)
+inline __m128 FilterWeights(__m128 sqDists, __m128 invSqRadius) {
+	#if (FILTER_RADIANCE_ESTIMATE == 1)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 s = _mm_min_ps(one, _mm_mul_ps(sqDists, invSqRadius));
+
+	#if (FILTER_KERNEL == FILTER_KERNEL_CONE)
+	return (_mm_sub_ps(one, _mm_mul_ps(_mm_sqrt_ps(s), _mm_set1_ps(1.0f / FILTER_CONSTANT))));
+	#elif (FILTER_KERNEL == FILTER_KERNEL_GAUSSIAN)
+	const __m128 x = _mm_mul_ps(s, _mm_set1_ps(-0.5f * FILTER_GAUSSIAN_BETA));
+
+	__m128 e = _mm_set1_ps(1.0f / 5040.0f);
+	e = _mm_add_ps(_mm_mul_ps(e, x), _mm_set1_ps(1.0f / 720.0f));
+	e = _mm_add_ps(_mm_mul_ps(e, x), _mm_set1_ps(1.0f / 120.0f));
+	e = _mm_add_ps(_mm_mul_ps(e, x), _mm_set1_ps(1.0f / 24.0f));
+	e = _mm_add_ps(_mm_mul_ps(e, x), _mm_set1_ps(1.0f / 6.0f));
+	e = _mm_add_ps(_mm_mul_ps(e, x), _mm_set1_ps(1.0f / 2.0f));
+	e = _mm_add_ps(_mm_mul_ps(e, x), one);
+	e = _mm_add_ps(_mm_mul_ps(e, x), one);
+
+	const __m128 f = _mm_mul_ps(_mm_sub_ps(one, e), _mm_set1_ps(1.0f / (1.0f - expf(-FILTER_GAUSSIAN_BETA))));
+	return (_mm_mul_ps(_mm_set1_ps(FILTER_GAUSSIAN_ALPHA), _mm_sub_ps(one, f)));
+	#elif (FILTER_KERNEL == FILTER_KERNEL_EPANECHNIKOV)
+	return (_mm_sub_ps(one, s));
+	#endif
+	#else
+	sqDists = sqDists;
+	invSqRadius = invSqRadius;
+	return (_mm_set1_ps(1.0f));
+	#endif
+}
+#endif
+
+#endif
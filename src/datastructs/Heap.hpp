@@ -38,8 +38,21 @@ public:
 	}
 	~Heap() { nodes.clear(); }
 
+	// empty the heap and set its capacity to <numNodes>; the
+	// storage is only reallocated if it has to grow
+	void reset(unsigned int numNodes) {
+		if (nodes.size() < (numNodes + 1)) {
+			nodes.resize(numNodes + 1, N());
+		}
+
+		maxNodes = numNodes;
+		lastNodeIdx = 0;
+		maxNodeIdx = 0;
+	}
+
 	unsigned int size() const { return lastNodeIdx; }
 	bool empty() const { return (lastNodeIdx == 0); }
+	bool full() const { return (lastNodeIdx == maxNodes); }
 
 	// return the top-node
 	const N& top() {
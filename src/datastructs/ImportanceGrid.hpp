@@ -0,0 +1,98 @@
+#ifndef KIRAN_IMPORTANCE_GRID_HDR
+#define KIRAN_IMPORTANCE_GRID_HDR
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+
+// coarse voxel grid (over the scene bounds) that counts the
+// importance particles ("importons") traced from the camera
+// landing in each cell; once finalized, these counts turn into
+// per-cell probabilities of keeping a photon that lands there
+class ImportanceGrid {
+public:
+	ImportanceGrid(const math::vec3f& _mins, const math::vec3f& _maxs, unsigned int _size): mins(_mins), maxs(_maxs), size(_size) {
+		counts.resize(size * size * size, 0);
+		probabilities.resize(size * size * size, 1.0f);
+	}
+
+	// safe to call from multiple threads at once
+	void AddImporton(const math::vec3f& pos) {
+		__sync_fetch_and_add(&counts[GetCellIndex(pos)], 1);
+	}
+
+	// give every cell the largest count among itself and its
+	// direct neighbors (photons just across a cell boundary
+	// still fall within the search radius of queries made in
+	// the cell) and normalize by the average non-empty count
+	void Finalize(float minProbability) {
+		std::vector<unsigned int> dilated(counts.size(), 0);
+
+		unsigned long long sumCount = 0;
+		unsigned int numCells = 0;
+
+		for (int z = 0; z < int(size); z++) {
+			for (int y = 0; y < int(size); y++) {
+				for (int x = 0; x < int(size); x++) {
+					unsigned int& count = dilated[(z * size + y) * size + x];
+
+					for (int dz = std::max(z - 1, 0); dz <= std::min(z + 1, int(size) - 1); dz++) {
+						for (int dy = std::max(y - 1, 0); dy <= std::min(y + 1, int(size) - 1); dy++) {
+							for (int dx = std::max(x - 1, 0); dx <= std::min(x + 1, int(size) - 1); dx++) {
+								count = std::max(count, counts[(dz * size + dy) * size + dx]);
+							}
+						}
+					}
+
+					sumCount += count;
+					numCells += (count > 0);
+				}
+			}
+		}
+
+		const float avgCount = (numCells > 0)? (sumCount / float(numCells)): 1.0f;
+
+		float sumProbability = 0.0f;
+
+		for (size_t i = 0; i < probabilities.size(); i++) {
+			probabilities[i] = std::max(minProbability, std::min(1.0f, dilated[i] / avgCount));
+			sumProbability += probabilities[i];
+		}
+
+		std::cout << "[ImportanceGrid::Finalize]" << std::endl;
+		std::cout << "\timportant cells:     " << numCells << " of " << counts.size() << std::endl;
+		std::cout << "\tavg. importons/cell: " << avgCount << std::endl;
+		std::cout << "\tavg. probability:    " << (sumProbability / probabilities.size()) << std::endl;
+	}
+
+	// probability with which a photon landing at <pos> is kept;
+	// the power of kept photons must be divided by this value
+	float GetProbability(const math::vec3f& pos) const {
+		return probabilities[GetCellIndex(pos)];
+	}
+
+private:
+	unsigned int GetCellIndex(const math::vec3f& pos) const {
+		unsigned int idx[3];
+
+		for (unsigned int axis = 0; axis < 3; axis++) {
+			const float rel = (pos[axis] - mins[axis]) / std::max(maxs[axis] - mins[axis], 1e-6f);
+			idx[axis] = std::min(size - 1, (unsigned int) (std::max(0.0f, rel) * size));
+		}
+
+		return ((idx[2] * size + idx[1]) * size + idx[0]);
+	}
+
+	math::vec3f mins;
+	math::vec3f maxs;
+
+	unsigned int size;
+
+	std::vector<unsigned int> counts;
+	std::vector<float> probabilities;
+};
+
+#endif
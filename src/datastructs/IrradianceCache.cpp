@@ -0,0 +1,249 @@
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "./IrradianceCache.hpp"
+
+// records are never stored deeper than this, whatever their
+// radius (keeps degenerate radii from building long chains)
+static const unsigned int MAX_NODE_DEPTH = 16;
+
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t fileTag;
+	uint64_t numRecords;
+};
+
+static const uint32_t FILE_VERSION = 1;
+
+
+
+IrradianceCache::IrradianceCache(const math::vec3f& mins, const math::vec3f& maxs, float _maxError):
+	maxError(_maxError),
+	numLookups(0),
+	numLookupHits(0)
+{
+	const math::vec3f size = maxs - mins;
+
+	root = new Node((mins + maxs) * 0.5f, std::max(size.x, std::max(size.y, size.z)) * 0.5f);
+}
+
+IrradianceCache::~IrradianceCache() {
+	delete root;
+}
+
+
+
+bool IrradianceCache::GetIrradiance(const math::vec3f& pos, const math::vec3f& nrm, math::vec3f* irr) const {
+	math::vec3f irrSum;
+	float wgtSum = 0.0f;
+
+	{
+		boost::shared_lock<boost::shared_mutex> lock(mutex);
+		GetNodeIrradiance(root, pos, nrm, &irrSum, &wgtSum);
+	}
+
+	__sync_fetch_and_add(&numLookups, 1);
+
+	if (wgtSum <= 0.0f) {
+		return false;
+	}
+
+	__sync_fetch_and_add(&numLookupHits, 1);
+
+	*irr = irrSum / wgtSum;
+	return true;
+}
+
+void IrradianceCache::GetNodeIrradiance(
+	const Node* node,
+	const math::vec3f& pos,
+	const math::vec3f& nrm,
+	math::vec3f* irrSum,
+	float* wgtSum
+) const {
+	for (std::vector<unsigned int>::const_iterator it = node->records.begin(); it != node->records.end(); ++it) {
+		const Record& record = records[*it];
+
+		const math::vec3f dp = pos - record.pos;
+		const float cosAngle = std::min(1.0f, nrm.dot3D(record.nrm));
+		const float error = dp.len3D() / record.radius + sqrtf(std::max(0.0f, 1.0f - cosAngle));
+
+		if (error >= maxError)
+			continue;
+		// records in front of <pos> do not see the same scene
+		if (dp.dot3D((nrm + record.nrm) * 0.5f) < (record.radius * -0.05f))
+			continue;
+
+		// falls off to zero at the edge of the valid region
+		// (so inserting a record causes no discontinuities)
+		const float wgt = (1.0f / std::max(error, 1e-6f)) - (1.0f / maxError);
+		const math::vec3f axis = record.nrm.cross(nrm);
+
+		math::vec3f irr = record.irr;
+
+		for (unsigned int c = 0; c < 3; c++) {
+			irr[c] = std::max(0.0f, irr[c] + axis.dot3D(record.rotGrad[c]) + dp.dot3D(record.trnGrad[c]));
+		}
+
+		*irrSum += (irr * wgt);
+		*wgtSum += wgt;
+	}
+
+	for (unsigned int i = 0; i < 8; i++) {
+		const Node* child = node->children[i];
+
+		if (child == NULL) {
+			continue;
+		}
+
+		// records stored in <child> have a radius of at most its
+		// half-size, and are valid up to maxError times that away
+		const math::vec3f dc = pos - child->center;
+		const float maxDist = child->halfSize * (1.0f + maxError);
+
+		if (fabsf(dc.x) > maxDist || fabsf(dc.y) > maxDist || fabsf(dc.z) > maxDist) {
+			continue;
+		}
+
+		GetNodeIrradiance(child, pos, nrm, irrSum, wgtSum);
+	}
+}
+
+
+
+void IrradianceCache::AddRecord(const Record& record) {
+	boost::unique_lock<boost::shared_mutex> lock(mutex);
+	InsertRecord(record);
+}
+
+void IrradianceCache::InsertRecord(const Record& record) {
+	Node* node = root;
+
+	for (unsigned int depth = 0; depth < MAX_NODE_DEPTH; depth++) {
+		const float childSize = node->halfSize * 0.5f;
+
+		if (childSize < record.radius) {
+			break;
+		}
+
+		unsigned int i = 0;
+		math::vec3f c = node->center;
+
+		if (record.pos.x >= c.x) { i |= 1; c.x += childSize; } else { c.x -= childSize; }
+		if (record.pos.y >= c.y) { i |= 2; c.y += childSize; } else { c.y -= childSize; }
+		if (record.pos.z >= c.z) { i |= 4; c.z += childSize; } else { c.z -= childSize; }
+
+		if (node->children[i] == NULL) {
+			node->children[i] = new Node(c, childSize);
+		}
+
+		node = node->children[i];
+	}
+
+	node->records.push_back(records.size());
+	records.push_back(record);
+}
+
+
+
+bool IrradianceCache::SaveToFile(const std::string& fileName, uint64_t fileTag) const {
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+
+	// written under a temporary name and renamed over <fileName>
+	// when complete, so a crash never leaves a truncated cache
+	char tempSuffix[32];
+	snprintf(tempSuffix, sizeof(tempSuffix), ".tmp.%d", int(getpid()));
+
+	const std::string tempName = fileName + tempSuffix;
+	FILE* file = fopen(tempName.c_str(), "wb");
+
+	if (file == NULL) {
+		std::cout << "[IrradianceCache::SaveToFile] cannot open \"" << fileName << "\"" << std::endl;
+		return false;
+	}
+
+	FileHeader header;
+	memcpy(header.magic, "KIRANIRC", sizeof(header.magic));
+	header.version = FILE_VERSION;
+	header.recordSize = sizeof(Record);
+	header.fileTag = fileTag;
+	header.numRecords = records.size();
+
+	bool ret = (fwrite(&header, sizeof(FileHeader), 1, file) == 1);
+	ret = ret && (records.empty() || fwrite(&records[0], sizeof(Record), records.size(), file) == records.size());
+	ret = (fclose(file) == 0) && ret;
+	ret = ret && (rename(tempName.c_str(), fileName.c_str()) == 0);
+
+	if (!ret) {
+		std::cout << "[IrradianceCache::SaveToFile] cannot write \"" << fileName << "\"" << std::endl;
+		remove(tempName.c_str());
+		return false;
+	}
+
+	std::cout << "[IrradianceCache::SaveToFile]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << records.size() << " records)" << std::endl;
+	return true;
+}
+
+bool IrradianceCache::LoadFromFile(const std::string& fileName, uint64_t fileTag) {
+	FILE* file = fopen(fileName.c_str(), "rb");
+
+	if (file == NULL) {
+		return false;
+	}
+
+	FileHeader header;
+	std::vector<Record> fileRecords;
+
+	bool ret = (fread(&header, sizeof(FileHeader), 1, file) == 1);
+
+	if (ret && (memcmp(header.magic, "KIRANIRC", sizeof(header.magic)) != 0 || header.version != FILE_VERSION || header.recordSize != sizeof(Record))) {
+		std::cout << "[IrradianceCache::LoadFromFile] \"" << fileName << "\" has an incompatible format" << std::endl;
+		ret = false;
+	}
+	if (ret && header.fileTag != fileTag) {
+		std::cout << "[IrradianceCache::LoadFromFile] \"" << fileName << "\" is stale" << std::endl;
+		ret = false;
+	}
+
+	if (ret) {
+		fileRecords.resize(header.numRecords);
+		ret = (fileRecords.empty() || fread(&fileRecords[0], sizeof(Record), fileRecords.size(), file) == fileRecords.size());
+	}
+
+	fclose(file);
+
+	if (!ret) {
+		return false;
+	}
+
+	boost::unique_lock<boost::shared_mutex> lock(mutex);
+
+	for (std::vector<Record>::const_iterator it = fileRecords.begin(); it != fileRecords.end(); ++it) {
+		InsertRecord(*it);
+	}
+
+	std::cout << "[IrradianceCache::LoadFromFile]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << fileRecords.size() << " records)" << std::endl;
+	return true;
+}
+
+
+
+unsigned int IrradianceCache::GetNumRecords() const {
+	boost::shared_lock<boost::shared_mutex> lock(mutex);
+	return records.size();
+}
+
+void IrradianceCache::PrintStatistics() const {
+	std::cout << "[IrradianceCache::PrintStatistics]" << std::endl;
+	std::cout << "\tnumRecords:    " << GetNumRecords() << std::endl;
+	std::cout << "\tnumLookups:    " << numLookups << std::endl;
+	std::cout << "\tnumLookupHits: " << numLookupHits << std::endl;
+}
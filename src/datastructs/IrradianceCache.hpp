@@ -0,0 +1,95 @@
+#ifndef KIRAN_IRRADIANCE_CACHE_HDR
+#define KIRAN_IRRADIANCE_CACHE_HDR
+
+#include <boost/thread/shared_mutex.hpp>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+
+// world-space cache of final-gather irradiance records [Ward,
+// 1988] with rotational and translational gradients [Ward and
+// Heckbert, 1992]; a record is (re-)used at every point where
+// its weight 1 / (|p - p_i| / R_i + sqrt(1 - n . n_i)) exceeds
+// 1 / maxError, so new gathers are only needed where none is
+//
+// records live in an octree over the scene bounds, each in the
+// deepest node at least as large as its validity radius (hence
+// a lookup only needs to visit the nodes whose bounds, doubled
+// in size, contain the lookup position); any number of threads
+// can look up and insert records at the same time
+class IrradianceCache {
+public:
+	struct Record {
+		Record(): radius(0.0f) {}
+
+		math::vec3f pos;
+		math::vec3f nrm;
+		math::vec3f irr;
+
+		// per color channel, the change of irradiance with
+		// rotation of the normal (along the rotation axis)
+		// and with translation of the position
+		math::vec3f rotGrad[3];
+		math::vec3f trnGrad[3];
+
+		// harmonic mean distance to the gathered surfaces
+		float radius;
+	};
+
+	IrradianceCache(const math::vec3f& mins, const math::vec3f& maxs, float maxError);
+	~IrradianceCache();
+
+	// weighted average of all records valid at <pos, nrm>,
+	// extrapolated to it by their gradients; false if none
+	bool GetIrradiance(const math::vec3f& pos, const math::vec3f& nrm, math::vec3f* irr) const;
+	void AddRecord(const Record& record);
+
+	// the tag (eg. a hash of everything the records depend
+	// on) is stored in the file and must match when loading
+	bool SaveToFile(const std::string& fileName, uint64_t fileTag) const;
+	bool LoadFromFile(const std::string& fileName, uint64_t fileTag);
+
+	unsigned int GetNumRecords() const;
+	void PrintStatistics() const;
+
+private:
+	struct Node {
+		Node(const math::vec3f& c, float s): center(c), halfSize(s) {
+			for (unsigned int i = 0; i < 8; i++) {
+				children[i] = NULL;
+			}
+		}
+		~Node() {
+			for (unsigned int i = 0; i < 8; i++) {
+				delete children[i];
+			}
+		}
+
+		math::vec3f center;
+		float halfSize;
+
+		Node* children[8];
+		// indices into IrradianceCache::records
+		std::vector<unsigned int> records;
+	};
+
+	void InsertRecord(const Record& record);
+	void GetNodeIrradiance(const Node* node, const math::vec3f& pos, const math::vec3f& nrm, math::vec3f* irrSum, float* wgtSum) const;
+
+	Node* root;
+
+	std::vector<Record> records;
+
+	float maxError;
+
+	// lookups take it shared, insertions exclusively
+	mutable boost::shared_mutex mutex;
+
+	mutable unsigned int numLookups;
+	mutable unsigned int numLookupHits;
+};
+
+#endif
@@ -6,6 +6,8 @@
 #include "../math/vec3fwd.hpp"
 #include "../math/vec3.hpp"
 #include "./NodeVolumeQuery.hpp"
+#include "./NodeRangeQuery.hpp"
+#include "./NodeAggregateQuery.hpp"
 
 template<typename T> class KDTree {
 public:
@@ -57,13 +59,17 @@ public:
 
 	// return all nodes matching the volume-query
 	// description, starting search at the subtree
-	// with node-index <nodeNum>
+	// with node-index <nodeNum> (<Q> is either a
+	// NodeVolumeQuery<T> or a NodeRangeQuery<T>)
 	//
 	// NOTE: do not call before balancing the tree
-	void GetNodes(NodeVolumeQuery<T>* query, size_t nodeNum, unsigned int depth = 0) {
+	template<typename Q> void GetNodes(Q* query, size_t nodeNum, unsigned int depth = 0) {
 		if (nodeNum >= nodes.size()) {
 			return;
 		}
+		if (!query->VisitNode()) {
+			return;
+		}
 
 		const T nodeInst = nodes[nodeNum];
 		float nodeDist = 0.0f;
@@ -76,14 +82,14 @@ public:
 				// search right of the axis-plane first
 				GetNodes(query, (nodeNum << 1) + 1, depth + 1);
 
-				if ((nodeDist * nodeDist) < query->GetMaxNodeDist()) {
+				if ((nodeDist * nodeDist) < query->GetMaxSplitDist()) {
 					GetNodes(query, (nodeNum << 1), depth + 1);
 				}
 			} else {
 				// search left of the axis-plane first
 				GetNodes(query, (nodeNum << 1), depth + 1);
 
-				if ((nodeDist * nodeDist) < query->GetMaxNodeDist()) {
+				if ((nodeDist * nodeDist) < query->GetMaxSplitDist()) {
 					GetNodes(query, (nodeNum << 1) + 1, depth + 1);
 				}
 			}
@@ -94,6 +100,98 @@ public:
 
 
 
+	// compute the aggregate of every interior node's subtree
+	// (bottom-up, so each child's aggregate is available when
+	// its parent is processed); leaves do not need their own
+	//
+	// NOTE: do not call before balancing the tree
+	void BuildAggregates() {
+		aggregates.clear();
+		aggregates.resize((nodes.size() + 1) >> 1);
+
+		for (size_t nodeNum = (nodes.size() - 1) >> 1; nodeNum >= 1; nodeNum--) {
+			NodeAggregate& agg = aggregates[nodeNum];
+			agg.Init(nodes[nodeNum]->GetPos(), nodes[nodeNum]->GetPwr(), GetAggregateNormal(nodes[nodeNum]));
+
+			for (size_t childNum = (nodeNum << 1); childNum <= ((nodeNum << 1) + 1); childNum++) {
+				if (childNum >= nodes.size()) {
+					break;
+				}
+
+				if ((childNum << 1) < nodes.size()) {
+					agg.Merge(aggregates[childNum]);
+				} else {
+					NodeAggregate leaf;
+					leaf.Init(nodes[childNum]->GetPos(), nodes[childNum]->GetPwr(), GetAggregateNormal(nodes[childNum]));
+					agg.Merge(leaf);
+				}
+			}
+		}
+	}
+
+	// level-of-detail counterpart of GetNodes: subtrees that
+	// the query considers small or contained enough are not
+	// descended into, their aggregates are used instead
+	//
+	// NOTE: do not call before BuildAggregates
+	void GetNodesLOD(NodeAggregateQuery<T>* query, size_t nodeNum) const {
+		if (nodeNum >= nodes.size()) {
+			return;
+		}
+
+		query->VisitNode();
+
+		if ((nodeNum << 1) < nodes.size()) {
+			const NodeAggregate& agg = aggregates[nodeNum];
+			const float aggWeight = query->GetAggregateWeight(agg);
+
+			if (aggWeight >= 0.0f) {
+				if (aggWeight > 0.0f) {
+					query->AddAggregate(agg, aggWeight);
+				}
+
+				return;
+			}
+
+			GetNodesLOD(query, (nodeNum << 1));
+			GetNodesLOD(query, (nodeNum << 1) + 1);
+		}
+
+		query->AddNode(nodes[nodeNum]);
+	}
+
+	bool HaveAggregates() const { return (!aggregates.empty()); }
+
+
+
+	// return the index of the deepest subtree that contains
+	// every node inside the box <bmins, bmaxs>; each search
+	// confined to that box can safely start from there (the
+	// splitting-planes of all ancestors lie outside the box)
+	//
+	// NOTE: do not call before balancing the tree
+	size_t GetEnclosingSubTree(const math::vec3f& bmins, const math::vec3f& bmaxs) const {
+		size_t nodeNum = 1;
+
+		while ((nodeNum << 1) < nodes.size()) {
+			const T nodeInst = nodes[nodeNum];
+			const float nodeSplit = nodeInst->GetPos()[nodeInst->GetAxis()];
+
+			if (bmaxs[nodeInst->GetAxis()] < nodeSplit) {
+				nodeNum = (nodeNum << 1);
+			} else if (bmins[nodeInst->GetAxis()] > nodeSplit) {
+				nodeNum = (nodeNum << 1) + 1;
+			} else {
+				break;
+			}
+		}
+
+		return nodeNum;
+	}
+
+	size_t GetNumNodes() const { return nodes.size(); }
+	T GetNode(size_t nodeNum) const { return nodes[nodeNum]; }
+
 	void SetNode(unsigned int nodeNum, T node) {
 		nodes[nodeNum] = node;
 	}
@@ -110,6 +208,17 @@ public:
 	}
 
 private:
+	// surface orientation of a node for its aggregate; the
+	// reversed incoming direction is used if nodes do not
+	// store a normal
+	static math::vec3f GetAggregateNormal(const T node) {
+		#if (USE_SPHERE_COMPRESSION == 1)
+		return (node->GetNrm());
+		#else
+		return -(node->GetDirection());
+		#endif
+	}
+
 	// re-organizes the balanced kd-tree into a max-heap
 	void BuildHeap(std::vector<T>& segment) {
 		size_t nodeNum = 1, nodeIdx = 1, nodeDiff = 0;
@@ -274,6 +383,8 @@ private:
 	// represents a heap in flat array-form
 	// NOTE: first element ([0]) is unused
 	std::vector<T> nodes;
+	// subtree aggregates of interior nodes (same indexing)
+	std::vector<NodeAggregate> aggregates;
 
 	math::vec3f mins;     // bounding-box minima
 	math::vec3f maxs;     // bounding-box maxima
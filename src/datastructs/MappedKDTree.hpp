@@ -0,0 +1,648 @@
+#ifndef KIRAN_MAPPEDKDTREE_HDR
+#define KIRAN_MAPPEDKDTREE_HDR
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+#include "./KDTree.hpp"
+#include "./NodeVolumeQuery.hpp"
+#include "./NodeRangeQuery.hpp"
+
+// read-only, file-backed copy of a balanced KDTree<T*> whose
+// nodes are records of type T (which must be copyable as raw
+// bytes); the tree is cut into subtrees of <blockHeight> levels
+// that each fill one page of the file, so a root-to-leaf search
+// touches only about (height / blockHeight) pages and the OS
+// can keep just the regions of the tree that are being queried
+// in memory
+//
+// the first page holds a header, block b is stored at page b+1;
+// within each block the nodes are kept in (local) heap-order; a
+// caller-defined tag (eg. a hash of whatever the nodes depend on)
+// can be stored in the header to detect stale files
+//
+// instead of a file, the tree can also be kept in a POSIX shared
+// memory object (<fileName> is then its name, eg. "/kiran-..."),
+// which every process mapping it shares through the page cache;
+// each of them holds a shared lock on the object while mapped,
+// so the last one to unmap it can remove it (unless persistent)
+// and it does not take up memory after all users have exited
+template<typename T> class MappedKDTree {
+public:
+	enum {
+		FILE_VERSION = 3,
+		MAX_LAYERS = 32,
+	};
+
+	struct FileHeader {
+		char magic[8];
+		uint64_t tag;
+
+		unsigned int version;
+		unsigned int pageSize;
+		unsigned int recordSize;
+		unsigned int numNodes;   // including the unused node 0
+		unsigned int treeHeight;
+		unsigned int blockHeight;
+
+		// process that wrote the file; if it no longer exists
+		// while the magic is still unset, it died while writing
+		int writerPid;
+
+		// bounding-box of all node positions
+		float mins[3];
+		float maxs[3];
+	};
+
+	MappedKDTree(): fileData(NULL), fileSize(0), lockDesc(-1), persistent(true), numNodes(0), pageSize(0), recordSize(0), numQueries(0) {
+		memset(depthLayers, 0, sizeof(depthLayers));
+		memset(layerRootDepths, 0, sizeof(layerRootDepths));
+		memset(layerFirstBlocks, 0, sizeof(layerFirstBlocks));
+	}
+	~MappedKDTree() { Unmap(); }
+
+	static int OpenFile(const std::string& fileName, int flags, bool shared) {
+		if (shared) {
+			return (shm_open(fileName.c_str(), flags, 0644));
+		}
+
+		return (open(fileName.c_str(), flags, 0644));
+	}
+
+	// removes a file or shared memory object that Write could
+	// not finish (or that nobody uses anymore)
+	static void Remove(const std::string& fileName, bool shared) {
+		if (shared) {
+			shm_unlink(fileName.c_str());
+		} else {
+			unlink(fileName.c_str());
+		}
+	}
+
+	// name under which Write and Build create <fileName>; a file
+	// is written under a temporary name and renamed over the old
+	// one when complete, so processes that have the old one mapped
+	// keep their (unlinked) copy instead of having it truncated
+	// under them, and a crash while writing leaves it intact
+	static std::string GetWriteName(const std::string& fileName, bool shared) {
+		if (shared) {
+			return fileName;
+		}
+
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".tmp.%d", int(getpid()));
+		return (fileName + suffix);
+	}
+
+	// write the nodes of <tree> to <fileName> in blocked order; a
+	// shared memory object is never overwritten (other processes
+	// may have it mapped) and neither is a file (see GetWriteName),
+	// and the header is only completed after all nodes are in place
+	// so nobody maps a partial tree
+	static bool Write(const std::string& fileName, const KDTree<T*>& tree, uint64_t tag, bool shared = false) {
+		MappedKDTree<T> layout;
+		layout.SetLayout(tree.GetNumNodes(), sysconf(_SC_PAGESIZE));
+
+		char* data = CreateFile(fileName, layout, tag, shared);
+
+		if (data == NULL) {
+			return false;
+		}
+
+		FileHeader* header = reinterpret_cast<FileHeader*>(data);
+
+		for (size_t nodeNum = 1; nodeNum < layout.numNodes; nodeNum++) {
+			const T* node = tree.GetNode(nodeNum);
+
+			for (unsigned int axis = 0; axis < 3; axis++) {
+				header->mins[axis] = std::min(header->mins[axis], node->GetPos()[axis]);
+				header->maxs[axis] = std::max(header->maxs[axis], node->GetPos()[axis]);
+			}
+
+			memcpy(data + layout.GetNodeOffset(nodeNum), node, sizeof(T));
+		}
+
+		return (FinishFile(fileName, data, layout, shared));
+	}
+
+	// balance <nodes> (of which the first is unused, as in KDTree)
+	// in place and write the tree to <fileName> in blocked order
+	// while doing so; unlike Write this needs no KDTree<T*> (or any
+	// other per-node memory), so <nodes> can be memory-mapped from
+	// a file themselves and the tree can have more nodes than fit
+	// in memory (each balancing step only scans its own subtree)
+	static bool Build(const std::string& fileName, T* nodes, size_t numNodes, uint64_t tag, bool shared = false) {
+		MappedKDTree<T> layout;
+		layout.SetLayout(numNodes, sysconf(_SC_PAGESIZE));
+
+		char* data = CreateFile(fileName, layout, tag, shared);
+
+		if (data == NULL) {
+			return false;
+		}
+
+		FileHeader* header = reinterpret_cast<FileHeader*>(data);
+
+		for (size_t nodeNum = 1; nodeNum < numNodes; nodeNum++) {
+			for (unsigned int axis = 0; axis < 3; axis++) {
+				header->mins[axis] = std::min(header->mins[axis], nodes[nodeNum].GetPos()[axis]);
+				header->maxs[axis] = std::max(header->maxs[axis], nodes[nodeNum].GetPos()[axis]);
+			}
+		}
+
+		if (numNodes > 1) {
+			const math::vec3f mins(header->mins[0], header->mins[1], header->mins[2]);
+			const math::vec3f maxs(header->maxs[0], header->maxs[1], header->maxs[2]);
+
+			BuildSubTree(nodes, 1, numNodes - 1, 1, mins, maxs, layout, data);
+		}
+
+		return (FinishFile(fileName, data, layout, shared));
+	}
+
+	// read and validate only the header of <fileName>
+	static bool ReadHeader(const std::string& fileName, FileHeader* header, bool shared = false) {
+		const int fd = OpenFile(fileName, O_RDONLY, shared);
+
+		if (fd < 0) {
+			return false;
+		}
+
+		const bool ret = (read(fd, header, sizeof(FileHeader)) == sizeof(FileHeader));
+
+		close(fd);
+
+		if (!ret) {
+			return false;
+		}
+
+		if (header->magic[0] == 0) {
+			if (RemoveStale(fileName, *header, shared)) {
+				return false;
+			}
+
+			std::cout << "[MappedKDTree::ReadHeader] \"" << fileName << "\" is still being written" << std::endl;
+			return false;
+		}
+
+		if (memcmp(header->magic, "KIRANKDT", sizeof(header->magic)) != 0 || header->version != FILE_VERSION || header->recordSize != sizeof(T)) {
+			std::cout << "[MappedKDTree::ReadHeader] \"" << fileName << "\" has an incompatible format" << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	// map a file created by Write (read-only); a shared memory
+	// object that is not <persistent> is removed by whichever
+	// process unmaps it last
+	bool Map(const std::string& fileName, bool shared = false, bool persistent = true) {
+		Unmap();
+
+		FileHeader header;
+		struct stat fileStat;
+
+		if (!ReadHeader(fileName, &header, shared)) {
+			std::cout << "[MappedKDTree::Map] cannot read \"" << fileName << "\"" << std::endl;
+			return false;
+		}
+
+		const int fd = OpenFile(fileName, O_RDONLY, shared);
+
+		if (fd < 0 || fstat(fd, &fileStat) != 0) {
+			std::cout << "[MappedKDTree::Map] cannot open \"" << fileName << "\"" << std::endl;
+
+			if (fd >= 0) {
+				close(fd);
+			}
+
+			return false;
+		}
+
+		SetLayout(header.numNodes, header.pageSize);
+
+		if (size_t(fileStat.st_size) < fileSize) {
+			std::cout << "[MappedKDTree::Map] \"" << fileName << "\" is truncated" << std::endl;
+			close(fd);
+			return false;
+		}
+
+		void* data = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (data == MAP_FAILED) {
+			std::cout << "[MappedKDTree::Map] cannot map \"" << fileName << "\"" << std::endl;
+			close(fd);
+			return false;
+		}
+
+		// the lock is released when the descriptor is closed (also
+		// if the process dies), so it counts the current users
+		if (shared && flock(fd, LOCK_SH) == 0) {
+			lockDesc = fd;
+			lockName = fileName;
+		} else {
+			close(fd);
+		}
+
+		// searches jump around the file, so read-ahead
+		// would mostly pull in pages nobody asks for
+		madvise(data, fileSize, MADV_RANDOM);
+
+		fileData = reinterpret_cast<const char*>(data);
+		numQueries = 0;
+
+		this->persistent = persistent;
+
+		getrusage(RUSAGE_SELF, &mapUsage);
+		return true;
+	}
+
+	void Unmap() {
+		if (fileData != NULL) {
+			munmap(const_cast<char*>(fileData), fileSize);
+		}
+
+		if (lockDesc >= 0) {
+			// an exclusive lock can only be had by the last user
+			// (a process that maps the object after its removal
+			// still keeps its own copy until it unmaps it too)
+			if (!persistent && flock(lockDesc, LOCK_EX | LOCK_NB) == 0) {
+				std::cout << "[MappedKDTree::Unmap] removing unused \"" << lockName << "\"" << std::endl;
+				Remove(lockName, true);
+			}
+
+			close(lockDesc);
+		}
+
+		fileData = NULL;
+		lockDesc = -1;
+	}
+
+
+
+	// return all nodes matching the volume-query
+	// description, starting search at the subtree
+	// with node-index <nodeNum> (see KDTree)
+	template<typename Q> void GetNodes(Q* query, size_t nodeNum) const {
+		if (nodeNum >= numNodes) {
+			return;
+		}
+		if (!query->VisitNode()) {
+			return;
+		}
+
+		const T* nodeInst = GetNode(nodeNum);
+
+		if ((nodeNum << 1) < numNodes) {
+			const float nodeDist = query->GetPos()[nodeInst->GetAxis()] - nodeInst->GetPos()[nodeInst->GetAxis()];
+
+			if (nodeDist > 0.0f) {
+				GetNodes(query, (nodeNum << 1) + 1);
+
+				if ((nodeDist * nodeDist) < query->GetMaxSplitDist()) {
+					GetNodes(query, (nodeNum << 1));
+				}
+			} else {
+				GetNodes(query, (nodeNum << 1));
+
+				if ((nodeDist * nodeDist) < query->GetMaxSplitDist()) {
+					GetNodes(query, (nodeNum << 1) + 1);
+				}
+			}
+		}
+
+		query->AddNode(nodeInst);
+	}
+
+	// see KDTree::GetEnclosingSubTree
+	size_t GetEnclosingSubTree(const math::vec3f& bmins, const math::vec3f& bmaxs) const {
+		size_t nodeNum = 1;
+
+		while ((nodeNum << 1) < numNodes) {
+			const T* nodeInst = GetNode(nodeNum);
+			const float nodeSplit = nodeInst->GetPos()[nodeInst->GetAxis()];
+
+			if (bmaxs[nodeInst->GetAxis()] < nodeSplit) {
+				nodeNum = (nodeNum << 1);
+			} else if (bmins[nodeInst->GetAxis()] > nodeSplit) {
+				nodeNum = (nodeNum << 1) + 1;
+			} else {
+				break;
+			}
+		}
+
+		return nodeNum;
+	}
+
+	const T* GetNode(size_t nodeNum) const {
+		return (reinterpret_cast<const T*>(fileData + GetNodeOffset(nodeNum)));
+	}
+
+	size_t GetNumNodes() const { return numNodes; }
+	size_t GetFileSize() const { return fileSize; }
+	bool IsMapped() const { return (fileData != NULL); }
+
+	// instrumentation: callers count their top-level searches
+	// so the number of page-faults (which are process-wide)
+	// since mapping can be related to the number of queries
+	void CountQuery() const { __sync_fetch_and_add(&numQueries, 1); }
+	unsigned long GetNumQueries() const { return numQueries; }
+
+	void GetPageFaults(long* minFaults, long* majFaults) const {
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+
+		*minFaults = usage.ru_minflt - mapUsage.ru_minflt;
+		*majFaults = usage.ru_majflt - mapUsage.ru_majflt;
+	}
+
+private:
+	// orders nodes by their position along one axis
+	struct NodeAxisCmp {
+	public:
+		NodeAxisCmp(unsigned int a): axis(a) {}
+
+		bool operator () (const T& a, const T& b) const { return (a.GetPos()[axis] < b.GetPos()[axis]); }
+
+	private:
+		unsigned int axis;
+	};
+
+	// removes <fileName> if the process that was writing it (as
+	// given by <header>, whose magic is still unset) died before it
+	// was done, so it does not block publishing a new one forever
+	static bool RemoveStale(const std::string& fileName, const FileHeader& header, bool shared) {
+		if (!shared || header.writerPid <= 0) {
+			return false;
+		}
+		if (kill(header.writerPid, 0) == 0 || errno != ESRCH) {
+			return false;
+		}
+
+		std::cout << "[MappedKDTree::RemoveStale] writer " << header.writerPid << " of \"" << fileName << "\" died, removing it" << std::endl;
+		Remove(fileName, shared);
+		return true;
+	}
+
+	// create <fileName> with the size of <layout> and map it; all of
+	// the header except its magic (and the bounds, which are reset)
+	// is filled in
+	static char* CreateFile(const std::string& fileName, const MappedKDTree<T>& layout, uint64_t tag, bool shared) {
+		const std::string writeName = GetWriteName(fileName, shared);
+
+		int fd = OpenFile(writeName, O_RDWR | O_CREAT | ((shared)? O_EXCL: O_TRUNC), shared);
+
+		if (fd < 0 && shared && errno == EEXIST) {
+			FileHeader header;
+
+			// an object whose writer died is removed by ReadHeader,
+			// in which case this can try again (once)
+			if (!ReadHeader(fileName, &header, shared)) {
+				fd = OpenFile(writeName, O_RDWR | O_CREAT | O_EXCL, shared);
+			}
+		}
+
+		if (fd < 0) {
+			if (shared && errno == EEXIST) {
+				std::cout << "[MappedKDTree::CreateFile] \"" << fileName << "\" was already created by another process" << std::endl;
+			} else {
+				std::cout << "[MappedKDTree::CreateFile] cannot create \"" << fileName << "\"" << std::endl;
+			}
+
+			return NULL;
+		}
+
+		if (ftruncate(fd, layout.fileSize) != 0) {
+			std::cout << "[MappedKDTree::CreateFile] cannot resize \"" << fileName << "\" to " << layout.fileSize << " bytes" << std::endl;
+			close(fd);
+			Remove(writeName, shared);
+			return NULL;
+		}
+
+		char* data = reinterpret_cast<char*>(mmap(NULL, layout.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+
+		close(fd);
+
+		if (data == MAP_FAILED) {
+			std::cout << "[MappedKDTree::CreateFile] cannot map \"" << fileName << "\"" << std::endl;
+			Remove(writeName, shared);
+			return NULL;
+		}
+
+		FileHeader* header = reinterpret_cast<FileHeader*>(data);
+
+		header->writerPid   = getpid();
+		header->tag         = tag;
+		header->version     = FILE_VERSION;
+		header->pageSize    = layout.pageSize;
+		header->recordSize  = layout.recordSize;
+		header->numNodes    = layout.numNodes;
+		header->treeHeight  = layout.treeHeight;
+		header->blockHeight = layout.blockHeight;
+
+		for (unsigned int axis = 0; axis < 3; axis++) {
+			header->mins[axis] = (layout.numNodes > 1)? ( 1e30f): 0.0f;
+			header->maxs[axis] = (layout.numNodes > 1)? (-1e30f): 0.0f;
+		}
+
+		return data;
+	}
+
+	// publish (by its magic, and for a file by renaming it to
+	// <fileName>) and unmap a file created by CreateFile once all
+	// nodes are in place
+	static bool FinishFile(const std::string& fileName, char* data, const MappedKDTree<T>& layout, bool shared) {
+		FileHeader* header = reinterpret_cast<FileHeader*>(data);
+
+		// readers check the magic first
+		__sync_synchronize();
+		memcpy(header->magic, "KIRANKDT", sizeof(header->magic));
+
+		msync(data, layout.fileSize, MS_SYNC);
+		munmap(data, layout.fileSize);
+
+		if (shared) {
+			return true;
+		}
+
+		const std::string writeName = GetWriteName(fileName, shared);
+
+		if (rename(writeName.c_str(), fileName.c_str()) != 0) {
+			std::cout << "[MappedKDTree::FinishFile] cannot rename \"" << writeName << "\" to \"" << fileName << "\"" << std::endl;
+			Remove(writeName, shared);
+			return false;
+		}
+
+		return true;
+	}
+
+	// balance nodes [firstNode, lastNode], which form the subtree
+	// of <nodeNum> and lie in the box <mins, maxs>, with the same
+	// median and split-axis rules as KDTree::BalanceSegment (so the
+	// tree is left-balanced) and write its root to its place
+	static void BuildSubTree(
+		T* nodes,
+		size_t firstNode,
+		size_t lastNode,
+		size_t nodeNum,
+		const math::vec3f& mins,
+		const math::vec3f& maxs,
+		const MappedKDTree<T>& layout,
+		char* data
+	) {
+		const size_t numSubNodes = lastNode - firstNode + 1;
+
+		size_t medianNode = 1;
+		unsigned int splitAxis = 2;
+
+		while ((4 * medianNode) <= numSubNodes) {
+			medianNode <<= 1;
+		}
+
+		if ((3 * medianNode) <= numSubNodes) {
+			medianNode = firstNode + (medianNode << 1) - 1;
+		} else {
+			medianNode = lastNode - medianNode + 1;
+		}
+
+		if (((maxs.x - mins.x) > (maxs.y - mins.y)) && ((maxs.x - mins.x) > (maxs.z - mins.z))) {
+			splitAxis = 0;
+		} else {
+			if ((maxs.y - mins.y) > (maxs.z - mins.z)) {
+				splitAxis = 1;
+			}
+		}
+
+		std::nth_element(nodes + firstNode, nodes + medianNode, nodes + lastNode + 1, NodeAxisCmp(splitAxis));
+
+		nodes[medianNode].SetAxis(splitAxis);
+		memcpy(data + layout.GetNodeOffset(nodeNum), &nodes[medianNode], sizeof(T));
+
+		if (medianNode > firstNode) {
+			math::vec3f subMaxs = maxs;
+			subMaxs[splitAxis] = nodes[medianNode].GetPos()[splitAxis];
+
+			BuildSubTree(nodes, firstNode, medianNode - 1, (nodeNum << 1), mins, subMaxs, layout, data);
+		}
+
+		if (medianNode < lastNode) {
+			math::vec3f subMins = mins;
+			subMins[splitAxis] = nodes[medianNode].GetPos()[splitAxis];
+
+			BuildSubTree(nodes, medianNode + 1, lastNode, (nodeNum << 1) + 1, subMins, maxs, layout, data);
+		}
+	}
+
+	void SetLayout(size_t nodes, size_t page) {
+		numNodes = nodes;
+		pageSize = page;
+		recordSize = sizeof(T);
+
+		assert(pageSize >= (recordSize + sizeof(FileHeader)));
+
+		// number of levels (a heap of N nodes has height
+		// floor(log2(N)) + 1) and of levels per block
+		treeHeight = 0;
+		blockHeight = 0;
+
+		while ((size_t(1) << treeHeight) < numNodes) { treeHeight++; }
+		while (((size_t(2) << blockHeight) - 1) <= (pageSize / recordSize)) { blockHeight++; }
+
+		assert(treeHeight <= MAX_LAYERS);
+
+		// cut the tree into layers of blocks from the bottom
+		// up so that only the top layer can be less than full
+		// height (it contains only a single block)
+		const unsigned int topHeight = (treeHeight > 0)? (((treeHeight - 1) % blockHeight) + 1): 0;
+
+		size_t numBlocks = 1;
+		unsigned int numLayers = 1;
+
+		layerRootDepths[0] = 0;
+		layerFirstBlocks[0] = 0;
+
+		for (unsigned int depth = topHeight; depth < treeHeight; depth += blockHeight) {
+			layerRootDepths[numLayers] = depth;
+			layerFirstBlocks[numLayers] = numBlocks;
+
+			numBlocks += (size_t(1) << depth);
+			numLayers += 1;
+		}
+
+		for (unsigned int depth = 0, layer = 0; depth < treeHeight; depth++) {
+			if ((layer + 1) < numLayers && depth >= layerRootDepths[layer + 1]) {
+				layer += 1;
+			}
+
+			depthLayers[depth] = layer;
+		}
+
+		// the header occupies the first page
+		fileSize = pageSize * (1 + numBlocks);
+	}
+
+	size_t GetNodeBlock(size_t nodeNum) const {
+		const unsigned int nodeDepth = (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(nodeNum);
+		const unsigned int nodeLayer = depthLayers[nodeDepth];
+		const unsigned int rootDepth = layerRootDepths[nodeLayer];
+
+		// index of the root of the block containing <nodeNum>
+		const size_t blockRoot = nodeNum >> (nodeDepth - rootDepth);
+
+		return (layerFirstBlocks[nodeLayer] + (blockRoot - (size_t(1) << rootDepth)));
+	}
+
+	size_t GetNodeOffset(size_t nodeNum) const {
+		const unsigned int nodeDepth = (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(nodeNum);
+		const unsigned int rootDepth = layerRootDepths[depthLayers[nodeDepth]];
+		const unsigned int relDepth  = nodeDepth - rootDepth;
+
+		// heap-index of <nodeNum> within its block (1-based)
+		const size_t localNum = (size_t(1) << relDepth) + (nodeNum & ((size_t(1) << relDepth) - 1));
+
+		return ((GetNodeBlock(nodeNum) + 1) * pageSize + (localNum - 1) * recordSize);
+	}
+
+
+	const char* fileData;
+	size_t fileSize;
+
+	// descriptor holding the shared lock on a mapped
+	// shared memory object (see Map), and its name
+	int lockDesc;
+	std::string lockName;
+
+	bool persistent;
+
+	size_t numNodes;
+	size_t pageSize;
+	size_t recordSize;
+
+	unsigned int treeHeight;
+	unsigned int blockHeight;
+
+	unsigned int depthLayers[MAX_LAYERS];
+	unsigned int layerRootDepths[MAX_LAYERS];
+	size_t layerFirstBlocks[MAX_LAYERS];
+
+	mutable volatile unsigned long numQueries;
+	rusage mapUsage;
+};
+
+#endif
@@ -0,0 +1,210 @@
+#ifndef KIRAN_NODEAGGREGATEQUERY_HDR
+#define KIRAN_NODEAGGREGATEQUERY_HDR
+
+#include <algorithm>
+#include <cmath>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+#include "../system/Defines.hpp"
+#include "./DensityFilter.hpp"
+
+// summary of all nodes in a kd-tree subtree (including
+// the subtree root itself), built bottom-up once after
+// balancing
+struct NodeAggregate {
+public:
+	NodeAggregate(): nrmCone(0.0f), count(0) {}
+
+	void Init(const math::vec3f& _pos, const math::vec3f& _pwr, const math::vec3f& _nrm) {
+		pwr = _pwr;
+		pos = _pos;
+		mins = _pos;
+		maxs = _pos;
+		nrm = _nrm;
+		nrmCone = 0.0f;
+		count = 1;
+	}
+
+	// conservatively merges the normal-cones; the merged
+	// cone is wider than strictly needed, but this only
+	// makes LOD-queries descend somewhat more often
+	void Merge(const NodeAggregate& a) {
+		const float wa = float(count) / float(count + a.count);
+		const float wb = 1.0f - wa;
+
+		math::vec3f axis = (nrm * wa) + (a.nrm * wb);
+
+		if (axis.sqLen3D() > 1e-6f) {
+			axis = axis.norm();
+
+			nrmCone = std::max(
+				acosf(std::max(-1.0f, std::min(1.0f, axis.dot3D(  nrm)))) +   nrmCone,
+				acosf(std::max(-1.0f, std::min(1.0f, axis.dot3D(a.nrm)))) + a.nrmCone
+			);
+			nrmCone = std::min(nrmCone, float(M_PI));
+		} else {
+			// opposing normals, cone covers everything
+			axis = nrm;
+			nrmCone = M_PI;
+		}
+
+		pwr += a.pwr;
+		pos = (pos * wa) + (a.pos * wb);
+		nrm = axis;
+
+		mins.x = std::min(mins.x, a.mins.x); maxs.x = std::max(maxs.x, a.maxs.x);
+		mins.y = std::min(mins.y, a.mins.y); maxs.y = std::max(maxs.y, a.maxs.y);
+		mins.z = std::min(mins.z, a.mins.z); maxs.z = std::max(maxs.z, a.maxs.z);
+
+		count += a.count;
+	}
+
+	math::vec3f pwr;  // summed power
+	math::vec3f pos;  // centroid
+	math::vec3f mins; // bounding-box minima
+	math::vec3f maxs; // bounding-box maxima
+	math::vec3f nrm;  // normal-cone axis
+	float nrmCone;    // normal-cone half-angle (radians)
+
+	unsigned int count;
+};
+
+
+
+// level-of-detail irradiance query (in the spirit of
+// lightcuts): subtrees that subtend less than the solid
+// angle <maxSolidAngle> as seen from <eye> (the origin of
+// the ray that produced the query) are accounted for by
+// their aggregate alone
+template<typename T> struct NodeAggregateQuery {
+public:
+	NodeAggregateQuery(const math::vec3f& _pos, const math::vec3f& _nrm, const math::vec3f& _eye, float _dst, float _maxSolidAngle) {
+		pos = _pos;
+		nrm = _nrm;
+		eye = _eye;
+		dst = _dst;
+
+		maxSolidAngle = _maxSolidAngle;
+		numVisitedNodes = 0;
+
+		// a subtree can only be accepted as a whole if all
+		// of its normals would pass the per-node test too
+		#if (USE_SPHERE_COMPRESSION == 1)
+		maxNormalAngle = acosf(SPHERE_COMPRESSION_RATIO);
+		#else
+		maxNormalAngle = M_PI * 0.5f;
+		#endif
+	}
+
+	const math::vec3f& GetPos() const { return pos; }
+	const math::vec3f& GetNrm() const { return nrm; }
+	float GetDst() const { return dst; }
+
+	unsigned int GetNumVisitedNodes() const { return numVisitedNodes; }
+	void VisitNode() { numVisitedNodes += 1; }
+
+	// returns the fraction of <agg> to count in [0, 1], or a
+	// negative value if the subtree must be descended into
+	float GetAggregateWeight(const NodeAggregate& agg) const {
+		math::vec3f nearVec;
+		math::vec3f farVec;
+
+		for (unsigned int axis = 0; axis < 3; axis++) {
+			nearVec[axis] = std::max(0.0f, std::max(agg.mins[axis] - pos[axis], pos[axis] - agg.maxs[axis]));
+			farVec[axis] = std::max(pos[axis] - agg.mins[axis], agg.maxs[axis] - pos[axis]);
+		}
+
+		if (nearVec.sqLen3D() > (dst * dst)) {
+			// subtree is entirely outside the search-sphere
+			return 0.0f;
+		}
+
+		const float nrmAngle = acosf(std::max(-1.0f, std::min(1.0f, agg.nrm.dot3D(nrm))));
+
+		if ((nrmAngle + agg.nrmCone) > maxNormalAngle) {
+			return -1.0f;
+		}
+
+		#if (FILTER_RADIANCE_ESTIMATE == 0)
+		// without a filter, the exact position of the nodes does
+		// not matter if the subtree is inside the search-sphere
+		if (farVec.sqLen3D() <= (dst * dst)) {
+			return 1.0f;
+		}
+		#endif
+
+		const float boxSize = (agg.maxs - agg.mins).sqLen3D();
+		const float eyeDist = (agg.pos - eye).sqLen3D();
+
+		// the search-sphere can itself subtend less than the
+		// threshold, so subtrees larger than it are never used
+		if (boxSize < (maxSolidAngle * eyeDist) && boxSize < (dst * dst)) {
+			if (farVec.sqLen3D() <= (dst * dst)) {
+				return 1.0f;
+			}
+
+			// subtree straddles the boundary but is too small to
+			// matter from afar; count the part of it estimated
+			// to lie inside the sphere based on its centroid
+			const float d = (agg.pos - pos).len3D();
+			const float f = 0.5f + ((dst - d) / std::max(sqrtf(boxSize), 1e-6f));
+
+			return std::max(0.0f, std::min(1.0f, f));
+		}
+
+		return -1.0f;
+	}
+
+	void AddAggregate(const NodeAggregate& agg, float frac) {
+		#if (FILTER_RADIANCE_ESTIMATE == 1)
+		irr += (agg.pwr * (frac * FilterWeight((agg.pos - pos).sqLen3D(), dst * dst)));
+		#else
+		irr += (agg.pwr * frac);
+		#endif
+	}
+
+	// same criteria as NodeVolumeQuery::AddNode and the
+	// irradiance estimate computed from its results
+	void AddNode(T nodeInst) {
+		const float nodeDist = (pos - nodeInst->GetPos()).sqLen3D();
+
+		if ((nodeDist > (dst * dst)) || (nodeDist <= 0.0f)) {
+			return;
+		}
+
+		#if (USE_SPHERE_COMPRESSION == 1)
+		if ((nodeInst->GetNrm()).dot3D(nrm) < SPHERE_COMPRESSION_RATIO) {
+			return;
+		}
+		#endif
+
+		if ((nodeInst->GetDirection()).dot3D(nrm) >= 0.0f) {
+			return;
+		}
+
+		#if (FILTER_RADIANCE_ESTIMATE == 1)
+		irr += (nodeInst->GetPwr() * FilterWeight(nodeDist, dst * dst));
+		#else
+		irr += (nodeInst->GetPwr());
+		#endif
+	}
+
+	math::vec3f GetIrradiance() const {
+		return (irr * (1.0f / (M_PI * dst * dst * FILTER_NORMALIZER)));
+	}
+
+private:
+	math::vec3f pos;
+	math::vec3f nrm;
+	math::vec3f eye;
+	math::vec3f irr;
+
+	float dst;
+	float maxSolidAngle;
+	float maxNormalAngle;
+
+	unsigned int numVisitedNodes;
+};
+
+#endif
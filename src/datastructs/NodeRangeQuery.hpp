@@ -0,0 +1,66 @@
+#ifndef KIRAN_NODERANGEQUERY_HDR
+#define KIRAN_NODERANGEQUERY_HDR
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+#include "../system/Defines.hpp"
+
+// fixed-radius counterpart of NodeVolumeQuery: instead of
+// keeping the k nearest nodes, the power and number of all
+// nodes within <dst> of <pos> are summed (as needed by the
+// progressive radiance estimate, which has no k)
+template<typename T> struct NodeRangeQuery {
+public:
+	NodeRangeQuery(const math::vec3f& _pos, const math::vec3f& _nrm, float _dst) {
+		pos = _pos;
+		nrm = _nrm;
+		dst = _dst;
+
+		numNodes = 0;
+	}
+
+	const math::vec3f& GetPos() const { return pos; }
+	const math::vec3f& GetNrm() const { return nrm; }
+	const math::vec3f& GetPwr() const { return pwr; }
+	float GetDst() const { return dst; }
+
+	unsigned int GetNumNodes() const { return numNodes; }
+
+	// the search never narrows, and is never cut short
+	float GetMaxSplitDist() const { return (dst * dst); }
+	bool VisitNode() { return true; }
+
+	// same criteria as NodeVolumeQuery::AddNode and the
+	// irradiance estimate computed from its results
+	void AddNode(T nodeInst) {
+		const float nodeDist = (pos - nodeInst->GetPos()).sqLen3D();
+
+		if ((nodeDist > (dst * dst)) || (nodeDist <= 0.0f)) {
+			return;
+		}
+
+		#if (USE_SPHERE_COMPRESSION == 1)
+		if ((nodeInst->GetNrm()).dot3D(nrm) < SPHERE_COMPRESSION_RATIO) {
+			return;
+		}
+		#endif
+
+		if ((nodeInst->GetDirection()).dot3D(nrm) >= 0.0f) {
+			return;
+		}
+
+		pwr += nodeInst->GetPwr();
+		numNodes += 1;
+	}
+
+private:
+	math::vec3f pos;
+	math::vec3f nrm;
+	math::vec3f pwr;
+
+	float dst;
+
+	unsigned int numNodes;
+};
+
+#endif
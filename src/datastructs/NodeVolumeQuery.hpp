@@ -7,15 +7,32 @@
 
 template<typename T> struct NodeVolumeQuery {
 public:
-	NodeVolumeQuery(unsigned int maxNodes, const math::vec3f& _pos, const math::vec3f& _nrm, float _dst) {
+	typedef Heap<float, T, MaxHeapNode<float, T> > HeapType;
+
+	// if <sharedHeap> is not NULL, the query borrows it (eg.
+	// from a per-thread buffer) instead of allocating its own
+	NodeVolumeQuery(unsigned int maxNodes, const math::vec3f& _pos, const math::vec3f& _nrm, float _dst, HeapType* sharedHeap = NULL) {
 		pos = _pos;
 		nrm = _nrm;
 		dst = _dst;
 
-		heap = new Heap<float, T, MaxHeapNode<float, T> >(maxNodes);
+		epsFactor = 1.0f;
+		numVisitedNodes = 0;
+		maxVisitedNodes = 0;
+
+		if (sharedHeap != NULL) {
+			heap = sharedHeap;
+			heap->reset(maxNodes);
+		} else {
+			heap = new HeapType(maxNodes);
+		}
+
+		ownHeap = (sharedHeap == NULL);
 	}
 	~NodeVolumeQuery() {
-		delete heap;
+		if (ownHeap) {
+			delete heap;
+		}
 	}
 
 	const math::vec3f& GetPos() const { return pos; }
@@ -23,9 +40,38 @@ public:
 	float GetDst() const { return dst; }
 
 	unsigned int GetNumNodes() const { return heap->size(); }
+	unsigned int GetNumVisitedNodes() const { return numVisitedNodes; }
+
+	// squared distance of the furthest node found so far
 	float GetMaxNodeDist() const { return (!heap->empty())? (heap->top()).key: (dst * dst); }
+	// squared distance beyond which subtrees can be pruned; this
+	// stays equal to the search-radius until the heap is filled
+	// (any node within range could still be among the nearest)
+	// and is shrunk by (1 + eps)^2 for approximate searches
+	float GetMaxSplitDist() const { return (heap->full()? (heap->top()).key: (dst * dst)) * epsFactor; }
+
+	// (1 + eps)-approximate search: subtrees are skipped when their
+	// splitting-plane lies further away than <maxDist / (1 + eps)>,
+	// so every node returned is within (1 + eps) times the distance
+	// of the true k-th nearest neighbor
+	void SetEpsilon(float eps) { epsFactor = 1.0f / ((1.0f + eps) * (1.0f + eps)); }
+	// optional cap on the number of nodes examined (0 means none)
+	void SetMaxVisitedNodes(unsigned int n) { maxVisitedNodes = n; }
+
+	// called by the partitioning data-structure for every node it
+	// examines; returns false once the visitation budget is spent
+	bool VisitNode() {
+		if (maxVisitedNodes != 0 && numVisitedNodes >= maxVisitedNodes) {
+			return false;
+		}
+
+		numVisitedNodes += 1;
+		return true;
+	}
 
 	T GetNode(unsigned int i) const { return (heap->get(i)).val; }
+	// squared distance of the i-th node
+	float GetNodeDist(unsigned int i) const { return (heap->get(i)).key; }
 	void AddNode(T nodeInst) {
 		// take the squared (!) Euclidean distance
 		const float nodeDist = (GetPos() - nodeInst->GetPos()).sqLen3D();
@@ -65,12 +111,17 @@ public:
 
 
 private:
-	Heap<float, T, MaxHeapNode<float, T> >* heap;
+	HeapType* heap;
+	bool ownHeap;
 
 	math::vec3f pos;
 	math::vec3f nrm;
 
 	float dst;
+	float epsFactor;
+
+	unsigned int numVisitedNodes;
+	unsigned int maxVisitedNodes;
 };
 
 #endif
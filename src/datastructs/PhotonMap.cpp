@@ -1,7 +1,12 @@
 #include <boost/thread/mutex.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cassert>
 #include <cfloat>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 
 // include first, so the preprocessor
@@ -10,27 +15,237 @@
 
 #include "./PhotonMap.hpp"
 #include "./KDTree.hpp"
+#include "./MappedKDTree.hpp"
 #include "./UniformGrid.hpp"
 #include "./SortedList.hpp"
+#include "./DensityFilter.hpp"
+
+#if (BENCHMARK_PHOTON_MAP_QUERIES == 1)
+#include "../system/Benchmark.hpp"
+#endif
+
+// turns the photons gathered by a (filled) volume query
+// into an irradiance estimate at its search-position; shared
+// by all partitioning data-structures
+template<typename T> static math::vec3f EstimateIrradiance(
+	const NodeVolumeQuery<T>& q,
+	const math::vec3f& searchNrm,
+	float searchRadius
+) {
+	// the filter-kernel spans the same disk that the sum is
+	// normalized by
+	#if (USE_FURTHEST_PHOTON_DIST == 1)
+	// use the distance of the furthest photon
+	const float sqRadius = q.GetMaxNodeDist();
+	searchRadius = searchRadius;
+	#else
+	const float sqRadius = searchRadius * searchRadius;
+	#endif
+
+	math::vec3f irr;
+
+	#if (SIMD_DENSITY_ESTIMATE == 1 && defined(__SSE__))
+	// the photons are gathered a block at a time into arrays
+	// of their (squared) distances, directions and powers, so
+	// the back-face test, filter and sum are done four-wide
+	enum {
+		BLOCK_SIZE = 64,
+	};
+
+	float dists[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float dirsX[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float dirsY[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float dirsZ[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float pwrsR[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float pwrsG[BLOCK_SIZE] __attribute__ ((aligned (16)));
+	float pwrsB[BLOCK_SIZE] __attribute__ ((aligned (16)));
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 nrmX = _mm_set1_ps(searchNrm.x);
+	const __m128 nrmY = _mm_set1_ps(searchNrm.y);
+	const __m128 nrmZ = _mm_set1_ps(searchNrm.z);
+	const __m128 invSqRadius = _mm_set1_ps(1.0f / std::max(sqRadius, 1e-12f));
+
+	__m128 sumR = zero;
+	__m128 sumG = zero;
+	__m128 sumB = zero;
+
+	for (unsigned int firstNode = 1; firstNode <= q.GetNumNodes(); firstNode += BLOCK_SIZE) {
+		const unsigned int numNodes = std::min(unsigned(BLOCK_SIZE), q.GetNumNodes() + 1 - firstNode);
+
+		unsigned int i = 0;
+
+		for (; i < numNodes; i++) {
+			const PhotonMap::Photon* photon = q.GetNode(firstNode + i);
+			const math::vec3f& pwr = photon->GetPwr();
+			const math::vec3f dir = photon->GetDirection();
+
+			dists[i] = q.GetNodeDist(firstNode + i);
+			dirsX[i] = dir.x; dirsY[i] = dir.y; dirsZ[i] = dir.z;
+			pwrsR[i] = pwr.x; pwrsG[i] = pwr.y; pwrsB[i] = pwr.z;
+		}
+
+		// pad the last group of four with powerless photons
+		for (; (i & 3) != 0; i++) {
+			dists[i] = 0.0f;
+			dirsX[i] = 0.0f; dirsY[i] = 0.0f; dirsZ[i] = 0.0f;
+			pwrsR[i] = 0.0f; pwrsG[i] = 0.0f; pwrsB[i] = 0.0f;
+		}
+
+		for (unsigned int j = 0; j < i; j += 4) {
+			// we are only dealing with Lambertian surfaces,
+			// so we can replace the BRDF evaluation with a
+			// dot-product to exclude photons that impacted
+			// the back-side of a surface
+			const __m128 dots = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_load_ps(&dirsX[j]), nrmX), _mm_mul_ps(_mm_load_ps(&dirsY[j]), nrmY)),
+				_mm_mul_ps(_mm_load_ps(&dirsZ[j]), nrmZ)
+			);
+			const __m128 wgts = _mm_and_ps(_mm_cmplt_ps(dots, zero), FilterWeights(_mm_load_ps(&dists[j]), invSqRadius));
+
+			sumR = _mm_add_ps(sumR, _mm_mul_ps(wgts, _mm_load_ps(&pwrsR[j])));
+			sumG = _mm_add_ps(sumG, _mm_mul_ps(wgts, _mm_load_ps(&pwrsG[j])));
+			sumB = _mm_add_ps(sumB, _mm_mul_ps(wgts, _mm_load_ps(&pwrsB[j])));
+		}
+	}
+
+	float sums[12] __attribute__ ((aligned (16)));
+
+	_mm_store_ps(&sums[0], sumR);
+	_mm_store_ps(&sums[4], sumG);
+	_mm_store_ps(&sums[8], sumB);
+
+	irr.x = (sums[0] + sums[1]) + (sums[ 2] + sums[ 3]);
+	irr.y = (sums[4] + sums[5]) + (sums[ 6] + sums[ 7]);
+	irr.z = (sums[8] + sums[9]) + (sums[10] + sums[11]);
+	#else
+	for (unsigned int i = 1; i <= q.GetNumNodes(); i++) {
+		const PhotonMap::Photon* photon = q.GetNode(i);
+
+		// we are only dealing with Lambertian surfaces,
+		// so we can replace the BRDF evaluation with a
+		// dot-product to exclude photons that impacted
+		// the back-side of a surface
+		if ((photon->GetDirection()).dot3D(searchNrm) < 0.0f) {
+			irr += (photon->GetPwr() * FilterWeight(q.GetNodeDist(i), sqRadius));
+		}
+	}
+	#endif
+
+	if (q.GetNumNodes() > 1) {
+		irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * sqRadius * FILTER_NORMALIZER)));
+	}
+
+	return irr;
+}
+
+
+
+// the heap for a query on nodes of type T in <buffer>, if any
+template<typename T> static typename NodeVolumeQuery<T>::HeapType* GetQueryHeap(PhotonMap::QueryBuffer* buffer) {
+	return ((buffer != NULL)? buffer->GetHeap(T(NULL)): NULL);
+}
+
+// kNN irradiance estimate from (the subtree at <rootNode> of)
+// either an in-core or a memory-mapped kd-tree
+//
+// if <seedRadius> is not NULL and holds a positive radius (that
+// of a previous, nearby query), the search first runs with just
+// that range so the traversal prunes tightly from the first node
+// on; only if it finds fewer than <searchCount> photons, it runs
+// again with the full <searchRadius> (the estimate itself is not
+// affected, since <searchCount> photons found within the seeded
+// range are the nearest ones within the full range as well); on
+// return it holds the distance of the furthest photon found, by
+// IRRADIANCE_RADIUS_SEED_FACTOR, or 0 if the full range did not
+// contain <searchCount> photons
+template<typename NodeType, typename TreeType> static math::vec3f GetTreeEstimate(
+	TreeType* tree,
+	size_t rootNode,
+	const math::vec3f& searchPos,
+	const math::vec3f& searchNrm,
+	float searchRadius,
+	unsigned int searchCount,
+	float searchEpsilon,
+	unsigned int searchNodeLimit,
+	PhotonMap::QueryBuffer* buffer,
+	float* seedRadius = NULL
+) {
+	if (seedRadius != NULL && (*seedRadius) > 0.0f && (*seedRadius) < searchRadius) {
+		NodeVolumeQuery<NodeType> q(searchCount, searchPos, searchNrm, *seedRadius, GetQueryHeap<NodeType>(buffer));
+		q.SetEpsilon(searchEpsilon);
+		q.SetMaxVisitedNodes(searchNodeLimit);
+		tree->GetNodes(&q, rootNode);
+
+		if (q.GetNumNodes() == searchCount) {
+			*seedRadius = std::min(searchRadius, sqrtf(q.GetMaxNodeDist()) * IRRADIANCE_RADIUS_SEED_FACTOR);
+			return (EstimateIrradiance(q, searchNrm, searchRadius));
+		}
+	}
+
+	NodeVolumeQuery<NodeType> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<NodeType>(buffer));
+	q.SetEpsilon(searchEpsilon);
+	q.SetMaxVisitedNodes(searchNodeLimit);
+	tree->GetNodes(&q, rootNode);
+
+	if (seedRadius != NULL) {
+		*seedRadius = (q.GetNumNodes() == searchCount)? (sqrtf(q.GetMaxNodeDist()) * IRRADIANCE_RADIUS_SEED_FACTOR): 0.0f;
+	}
+
+	return (EstimateIrradiance(q, searchNrm, searchRadius));
+}
+
+// interleaves the bits of the three 10-bit cell coordinates
+// of <pos> within the box <mins, maxs> into a 30-bit Z-order
+// (Morton) code
+static unsigned int MortonCode(const math::vec3f& pos, const math::vec3f& mins, const math::vec3f& maxs) {
+	unsigned int code = 0;
+
+	for (unsigned int axis = 0; axis < 3; axis++) {
+		const float ext = std::max(maxs[axis] - mins[axis], 1e-6f);
+		const float rel = std::max(0.0f, std::min(1.0f, (pos[axis] - mins[axis]) / ext));
+
+		// spread the ten bits of <crd> out so that two
+		// zero bits separate each consecutive pair
+		unsigned int crd = std::min(1023u, (unsigned int) (rel * 1024.0f));
+			crd = (crd | (crd << 16)) & 0x030000FF;
+			crd = (crd | (crd <<  8)) & 0x0300F00F;
+			crd = (crd | (crd <<  4)) & 0x030C30C3;
+			crd = (crd | (crd <<  2)) & 0x09249249;
+
+		code |= (crd << axis);
+	}
+
+	return code;
+}
+
+
 
 PhotonMap::Map::Map(unsigned int maxPhotons, PhotonMapType mapType): type(mapType), finalized(false) {
-	photonArray.reserve(maxPhotons + 1);
-	photonArray.push_back(Photon()); // dummy
+	// storage is only allocated as photons are added
+	photonArray.SetLimit(maxPhotons + 1);
+	photonArray.AddRecord(Photon()); // dummy
 
 	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
-	photonTree = new KDTree<PhotonMap::Photon*>(maxPhotons);
-	photonTree->SetNode(0, &photonArray[0]);
+	photonTree = NULL;
+	mappedTree = NULL;
 	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
-	photonGridCellCount = math::UVECi * powf(maxPhotons, 0.333333f);
-	photonGrid = new UniformGrid<const PhotonMap::Photon*>(photonGridCellCount);
+	photonGrid = NULL;
 	#endif
 
 	minPhotonPower = math::vec3f( FLT_MAX,  FLT_MAX,  FLT_MAX);
 	maxPhotonPower = math::vec3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	minPhotonPos = math::vec3f( FLT_MAX,  FLT_MAX,  FLT_MAX);
+	maxPhotonPos = math::vec3f(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 
 	numPhotons = 0;
+	mapCapacity = maxPhotons;
+	outOfCoreTag = 0;
 	lastScaledPhoton = 0;
 
+	searchEpsilon = 0.0f;
+	searchNodeLimit = 0;
+
 	Photon::InitDirectionTables();
 
 	std::cout << "[PhotonMap::Map::Map]" << std::endl;
@@ -40,17 +255,22 @@ PhotonMap::Map::Map(unsigned int maxPhotons, PhotonMapType mapType): type(mapTyp
 	std::cout << "\tPRECOMPUTE_IRRADIANCE_ESTIMATES: " << PRECOMPUTE_IRRADIANCE_ESTIMATES << std::endl;
 	std::cout << "\tUSE_FURTHEST_PHOTON_DIST:        " << USE_FURTHEST_PHOTON_DIST        << std::endl;
 	std::cout << "\tFILTER_RADIANCE_ESTIMATE:        " << FILTER_RADIANCE_ESTIMATE        << std::endl;
+	std::cout << "\tFILTER_KERNEL:                   " << FILTER_KERNEL                   << std::endl;
 	std::cout << "\tFILTER_CONSTANT:                 " << FILTER_CONSTANT                 << std::endl;
+	std::cout << "\tSIMD_DENSITY_ESTIMATE:           " << SIMD_DENSITY_ESTIMATE           << std::endl;
 	std::cout << "\tFILTER_NORMALIZER:               " << FILTER_NORMALIZER               << std::endl;
+	std::cout << "\tSEED_IRRADIANCE_SEARCH_RADIUS:   " << SEED_IRRADIANCE_SEARCH_RADIUS   << std::endl;
+	std::cout << "\tIRRADIANCE_RADIUS_SEED_FACTOR:   " << IRRADIANCE_RADIUS_SEED_FACTOR   << std::endl;
 	std::cout << std::endl;
 	std::cout << "\tmaxPhotons: " << maxPhotons     << std::endl;
 }
 
 PhotonMap::Map::~Map() {
-	photonArray.clear();
+	photonArray.Free();
 
 	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
 	delete photonTree;
+	delete mappedTree;
 	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
 	delete photonGrid;
 	#endif
@@ -59,15 +279,53 @@ PhotonMap::Map::~Map() {
 void PhotonMap::Map::Finalize() {
 	assert(!finalized);
 
-	if (numPhotons > 0) {
-		#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
-		photonTree->Balance(photonArray.size() == photonArray.capacity());
-		#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	// out of core, the photons are balanced in place (in their
+	// scratch file) and written straight to the tree file, which
+	// replaces them; if that fails, the tree is built in core
+	if (!outOfCoreFile.empty()) {
+		if (!MappedKDTree<PhotonMap::Photon>::Build(outOfCoreFile, &photonArray[0], numPhotons + 1, outOfCoreTag) || !MapFile(outOfCoreFile, false)) {
+			outOfCoreFile.clear();
+		}
+	}
+
+	if (mappedTree == NULL) {
+		// the photons will not move anymore, so the tree
+		// can now be made to point at them
+		photonTree = new KDTree<PhotonMap::Photon*>(numPhotons);
+
+		for (unsigned int i = 0; i <= numPhotons; i++) {
+			photonTree->SetNode(i, &photonArray[i]);
+		}
 		for (unsigned int i = 1; i <= numPhotons; i++) {
-			photonGrid->AddNode(&photonArray[i]);
+			photonTree->SetMins(&photonArray[i]);
+			photonTree->SetMaxs(&photonArray[i]);
 		}
-		#endif
 
+		if (numPhotons > 0) {
+			photonTree->Balance(true);
+
+			#if (IRRADIANCE_LOD_QUERIES == 1 && NUM_IRRADIANCE_GATHER_RAYS > 0)
+			photonTree->BuildAggregates();
+			#endif
+		}
+	}
+	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
+	// the photons will not move anymore, so the grid
+	// can now be made to point at them
+	photonGridCellCount = math::UVECi * powf(numPhotons, 0.333333f);
+	photonGrid = new UniformGrid<const PhotonMap::Photon*>(photonGridCellCount);
+
+	for (unsigned int i = 1; i <= numPhotons; i++) {
+		photonGrid->SetMins(&photonArray[i]);
+		photonGrid->SetMaxs(&photonArray[i]);
+	}
+	for (unsigned int i = 1; i <= numPhotons; i++) {
+		photonGrid->AddNode(&photonArray[i]);
+	}
+	#endif
+
+	if (numPhotons > 0) {
 		avgPhotonPower /= numPhotons;
 	}
 
@@ -78,6 +336,436 @@ void PhotonMap::Map::Finalize() {
 	std::cout << "\tminPhotonPower: " << minPhotonPower.str() << std::endl;
 	std::cout << "\tmaxPhotonPower: " << maxPhotonPower.str() << std::endl;
 	std::cout << "\tavgPhotonPower: " << avgPhotonPower.str() << std::endl;
+	std::cout << "\tout of core:    " << (!outOfCoreFile.empty()) << std::endl;
+}
+
+// the LOD query does not stop after <searchCount> photons but
+// (in the worst case) gathers everything within <searchRadius>
+// either photon by photon or via subtree aggregates; it falls
+// back to a regular query when no aggregates are available
+math::vec3f PhotonMap::Map::GetIrradianceEstimateLOD(
+	const math::vec3f& searchPos,
+	const math::vec3f& searchNrm,
+	math::vec3f searchEye,
+	float searchRadius,
+	unsigned int searchCount
+) const {
+	assert(finalized);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE && PRECOMPUTE_IRRADIANCE_ESTIMATES == 0)
+	if (numPhotons > 0 && mappedTree == NULL && photonTree->HaveAggregates()) {
+		NodeAggregateQuery<PhotonMap::Photon*> q(searchPos, searchNrm, searchEye, searchRadius, IRRADIANCE_LOD_SOLID_ANGLE);
+		photonTree->GetNodesLOD(&q, 1);
+
+		return (q.GetIrradiance());
+	}
+	#else
+	searchEye = searchEye;
+	#endif
+
+	return (GetIrradianceEstimate(searchPos, searchNrm, searchRadius, searchCount));
+}
+
+bool PhotonMap::Map::SaveToFile(const std::string& fileName, uint64_t fileTag) const {
+	assert(finalized);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (mappedTree != NULL) {
+		// already backed by a file (not necessarily <fileName>)
+		return false;
+	}
+
+	if (!MappedKDTree<PhotonMap::Photon>::Write(fileName, *photonTree, fileTag)) {
+		return false;
+	}
+
+	std::cout << "[PhotonMap::Map::SaveToFile]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << numPhotons << " photons)" << std::endl;
+	return true;
+	#else
+	fileTag = fileTag;
+
+	std::cout << "[PhotonMap::Map::SaveToFile] only supported for PM_DATASTRUCT_TREE (" << fileName << ")" << std::endl;
+	return false;
+	#endif
+}
+
+bool PhotonMap::Map::SetOutOfCore(const std::string& fileName, uint64_t fileTag) {
+	assert(!finalized);
+	assert(numPhotons == 0);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE && PRECOMPUTE_IRRADIANCE_ESTIMATES == 0)
+	char scratchName[32];
+	snprintf(scratchName, sizeof(scratchName), ".photons.%d", int(getpid()));
+
+	if (!photonArray.MapFile(fileName + scratchName)) {
+		std::cout << "[PhotonMap::Map::SetOutOfCore] cannot create \"" << fileName << scratchName << "\"" << std::endl;
+		return false;
+	}
+
+	outOfCoreFile = fileName;
+	outOfCoreTag = fileTag;
+
+	std::cout << "[PhotonMap::Map::SetOutOfCore]" << std::endl;
+	std::cout << "\tfile: " << fileName << std::endl;
+	return true;
+	#else
+	fileTag = fileTag;
+
+	std::cout << "[PhotonMap::Map::SetOutOfCore] only supported for PM_DATASTRUCT_TREE without PRECOMPUTE_IRRADIANCE_ESTIMATES (" << fileName << ")" << std::endl;
+	return false;
+	#endif
+}
+
+bool PhotonMap::Map::LoadFromFile(const std::string& fileName, uint64_t fileTag) {
+	return (AttachFile(fileName, fileTag, false));
+}
+
+bool PhotonMap::Map::LoadFromSharedMemory(uint64_t fileTag, bool persistent) {
+	return (AttachFile(GetSharedMemoryName(fileTag), fileTag, true, persistent));
+}
+
+bool PhotonMap::Map::MoveToSharedMemory(uint64_t fileTag, bool persistent) {
+	assert(finalized);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (mappedTree != NULL) {
+		return false;
+	}
+
+	const std::string name = GetSharedMemoryName(fileTag);
+
+	// fails if another process published the same map first
+	if (!MappedKDTree<PhotonMap::Photon>::Write(name, *photonTree, fileTag, true)) {
+		return false;
+	}
+
+	std::cout << "[PhotonMap::Map::MoveToSharedMemory]" << std::endl;
+	std::cout << "\tname: " << name << " (" << numPhotons << " photons)" << std::endl;
+	std::cout << "\tpersistent: " << persistent << std::endl;
+
+	return (MapFile(name, true, persistent));
+	#else
+	persistent = persistent;
+
+	std::cout << "[PhotonMap::Map::MoveToSharedMemory] only supported for PM_DATASTRUCT_TREE (" << fileTag << ")" << std::endl;
+	return false;
+	#endif
+}
+
+std::string PhotonMap::Map::GetSharedMemoryName(uint64_t fileTag) {
+	char name[64];
+	snprintf(name, sizeof(name), "/kiran-photonmap-%016llx", (unsigned long long) fileTag);
+	return name;
+}
+
+bool PhotonMap::Map::AttachFile(const std::string& fileName, uint64_t fileTag, bool shared, bool persistent) {
+	assert(!finalized);
+	assert(numPhotons == 0);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	MappedKDTree<PhotonMap::Photon>::FileHeader header;
+
+	if (!MappedKDTree<PhotonMap::Photon>::ReadHeader(fileName, &header, shared)) {
+		return false;
+	}
+
+	if (header.tag != fileTag) {
+		std::cout << "[PhotonMap::Map::AttachFile] \"" << fileName << "\" is stale (scene changed)" << std::endl;
+		return false;
+	}
+
+	if (!MapFile(fileName, shared, persistent)) {
+		return false;
+	}
+
+	numPhotons = mappedTree->GetNumNodes() - 1;
+	minPhotonPos = math::vec3f(header.mins[0], header.mins[1], header.mins[2]);
+	maxPhotonPos = math::vec3f(header.maxs[0], header.maxs[1], header.maxs[2]);
+	// loaded photons are already scaled
+	lastScaledPhoton = numPhotons;
+	finalized = true;
+
+	std::cout << "[PhotonMap::Map::AttachFile]" << std::endl;
+	std::cout << "\tstored photons: " << numPhotons << std::endl;
+	return true;
+	#else
+	fileTag = fileTag;
+	shared = shared;
+	persistent = persistent;
+
+	std::cout << "[PhotonMap::Map::AttachFile] only supported for PM_DATASTRUCT_TREE (" << fileName << ")" << std::endl;
+	return false;
+	#endif
+}
+
+#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+bool PhotonMap::Map::MapFile(const std::string& fileName, bool shared, bool persistent) {
+	mappedTree = new MappedKDTree<PhotonMap::Photon>();
+
+	if (!mappedTree->Map(fileName, shared, persistent)) {
+		delete mappedTree;
+		mappedTree = NULL;
+		return false;
+	}
+
+	// the tree holds pointers into the array, so free both
+	delete photonTree;
+	photonTree = NULL;
+	photonArray.Free();
+
+	std::cout << "[PhotonMap::Map::MapFile]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << (mappedTree->GetFileSize() >> 20) << " MB)" << std::endl;
+	return true;
+}
+#endif
+
+// header of the flat photon files written by SavePhotons; it is
+// followed by the group records and then the photons, group by
+// group
+struct PhotonsFileHeader {
+	enum {
+		FILE_VERSION = 2,
+	};
+
+	char magic[8];
+	uint64_t tag;
+	uint64_t groupTag;
+
+	unsigned int version;
+	unsigned int recordSize;
+	unsigned int groupRecordSize;
+	unsigned int numGroups;
+	unsigned int numPhotons;
+};
+
+static bool ReadPhotonsHeader(int fd, PhotonsFileHeader* header) {
+	if (read(fd, header, sizeof(PhotonsFileHeader)) != sizeof(PhotonsFileHeader)) {
+		return false;
+	}
+
+	if (memcmp(header->magic, "KIRANPHL", sizeof(header->magic)) != 0 || header->version != PhotonsFileHeader::FILE_VERSION) {
+		return false;
+	}
+
+	return (header->recordSize == sizeof(PhotonMap::Photon) && header->groupRecordSize == sizeof(PhotonMap::PhotonGroup));
+}
+
+// reads the group records following the header, and checks
+// that they account for exactly the photons in the file
+static bool ReadPhotonGroups(int fd, const PhotonsFileHeader& header, std::vector<PhotonMap::PhotonGroup>* groups) {
+	groups->resize(header.numGroups);
+
+	const size_t dataSize = header.numGroups * sizeof(PhotonMap::PhotonGroup);
+
+	if (dataSize > 0 && read(fd, &(*groups)[0], dataSize) != ssize_t(dataSize)) {
+		return false;
+	}
+
+	unsigned int numPhotons = 0;
+
+	for (size_t i = 0; i < groups->size(); i++) {
+		numPhotons += (*groups)[i].numPhotons;
+	}
+
+	return (groups->empty() || numPhotons == header.numPhotons);
+}
+
+bool PhotonMap::Map::SavePhotons(
+	const std::string& fileName,
+	uint64_t fileTag,
+	uint64_t groupTag,
+	unsigned int firstPhoton,
+	unsigned int lastPhoton,
+	const std::vector<PhotonGroup>& groups
+) const {
+	assert(!finalized);
+	assert(firstPhoton >= 1 && lastPhoton <= numPhotons);
+
+	// written under a temporary name and renamed over <fileName>
+	// when complete, so a crash never leaves a truncated file
+	char tempSuffix[32];
+	snprintf(tempSuffix, sizeof(tempSuffix), ".tmp.%d", int(getpid()));
+
+	const std::string tempName = fileName + tempSuffix;
+	const int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		std::cout << "[PhotonMap::Map::SavePhotons] cannot create \"" << fileName << "\"" << std::endl;
+		return false;
+	}
+
+	PhotonsFileHeader header;
+	memset(&header, 0, sizeof(PhotonsFileHeader));
+	memcpy(header.magic, "KIRANPHL", sizeof(header.magic));
+
+	header.tag             = fileTag;
+	header.groupTag        = groupTag;
+	header.version         = PhotonsFileHeader::FILE_VERSION;
+	header.recordSize      = sizeof(PhotonMap::Photon);
+	header.groupRecordSize = sizeof(PhotonMap::PhotonGroup);
+	header.numGroups       = groups.size();
+	header.numPhotons      = (lastPhoton >= firstPhoton)? (lastPhoton - firstPhoton + 1): 0;
+
+	const size_t groupsSize = header.numGroups * sizeof(PhotonMap::PhotonGroup);
+	const size_t dataSize = header.numPhotons * sizeof(PhotonMap::Photon);
+
+	bool ret = (write(fd, &header, sizeof(PhotonsFileHeader)) == sizeof(PhotonsFileHeader));
+	ret = ret && (groupsSize == 0 || write(fd, &groups[0], groupsSize) == ssize_t(groupsSize));
+	ret = ret && (dataSize == 0 || write(fd, &photonArray[firstPhoton], dataSize) == ssize_t(dataSize));
+	ret = (close(fd) == 0) && ret;
+	ret = ret && (rename(tempName.c_str(), fileName.c_str()) == 0);
+
+	if (!ret) {
+		std::cout << "[PhotonMap::Map::SavePhotons] cannot write \"" << fileName << "\"" << std::endl;
+		unlink(tempName.c_str());
+		return false;
+	}
+
+	std::cout << "[PhotonMap::Map::SavePhotons]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << header.numPhotons << " photons in " << header.numGroups << " groups)" << std::endl;
+	return true;
+}
+
+bool PhotonMap::Map::LoadPhotons(
+	const std::string& fileName,
+	uint64_t groupTag,
+	const std::vector<float>* groupScales,
+	std::vector<PhotonGroup>* groups
+) {
+	assert(!finalized);
+
+	const int fd = open(fileName.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	PhotonsFileHeader header;
+	std::vector<PhotonMap::PhotonGroup> fileGroups;
+
+	if (!ReadPhotonsHeader(fd, &header) || header.groupTag != groupTag || !ReadPhotonGroups(fd, header, &fileGroups)) {
+		std::cout << "[PhotonMap::Map::LoadPhotons] \"" << fileName << "\" is invalid or stale" << std::endl;
+		close(fd);
+		return false;
+	}
+
+	std::vector<PhotonMap::Photon> photons(header.numPhotons);
+
+	const size_t dataSize = header.numPhotons * sizeof(PhotonMap::Photon);
+	const bool ret = (dataSize == 0 || read(fd, &photons[0], dataSize) == ssize_t(dataSize));
+
+	close(fd);
+
+	if (!ret) {
+		std::cout << "[PhotonMap::Map::LoadPhotons] \"" << fileName << "\" is truncated" << std::endl;
+		return false;
+	}
+
+	// a file without groups holds a single one
+	if (fileGroups.empty()) {
+		fileGroups.push_back(PhotonGroup());
+		fileGroups.back().numPhotons = header.numPhotons;
+	}
+
+	unsigned int numLoaded = 0;
+
+	for (size_t i = 0, groupPhoton = 0; i < fileGroups.size(); groupPhoton += fileGroups[i++].numPhotons) {
+		PhotonGroup group = fileGroups[i];
+
+		float groupScale = 1.0f;
+
+		if (groupScales != NULL) {
+			groupScale = (group.groupNum < groupScales->size())? (*groupScales)[group.groupNum]: 0.0f;
+		}
+
+		if (groupScale <= 0.0f) {
+			continue;
+		}
+
+		unsigned int numAdded = 0;
+
+		for (; numAdded < group.numPhotons; numAdded++) {
+			PhotonMap::Photon* photon = &photons[groupPhoton + numAdded];
+
+			if (groupScale != 1.0f) {
+				photon->SetPwr(photon->GetPwr() * groupScale);
+			}
+
+			if (!AddPhoton(photon)) {
+				break;
+			}
+		}
+
+		group.numPhotons = numAdded;
+		group.powerScale *= groupScale;
+		numLoaded += numAdded;
+
+		if (groups != NULL) {
+			groups->push_back(group);
+		}
+	}
+
+	// loaded photons are already scaled
+	lastScaledPhoton = numPhotons;
+
+	std::cout << "[PhotonMap::Map::LoadPhotons]" << std::endl;
+	std::cout << "\tfile: " << fileName << " (" << numLoaded << " of " << header.numPhotons << " photons)" << std::endl;
+	return true;
+}
+
+bool PhotonMap::Map::LoadPhotonGroups(const std::string& fileName, uint64_t groupTag, std::vector<PhotonGroup>* groups) {
+	const int fd = open(fileName.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	PhotonsFileHeader header;
+
+	const bool ret = (ReadPhotonsHeader(fd, &header) && header.groupTag == groupTag && ReadPhotonGroups(fd, header, groups));
+
+	close(fd);
+	return ret;
+}
+
+bool PhotonMap::Map::HavePhotons(const std::string& fileName, uint64_t fileTag) {
+	const int fd = open(fileName.c_str(), O_RDONLY);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	PhotonsFileHeader header;
+
+	const bool ret = (ReadPhotonsHeader(fd, &header) && header.tag == fileTag);
+
+	close(fd);
+	return ret;
+}
+
+void PhotonMap::Map::PrintQueryStatistics() const {
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (mappedTree == NULL) {
+		return;
+	}
+
+	// note: faults are counted for the whole process, so those
+	// caused by anything else in the meantime are included too
+	long minFaults = 0;
+	long majFaults = 0;
+
+	mappedTree->GetPageFaults(&minFaults, &majFaults);
+
+	const double kiloQueries = std::max(1.0, mappedTree->GetNumQueries() / 1000.0);
+
+	std::cout << "[PhotonMap::Map::PrintQueryStatistics]" << std::endl;
+	std::cout << "\tqueries:                     " << mappedTree->GetNumQueries() << std::endl;
+	std::cout << "\tminor page-faults:           " << minFaults << std::endl;
+	std::cout << "\tmajor page-faults:           " << majFaults << std::endl;
+	std::cout << "\tminor faults / 1000 queries: " << (minFaults / kiloQueries) << std::endl;
+	std::cout << "\tmajor faults / 1000 queries: " << (majFaults / kiloQueries) << std::endl;
+	#endif
 }
 
 #if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
@@ -93,7 +781,7 @@ void PhotonMap::Map::PrecomputeIrradianceEstimates(
 		static boost::mutex progressMutex;
 
 		const unsigned int photonsPerThread = numPhotons / numThreads;
-		const unsigned int photonsRemaining = numPhotons % photonsPerThread;
+		const unsigned int photonsRemaining = numPhotons % numThreads;
 
 		const unsigned int photonIdxL = (photonsPerThread * threadNum) + 1;
 		const unsigned int photonIdxR =
@@ -104,9 +792,11 @@ void PhotonMap::Map::PrecomputeIrradianceEstimates(
 		unsigned int prevProgress = 0;
 		unsigned int currProgress = 0;
 
+		QueryBuffer buffer;
+
 		for (unsigned int photonIdx = photonIdxL; photonIdx <= photonIdxR; photonIdx++) {
 			Photon* p = &photonArray[photonIdx];
-				p->SetIrr(GetIrradianceEstimate(p->GetPos(), p->GetNrm(), searchRadius, searchCount, true));
+				p->SetIrr(GetIrradianceEstimate(p->GetPos(), p->GetNrm(), searchRadius, searchCount, true, &buffer));
 
 			currProgress = ((photonIdx - photonIdxL) / photonRange) * 100;
 
@@ -125,25 +815,144 @@ void PhotonMap::Map::PrecomputeIrradianceEstimates(
 }
 #endif
 
+#if (BENCHMARK_PHOTON_MAP_QUERIES == 1)
+// compares the configured (approximate) kd-tree search against
+// an exact kNN search at a subset of the stored photon positions
+// and reports the number of visited nodes and irradiance errors
+void PhotonMap::Map::BenchmarkQueries(float searchRadius, unsigned int searchCount) const {
+	assert(finalized);
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (numPhotons == 0 || mappedTree != NULL) {
+		return;
+	}
+
+	const unsigned int numQueries = std::min(numPhotons, (unsigned int) BENCHMARK_PHOTON_MAP_NUM_QUERIES);
+	const unsigned int queryStride = numPhotons / numQueries;
+
+	std::vector<math::vec3f> exactEstimates(numQueries);
+	std::vector<math::vec3f> approxEstimates(numQueries);
+
+	unsigned long exactVisitedNodes = 0;
+	unsigned long approxVisitedNodes = 0;
+
+	Benchmark exactBenchmark("exact");
+	Benchmark approxBenchmark("approximate");
+
+	for (unsigned int n = 0; n < 2; n++) {
+		const bool exact = (n == 0);
+
+		Benchmark& benchmark = (exact)? exactBenchmark: approxBenchmark;
+		benchmark.Start();
+
+		for (unsigned int i = 0; i < numQueries; i++) {
+			const Photon* p = &photonArray[1 + i * queryStride];
+
+			#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
+			const math::vec3f& queryNrm = p->GetNrm();
+			#else
+			const math::vec3f  queryNrm = -(p->GetDirection());
+			#endif
+
+			NodeVolumeQuery<PhotonMap::Photon*> q(searchCount, p->GetPos(), queryNrm, searchRadius);
+
+			if (!exact) {
+				q.SetEpsilon(searchEpsilon);
+				q.SetMaxVisitedNodes(searchNodeLimit);
+			}
+
+			photonTree->GetNodes(&q, 1);
+
+			if (exact) {
+				exactEstimates[i] = EstimateIrradiance(q, queryNrm, searchRadius);
+				exactVisitedNodes += q.GetNumVisitedNodes();
+			} else {
+				approxEstimates[i] = EstimateIrradiance(q, queryNrm, searchRadius);
+				approxVisitedNodes += q.GetNumVisitedNodes();
+			}
+		}
+
+		benchmark.Stop();
+	}
+
+	double sumSqrErr = 0.0;
+	double sumSqrRef = 0.0;
+	double sumRelErr = 0.0;
+	double maxRelErr = 0.0;
+
+	for (unsigned int i = 0; i < numQueries; i++) {
+		const float sqrErr = (approxEstimates[i] - exactEstimates[i]).sqLen3D();
+		const float sqrRef = (exactEstimates[i]).sqLen3D();
+
+		sumSqrErr += sqrErr;
+		sumSqrRef += sqrRef;
+
+		if (sqrRef > 0.0f) {
+			const double relErr = sqrt(sqrErr / sqrRef);
+
+			sumRelErr += relErr;
+			maxRelErr = std::max(maxRelErr, relErr);
+		}
+	}
+
+	std::cout << "[PhotonMap::Map::BenchmarkQueries]" << std::endl;
+	std::cout << "\tqueries:              " << numQueries << " (k=" << searchCount << ", r=" << searchRadius << ")" << std::endl;
+	std::cout << "\tepsilon:              " << searchEpsilon << std::endl;
+	std::cout << "\tnode-limit:           " << searchNodeLimit << std::endl;
+	std::cout << "\texact  nodes/query:   " << (exactVisitedNodes / double(numQueries)) << std::endl;
+	std::cout << "\tapprox nodes/query:   " << (approxVisitedNodes / double(numQueries)) << std::endl;
+	std::cout << "\texact  time:          " << exactBenchmark.GetElapsedTime() << "ms" << std::endl;
+	std::cout << "\tapprox time:          " << approxBenchmark.GetElapsedTime() << "ms" << std::endl;
+	std::cout << "\tRMS relative error:   " << ((sumSqrRef > 0.0)? sqrt(sumSqrErr / sumSqrRef): 0.0) << std::endl;
+	std::cout << "\tmean relative error:  " << (sumRelErr / numQueries) << std::endl;
+	std::cout << "\tmax relative error:   " << maxRelErr << std::endl;
+	#else
+	searchRadius = searchRadius;
+	searchCount = searchCount;
+	#endif
+}
+#endif
+
+// shared by AddPhoton and AddPhotons
+static boost::mutex addPhotonMutex;
+
 bool PhotonMap::Map::AddPhoton(PhotonMap::Photon* p) {
-	static boost::mutex addPhotonMutex;
+	boost::mutex::scoped_lock lock(addPhotonMutex);
+	return (InsertPhoton(p));
+}
 
+unsigned int PhotonMap::Map::AddPhotons(const std::vector<PhotonMap::Photon>& photons) {
 	boost::mutex::scoped_lock lock(addPhotonMutex);
 
-	if (photonArray.size() >= photonArray.capacity()) {
-		return false;
+	unsigned int numAdded = 0;
+
+	while (numAdded < photons.size() && InsertPhoton(&photons[numAdded])) {
+		numAdded++;
 	}
 
-	photonArray.push_back(*p);
+	return numAdded;
+}
 
-	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
-	photonTree->SetNode(photonArray.size() - 1, &photonArray[photonArray.size() - 1]);
-	photonTree->SetMins(p);
-	photonTree->SetMaxs(p);
-	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
-	photonGrid->SetMins(p);
-	photonGrid->SetMaxs(p);
-	#endif
+unsigned int PhotonMap::Map::MergePhotons(const Map& map) {
+	boost::mutex::scoped_lock lock(addPhotonMutex);
+
+	// grow by exactly what is merged (eg. one adaptive round)
+	photonArray.Reserve(std::min(photonArray.GetSize() + map.numPhotons, size_t(mapCapacity) + 1));
+
+	unsigned int numAdded = 0;
+
+	while (numAdded < map.numPhotons && InsertPhoton(&map.photonArray[numAdded + 1])) {
+		numAdded++;
+	}
+
+	return numAdded;
+}
+
+bool PhotonMap::Map::InsertPhoton(const PhotonMap::Photon* p) {
+	// fails once the map is full
+	if (!photonArray.AddRecord(*p)) {
+		return false;
+	}
 
 	minPhotonPower.x = std::min(minPhotonPower.x, (p->GetPwr()).x);
 	minPhotonPower.y = std::min(minPhotonPower.y, (p->GetPwr()).y);
@@ -153,7 +962,14 @@ bool PhotonMap::Map::AddPhoton(PhotonMap::Photon* p) {
 	maxPhotonPower.z = std::max(maxPhotonPower.z, (p->GetPwr()).z);
 	avgPhotonPower += p->GetPwr();
 
-	numPhotons = photonArray.size() - 1;
+	minPhotonPos.x = std::min(minPhotonPos.x, (p->GetPos()).x);
+	minPhotonPos.y = std::min(minPhotonPos.y, (p->GetPos()).y);
+	minPhotonPos.z = std::min(minPhotonPos.z, (p->GetPos()).z);
+	maxPhotonPos.x = std::max(maxPhotonPos.x, (p->GetPos()).x);
+	maxPhotonPos.y = std::max(maxPhotonPos.y, (p->GetPos()).y);
+	maxPhotonPos.z = std::max(maxPhotonPos.z, (p->GetPos()).z);
+
+	numPhotons = photonArray.GetSize() - 1;
 	return true;
 }
 
@@ -175,7 +991,8 @@ void PhotonMap::Map::ScalePhotonPower(const math::vec3f& scale) {
 math::vec3f PhotonMap::Map::GetIrradianceEstimateTree(
 	const math::vec3f& searchPos, const math::vec3f& searchNrm,
 	float searchRadius, unsigned int searchCount,
-	bool precompute
+	bool precompute,
+	PhotonMap::QueryBuffer* buffer
 ) const {
 	math::vec3f irr;
 
@@ -187,45 +1004,33 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateTree(
 	{
 		// assemble volume query structure with
 		// the <count> photons nearest to <p>
-		NodeVolumeQuery<PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius);
-		photonTree->GetNodes(&q, 1);
-
-		for (unsigned int i = 1; i <= q.GetNumNodes(); i++) {
-			const Photon* photon = q.GetNode(i);
-
-			// we are only dealing with Lambertian surfaces,
-			// so we can replace the BRDF evaluation with a
-			// dot-product to exclude photons that impacted
-			// the back-side of a surface
-			if ((photon->GetDirection()).dot3D(searchNrm) < 0.0f) {
-				#if (FILTER_RADIANCE_ESTIMATE == 1)
-				const float dst = (photon->GetPos() - searchPos).sqLen3D();
-				const float wgt = 1.0f - (sqrtf(dst) / (FILTER_CONSTANT * searchRadius));
-				irr += (photon->GetPwr() * wgt);
-				#else
-				irr += (photon->GetPwr());
-				#endif
-			}
-		}
-
-		if (q.GetNumNodes() > 1) {
-			#if (USE_FURTHEST_PHOTON_DIST == 1)
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * q.GetMaxNodeDist() * FILTER_NORMALIZER)));
-			#else
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * searchRadius * searchRadius * FILTER_NORMALIZER)));
-			#endif
+		if (mappedTree != NULL) {
+			mappedTree->CountQuery();
+			irr = GetTreeEstimate<const PhotonMap::Photon*>(mappedTree, 1, searchPos, searchNrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer);
+		} else {
+			irr = GetTreeEstimate<PhotonMap::Photon*>(photonTree, 1, searchPos, searchNrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer);
 		}
 	}
 	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
 	else {
 		// get the single nearest photon
-		NodeVolumeQuery<PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius);
-		photonTree->GetNodes(&q, 1);
+		if (mappedTree != NULL) {
+			NodeVolumeQuery<const PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
+			mappedTree->CountQuery();
+			mappedTree->GetNodes(&q, 1);
 
-		assert(q.GetNumNodes() <= 1);
+			if (q.GetNumNodes() == 1) {
+				irr = (q.GetNode(1))->GetIrr();
+			}
+		} else {
+			NodeVolumeQuery<PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius, GetQueryHeap<PhotonMap::Photon*>(buffer));
+			photonTree->GetNodes(&q, 1);
 
-		if (q.GetNumNodes() == 1) {
-			irr = (q.GetNode(1))->GetIrr();
+			assert(q.GetNumNodes() <= 1);
+
+			if (q.GetNumNodes() == 1) {
+				irr = (q.GetNode(1))->GetIrr();
+			}
 		}
 	}
 	#endif
@@ -240,7 +1045,8 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateTree(
 math::vec3f PhotonMap::Map::GetIrradianceEstimateGrid(
 	const math::vec3f& searchPos, const math::vec3f& searchNrm,
 	float searchRadius, unsigned int searchCount,
-	bool precompute
+	bool precompute,
+	PhotonMap::QueryBuffer* buffer
 ) const {
 	math::vec3f irr;
 
@@ -261,35 +1067,14 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateGrid(
 		*/
 		#endif
 
-		NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius);
+		NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
 		photonGrid->GetNodes(&q);
 
-		for (unsigned int i = 1; i <= q.GetNumNodes(); i++) {
-			const Photon* photon = q.GetNode(i);
-
-			if ((photon->GetDirection()).dot3D(searchNrm) < 0.0f) {
-				#if (FILTER_RADIANCE_ESTIMATE == 1)
-				const float dst = (photon->GetPos() - searchPos).sqLen3D();
-				const float wgt = 1.0f - (sqrtf(dst) / (FILTER_CONSTANT * searchRadius));
-				irr += (photon->GetPwr() * wgt);
-				#else
-				irr += (photon->GetPwr());
-				#endif
-			}
-		}
-
-		if (q.GetNumNodes() > 1) {
-			#if (USE_FURTHEST_PHOTON_DIST == 1)
-			// use the distance of the furthest photon
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * q.GetMaxNodeDist() * FILTER_NORMALIZER)));
-			#else
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * searchRadius * searchRadius * FILTER_NORMALIZER)));
-			#endif
-		}
+		irr = EstimateIrradiance(q, searchNrm, searchRadius);
 	}
 	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
 	else {
-		NodeVolumeQuery<const PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius);
+		NodeVolumeQuery<const PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
 		photonGrid->GetNodes(&q);
 
 		assert(q.GetNumNodes() <= 1);
@@ -310,7 +1095,8 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateGrid(
 math::vec3f PhotonMap::Map::GetIrradianceEstimateFlat(
 	const math::vec3f& searchPos, const math::vec3f& searchNrm,
 	float searchRadius, unsigned int searchCount,
-	bool precompute
+	bool precompute,
+	PhotonMap::QueryBuffer* buffer
 ) const {
 	math::vec3f irr;
 
@@ -320,38 +1106,18 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateFlat(
 	if (precompute)
 	#endif
 	{
-		NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius);
+		NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
 
 		// examine all photons (unavoidable without spatial partitioning)
 		for (unsigned int i = 1; i <= numPhotons; i++) {
 			q.AddNode(&photonArray[i]);
 		}
 
-		for (unsigned int i = 1; i <= q.GetNumNodes(); i++) {
-			const Photon* photon = q.GetNode(i);
-
-			if ((photon->GetDirection()).dot3D(searchNrm) < 0.0f) {
-				#if (FILTER_RADIANCE_ESTIMATE == 1)
-				const float dst = (photon->GetPos() - searchPos).sqLen3D();
-				const float wgt = 1.0f - (sqrtf(dst) / (FILTER_CONSTANT * searchRadius));
-				irr += (photon->GetPwr() * wgt);
-				#else
-				irr += (photon->GetPwr());
-				#endif
-			}
-		}
-
-		if (q.GetNumNodes() > 1) {
-			#if (USE_FURTHEST_PHOTON_DIST == 1)
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * q.GetMaxNodeDist() * FILTER_NORMALIZER)));
-			#else
-			irr *= (math::vec3f(1.0f, 1.0f, 1.0f) * (1.0f / (M_PI * searchRadius * searchRadius * FILTER_NORMALIZER)));
-			#endif
-		}
+		irr = EstimateIrradiance(q, searchNrm, searchRadius);
 	}
 	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
 	else {
-		NodeVolumeQuery<const PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius);
+		NodeVolumeQuery<const PhotonMap::Photon*> q(1, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
 
 		for (unsigned int i = 1; i <= numPhotons; i++) {
 			q.AddNode(&photonArray[i]);
@@ -377,7 +1143,8 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimateFlat(
 math::vec3f PhotonMap::Map::GetIrradianceEstimate(
 	const math::vec3f& searchPos, const math::vec3f& searchNrm,
 	float searchRadius, unsigned int searchCount,
-	bool precompute
+	bool precompute,
+	PhotonMap::QueryBuffer* buffer
 ) const {
 	if (numPhotons == 0) {
 		return math::NVECf;
@@ -386,16 +1153,246 @@ math::vec3f PhotonMap::Map::GetIrradianceEstimate(
 	assert(searchRadius > 0.0f && searchCount > 0);
 
 	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
-	return (GetIrradianceEstimateTree(searchPos, searchNrm, searchRadius, searchCount, precompute));
+	return (GetIrradianceEstimateTree(searchPos, searchNrm, searchRadius, searchCount, precompute, buffer));
 	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
-	return (GetIrradianceEstimateGrid(searchPos, searchNrm, searchRadius, searchCount, precompute));
+	return (GetIrradianceEstimateGrid(searchPos, searchNrm, searchRadius, searchCount, precompute, buffer));
 	#elif (PM_DATASTRUCT == PM_DATASTRUCT_FLAT)
-	return (GetIrradianceEstimateFlat(searchPos, searchNrm, searchRadius, searchCount, precompute));
+	return (GetIrradianceEstimateFlat(searchPos, searchNrm, searchRadius, searchCount, precompute, buffer));
 	#else
 	return math::NVECf;
 	#endif
 }
 
+math::vec3f PhotonMap::Map::GetSeededIrradianceEstimate(
+	const math::vec3f& searchPos, const math::vec3f& searchNrm,
+	float searchRadius, unsigned int searchCount,
+	float* seedRadius,
+	PhotonMap::QueryBuffer* buffer
+) const {
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE && PRECOMPUTE_IRRADIANCE_ESTIMATES == 0 && SEED_IRRADIANCE_SEARCH_RADIUS == 1)
+	if (numPhotons == 0) {
+		return math::NVECf;
+	}
+
+	assert(searchRadius > 0.0f && searchCount > 0);
+
+	if (mappedTree != NULL) {
+		mappedTree->CountQuery();
+		return (GetTreeEstimate<const PhotonMap::Photon*>(mappedTree, 1, searchPos, searchNrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer, seedRadius));
+	}
+
+	return (GetTreeEstimate<PhotonMap::Photon*>(photonTree, 1, searchPos, searchNrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer, seedRadius));
+	#else
+	seedRadius = seedRadius;
+	return (GetIrradianceEstimate(searchPos, searchNrm, searchRadius, searchCount, false, buffer));
+	#endif
+}
+
+// fraction of the photons found by <q> that are shadow photons
+// (which carry no power), or a negative value if there are none
+template<typename T> static float EstimateShadowFraction(const NodeVolumeQuery<T>& q, const math::vec3f& searchNrm, unsigned int minCount) {
+	unsigned int numPhotons = 0;
+	unsigned int numShadowPhotons = 0;
+
+	for (unsigned int i = 1; i <= q.GetNumNodes(); i++) {
+		const PhotonMap::Photon* photon = q.GetNode(i);
+
+		// ignore photons that struck the back-side of a surface
+		if ((photon->GetDirection()).dot3D(searchNrm) >= 0.0f) {
+			continue;
+		}
+
+		numPhotons += 1;
+		numShadowPhotons += ((photon->GetPwr()).sqLen3D() <= 0.0f);
+	}
+
+	// too few photons to tell a fully lit (or occluded) region
+	// from one that just happens to have no photons of the other
+	// kind nearby, eg. at the sparse edge of a penumbra
+	if (numPhotons == 0 || numPhotons < minCount) {
+		return -1.0f;
+	}
+
+	return (numShadowPhotons / float(numPhotons));
+}
+
+// classify <searchPos> with respect to the light that emitted
+// the photons of this (direct + shadow) map: 0 means fully lit,
+// 1 fully occluded, anything in between a penumbra region and a
+// negative value that nothing (reliable) is known about it
+float PhotonMap::Map::GetShadowFraction(
+	const math::vec3f& searchPos,
+	const math::vec3f& searchNrm,
+	float searchRadius,
+	unsigned int searchCount,
+	unsigned int minCount,
+	PhotonMap::QueryBuffer* buffer
+) const {
+	assert(finalized);
+
+	if (numPhotons == 0) {
+		return -1.0f;
+	}
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (mappedTree != NULL) {
+		NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
+		mappedTree->CountQuery();
+		mappedTree->GetNodes(&q, 1);
+
+		return (EstimateShadowFraction(q, searchNrm, minCount));
+	}
+
+	NodeVolumeQuery<PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<PhotonMap::Photon*>(buffer));
+	photonTree->GetNodes(&q, 1);
+	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
+	NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
+	photonGrid->GetNodes(&q);
+	#else
+	NodeVolumeQuery<const PhotonMap::Photon*> q(searchCount, searchPos, searchNrm, searchRadius, GetQueryHeap<const PhotonMap::Photon*>(buffer));
+
+	for (unsigned int i = 1; i <= numPhotons; i++) {
+		q.AddNode(&photonArray[i]);
+	}
+	#endif
+
+	return (EstimateShadowFraction(q, searchNrm, minCount));
+}
+
+// return the summed power of (and count) all photons within
+// <searchRadius> of <searchPos>; unlike an irradiance estimate
+// this is not normalized by the search-area, the caller (eg.
+// a progressive estimate) accumulates the raw flux over maps
+math::vec3f PhotonMap::Map::GetPhotonFlux(
+	const math::vec3f& searchPos,
+	const math::vec3f& searchNrm,
+	float searchRadius,
+	unsigned int* searchCount
+) const {
+	assert(finalized);
+
+	*searchCount = 0;
+
+	if (numPhotons == 0) {
+		return math::NVECf;
+	}
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+	if (mappedTree != NULL) {
+		NodeRangeQuery<const PhotonMap::Photon*> q(searchPos, searchNrm, searchRadius);
+		mappedTree->CountQuery();
+		mappedTree->GetNodes(&q, 1);
+
+		*searchCount = q.GetNumNodes();
+		return (q.GetPwr());
+	}
+
+	NodeRangeQuery<PhotonMap::Photon*> q(searchPos, searchNrm, searchRadius);
+	photonTree->GetNodes(&q, 1);
+	#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
+	NodeRangeQuery<const PhotonMap::Photon*> q(searchPos, searchNrm, searchRadius);
+	photonGrid->GetNodes(&q);
+	#else
+	NodeRangeQuery<const PhotonMap::Photon*> q(searchPos, searchNrm, searchRadius);
+
+	for (unsigned int i = 1; i <= numPhotons; i++) {
+		q.AddNode(&photonArray[i]);
+	}
+	#endif
+
+	*searchCount = q.GetNumNodes();
+	return (q.GetPwr());
+}
+
+
+
+
+
+
+// resolve a batch of queries (typically all shading points
+// of one image tile) together: sorting them along a Z-order
+// curve makes consecutive searches walk mostly the same kd-
+// tree paths and touch the same photons, and the part of the
+// tree-descent that is common to the whole batch (as bounded
+// by its search-box) is only performed once
+void PhotonMap::Map::GetIrradianceEstimates(
+	std::vector<IrradianceQuery>& queries,
+	float searchRadius,
+	unsigned int searchCount,
+	PhotonMap::QueryBuffer* buffer
+) const {
+	if (queries.empty()) {
+		return;
+	}
+
+	if (numPhotons == 0) {
+		for (size_t i = 0; i < queries.size(); i++) {
+			queries[i].irr = math::NVECf;
+		}
+
+		return;
+	}
+
+	assert(searchRadius > 0.0f && searchCount > 0);
+
+	math::vec3f batchMins = queries[0].pos;
+	math::vec3f batchMaxs = queries[0].pos;
+
+	for (size_t i = 0; i < queries.size(); i++) {
+		const math::vec3f& pos = queries[i].pos;
+
+		queries[i].code = MortonCode(pos, minPhotonPos, maxPhotonPos);
+
+		batchMins.x = std::min(batchMins.x, pos.x); batchMaxs.x = std::max(batchMaxs.x, pos.x);
+		batchMins.y = std::min(batchMins.y, pos.y); batchMaxs.y = std::max(batchMaxs.y, pos.y);
+		batchMins.z = std::min(batchMins.z, pos.z); batchMaxs.z = std::max(batchMaxs.z, pos.z);
+	}
+
+	std::sort(queries.begin(), queries.end());
+
+	// without a caller-provided buffer, all queries of the batch
+	// still share one set of kNN heaps
+	PhotonMap::QueryBuffer batchBuffer;
+
+	if (buffer == NULL) {
+		buffer = &batchBuffer;
+	}
+
+	#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE && PRECOMPUTE_IRRADIANCE_ESTIMATES == 0)
+	// consecutive queries are close together in Morton order, so
+	// each one seeds the search radius of the next
+	#if (SEED_IRRADIANCE_SEARCH_RADIUS == 1)
+	float seedRadius = 0.0f;
+	float* seedRadiusPtr = &seedRadius;
+	#else
+	float* seedRadiusPtr = NULL;
+	#endif
+
+	// no photon outside the search-box can be within range of any query
+	if (mappedTree != NULL) {
+		const size_t batchRootNode = mappedTree->GetEnclosingSubTree(batchMins - searchRadius, batchMaxs + searchRadius);
+
+		for (size_t i = 0; i < queries.size(); i++) {
+			IrradianceQuery& query = queries[i];
+
+			mappedTree->CountQuery();
+			query.irr = GetTreeEstimate<const PhotonMap::Photon*>(mappedTree, batchRootNode, query.pos, query.nrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer, seedRadiusPtr);
+		}
+	} else {
+		const size_t batchRootNode = photonTree->GetEnclosingSubTree(batchMins - searchRadius, batchMaxs + searchRadius);
+
+		for (size_t i = 0; i < queries.size(); i++) {
+			IrradianceQuery& query = queries[i];
+			query.irr = GetTreeEstimate<PhotonMap::Photon*>(photonTree, batchRootNode, query.pos, query.nrm, searchRadius, searchCount, searchEpsilon, searchNodeLimit, buffer, seedRadiusPtr);
+		}
+	}
+	#else
+	for (size_t i = 0; i < queries.size(); i++) {
+		queries[i].irr = GetIrradianceEstimate(queries[i].pos, queries[i].nrm, searchRadius, searchCount, false, buffer);
+	}
+	#endif
+}
+
 
 
 
@@ -1,12 +1,18 @@
 #ifndef KIRAN_PHOTON_MAP_HDR
 #define KIRAN_PHOTON_MAP_HDR
 
+#include <string>
 #include <vector>
+#include <stdint.h>
 
 #include "../math/vec3fwd.hpp"
 #include "../math/vec3.hpp"
+#include "./Heap.hpp"
+#include "./RecordArray.hpp"
+#include "../system/Defines.hpp"
 
 template<typename T> class KDTree;
+template<typename T> class MappedKDTree;
 template<typename T> class UniformGrid;
 
 namespace PhotonMap {
@@ -83,6 +89,66 @@ namespace PhotonMap {
 		static float sinphi[NUM_DIRECTIONS];
 	};
 
+	// a single entry of a batched irradiance query; <code> is
+	// filled in by the photon-map (for sorting) and <id> is an
+	// opaque caller-defined tag that survives the reordering
+	struct IrradianceQuery {
+	public:
+		IrradianceQuery(): code(0), id(0) {}
+		IrradianceQuery(const math::vec3f& p, const math::vec3f& n, unsigned int i): pos(p), nrm(n), code(0), id(i) {}
+
+		bool operator < (const IrradianceQuery& q) const { return (code < q.code); }
+
+		math::vec3f pos;
+		math::vec3f nrm;
+		math::vec3f irr;
+
+		unsigned int code;
+		unsigned int id;
+	};
+
+	// record of one group of photons in the files written by
+	// SavePhotons; the photons of a group were all traced from
+	// one (caller-defined) group of paths, of which the first hits
+	// of up to ANIMATION_PILOT_PATHS are kept to tell later whether
+	// the paths still lead to the same photons (a path that hit
+	// nothing has a zero normal)
+	struct PhotonGroup {
+	public:
+		PhotonGroup(): groupNum(0), numPhotons(0), numPilots(0), powerScale(1.0f) {}
+
+		unsigned int groupNum;
+		unsigned int numPhotons;
+		unsigned int numPilots;
+
+		// scale (eg. projection-map coverage) the power of the
+		// photons was emitted with
+		float powerScale;
+
+		math::vec3f pilotHits[ANIMATION_PILOT_PATHS];
+		math::vec3f pilotNrms[ANIMATION_PILOT_PATHS];
+	};
+
+	// storage for the kNN heaps of queries, so that a caller
+	// issuing many of them (eg. one render thread) does not
+	// allocate a heap for each; a buffer must only be used by
+	// one query at a time
+	struct QueryBuffer {
+	public:
+		typedef Heap<float, Photon*, MaxHeapNode<float, Photon*> > HeapType;
+		typedef Heap<float, const Photon*, MaxHeapNode<float, const Photon*> > ConstHeapType;
+
+		QueryBuffer(): heap(0), constHeap(0) {}
+
+		// heap for queries on nodes of the type of the argument
+		HeapType* GetHeap(Photon*) { return &heap; }
+		ConstHeapType* GetHeap(const Photon*) { return &constHeap; }
+
+	private:
+		HeapType heap;
+		ConstHeapType constHeap;
+	};
+
 	enum PhotonMapType {
 		PHOTONMAP_GLOBAL  = 0,
 		PHOTONMAP_DIFFUSE = 1,
@@ -95,7 +161,14 @@ namespace PhotonMap {
 		~Map();
 
 		bool AddPhoton(PhotonMap::Photon*);
+		// adds as many of <photons> as fit under one lock and
+		// returns their number
+		unsigned int AddPhotons(const std::vector<PhotonMap::Photon>&);
 		void ScalePhotonPower(const math::vec3f&);
+		// adds (as many as fit of) the photons of another map
+		// and returns their number; like added photons, they
+		// are scaled by the next call to ScalePhotonPower
+		unsigned int MergePhotons(const Map&);
 
 		// turn the flat array of photons into a
 		// left-balanced max-heap (which is also
@@ -106,28 +179,120 @@ namespace PhotonMap {
 		#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
 		void PrecomputeIrradianceEstimates(unsigned int, unsigned int, float, unsigned int);
 		#endif
+		#if (BENCHMARK_PHOTON_MAP_QUERIES == 1)
+		void BenchmarkQueries(float, unsigned int) const;
+		#endif
 
-		PhotonMapType GetMapType() const { return type; }
-		unsigned int GetMapSize() const { return (photonArray.size() - 1); }
-		unsigned int GetMapCapacity() const { return (photonArray.capacity() - 1); }
+		// write the balanced kd-tree to a page-blocked file whose
+		// header carries <fileTag> (eg. a hash of the scene); only
+		// the tree data-structure supports this
+		bool SaveToFile(const std::string&, uint64_t) const;
+		// keep the map out of core: photons are added to a scratch
+		// file (next to <fileName>, and unlinked) instead of memory,
+		// and Finalize balances them in place straight into the tree
+		// file <fileName> (tagged with <fileTag>) which is then used
+		// memory-mapped; must be called before any photons are added
+		// and only the tree data-structure (without precomputed
+		// estimates, which need the tree in core) supports this
+		bool SetOutOfCore(const std::string&, uint64_t);
+		// map a file written by SaveToFile into an empty map if
+		// its tag equals <fileTag>; the map is finalized on return
+		// and photon tracing can be skipped altogether
+		bool LoadFromFile(const std::string&, uint64_t);
+		// print the page-faults per 1000 queries since moving
+		void PrintQueryStatistics() const;
+
+		// same as SaveToFile and LoadFromFile, but the tree is put
+		// in (or mapped from) a POSIX shared memory object named
+		// after <fileTag>, so processes rendering the same scene
+		// build the map only once and share its pages; an object
+		// is removed when the last process using it unmaps it or
+		// exits, unless <persistent> (it then stays until removed
+		// from /dev/shm or reboot)
+		bool MoveToSharedMemory(uint64_t, bool);
+		bool LoadFromSharedMemory(uint64_t, bool);
+		static std::string GetSharedMemoryName(uint64_t);
+
+		// write (already scaled) photons [firstPhoton, lastPhoton]
+		// as a flat array to a file whose header carries <fileTag>
+		// and <groupTag>, split into the consecutive <groups>; used
+		// to keep the photons of each light between frames, where
+		// <groupTag> covers what the paths of the groups depend on
+		// (and <fileTag> everything the photons depend on)
+		bool SavePhotons(const std::string&, uint64_t, uint64_t, unsigned int, unsigned int, const std::vector<PhotonGroup>&) const;
+		// add the photons in a file written by SavePhotons to the
+		// (unfinalized) map if its group tag equals <groupTag>; they
+		// are not scaled again, except that the power of the photons
+		// of group <g> is scaled by (*groupScales)[g] if given, and a
+		// group with a scale of 0 is left out; the records of the
+		// added groups are appended to <groups> if not NULL
+		bool LoadPhotons(const std::string&, uint64_t, const std::vector<float>* = NULL, std::vector<PhotonGroup>* = NULL);
+		// read only the group records of such a file
+		static bool LoadPhotonGroups(const std::string&, uint64_t, std::vector<PhotonGroup>*);
+		// whether <fileName> holds photons tagged with <fileTag>
+		static bool HavePhotons(const std::string&, uint64_t);
+
+		// parameters for (1 + eps)-approximate kd-tree searches;
+		// an epsilon of 0 and a node-limit of 0 mean exact kNN
+		void SetSearchEpsilon(float eps) { searchEpsilon = eps; }
+		void SetSearchNodeLimit(unsigned int n) { searchNodeLimit = n; }
 
-		math::vec3f GetIrradianceEstimate(const math::vec3f&, const math::vec3f&, float, unsigned int, bool = false) const;
+		PhotonMapType GetMapType() const { return type; }
+		unsigned int GetMapSize() const { return numPhotons; }
+		unsigned int GetMapCapacity() const { return mapCapacity; }
+
+		// all queries below take an optional QueryBuffer
+		math::vec3f GetIrradianceEstimate(const math::vec3f&, const math::vec3f&, float, unsigned int, bool = false, QueryBuffer* = NULL) const;
+		// same, but the search starts out with the (smaller) radius
+		// in <seedRadius> when positive, and leaves the radius that
+		// seeds the next nearby query in it; see GetTreeEstimate
+		math::vec3f GetSeededIrradianceEstimate(const math::vec3f&, const math::vec3f&, float, unsigned int, float*, QueryBuffer* = NULL) const;
+		// resolves a batch of (spatially coherent) queries in
+		// Morton order; the batch is reordered in the process
+		void GetIrradianceEstimates(std::vector<IrradianceQuery>&, float, unsigned int, QueryBuffer* = NULL) const;
+		// cheaper (fixed-radius) estimate for far-away queries;
+		// the third argument is the position the query is seen
+		// from, ie. the origin of the ray that hit <pos>
+		math::vec3f GetIrradianceEstimateLOD(const math::vec3f&, const math::vec3f&, math::vec3f, float, unsigned int) const;
+		// fixed-radius (unnormalized) photon power and count
+		math::vec3f GetPhotonFlux(const math::vec3f&, const math::vec3f&, float, unsigned int*) const;
+		// fraction of shadow photons among the nearest photons, or
+		// negative if fewer than <minCount> of them were found
+		float GetShadowFraction(const math::vec3f&, const math::vec3f&, float, unsigned int, unsigned int, QueryBuffer* = NULL) const;
+
+		const math::vec3f& GetMinPhotonPos() const { return minPhotonPos; }
+		const math::vec3f& GetMaxPhotonPos() const { return maxPhotonPos; }
 
 	private:
-		math::vec3f GetIrradianceEstimateGrid(const math::vec3f&, const math::vec3f&, float, unsigned int, bool) const;
-		math::vec3f GetIrradianceEstimateTree(const math::vec3f&, const math::vec3f&, float, unsigned int, bool) const;
-		math::vec3f GetIrradianceEstimateFlat(const math::vec3f&, const math::vec3f&, float, unsigned int, bool) const;
+		// AddPhoton without locking
+		bool InsertPhoton(const PhotonMap::Photon*);
+
+		math::vec3f GetIrradianceEstimateGrid(const math::vec3f&, const math::vec3f&, float, unsigned int, bool, QueryBuffer*) const;
+		math::vec3f GetIrradianceEstimateTree(const math::vec3f&, const math::vec3f&, float, unsigned int, bool, QueryBuffer*) const;
+		math::vec3f GetIrradianceEstimateFlat(const math::vec3f&, const math::vec3f&, float, unsigned int, bool, QueryBuffer*) const;
+
+		#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
+		bool MapFile(const std::string&, bool, bool = true);
+		#endif
+		bool AttachFile(const std::string&, uint64_t, bool, bool = true);
 
 		// NOTE: each Photon* in photonTree::nodes (except the first)
 		// points to an element of photonArray, which functions as a
-		// backing store
-		// (this only works because the array is resized just once,
-		// any further resizing would invalidate the node pointers
-		// in photonTree)
-		std::vector<PhotonMap::Photon> photonArray;
+		// backing store; the array grows while photons are added so
+		// the tree (or grid) is only built by Finalize, after which
+		// it can not move anymore
+		RecordArray<PhotonMap::Photon> photonArray;
+
+		// tree file written by Finalize when out of core (if set)
+		std::string outOfCoreFile;
+		uint64_t outOfCoreTag;
 
 		#if (PM_DATASTRUCT == PM_DATASTRUCT_TREE)
 		KDTree<PhotonMap::Photon*>* photonTree;
+		// non-NULL (and photonTree NULL) when out of core or after
+		// LoadFromFile
+
+		MappedKDTree<PhotonMap::Photon>* mappedTree;
 		#elif (PM_DATASTRUCT == PM_DATASTRUCT_GRID)
 		math::vec3i photonGridCellCount;
 		UniformGrid<const PhotonMap::Photon*>* photonGrid;
@@ -136,12 +301,20 @@ namespace PhotonMap {
 		PhotonMapType type;
 
 		unsigned int numPhotons;
+		unsigned int mapCapacity;
 		unsigned int lastScaledPhoton;
 		bool finalized;
 
+		float searchEpsilon;
+		unsigned int searchNodeLimit;
+
 		math::vec3f minPhotonPower;
 		math::vec3f maxPhotonPower;
 		math::vec3f avgPhotonPower;
+
+		// bounding-box of all stored photons
+		math::vec3f minPhotonPos;
+		math::vec3f maxPhotonPos;
 	};
 };
 
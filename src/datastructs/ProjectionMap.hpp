@@ -0,0 +1,99 @@
+#ifndef KIRAN_PROJECTION_MAP_HDR
+#define KIRAN_PROJECTION_MAP_HDR
+
+#include <algorithm>
+#include <vector>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+#include "../math/Sampling.hpp"
+#include "../system/RNG.hpp"
+
+// discretized sphere of emission directions around a light
+// [Jensen, 5.1.3]; each cell spans an equal solid angle (the
+// cells are uniform in cos(theta) and in phi) and is marked
+// occupied when photons leaving through it can hit geometry
+class ProjectionMap {
+public:
+	ProjectionMap(unsigned int _sizeTheta, unsigned int _sizePhi): sizeTheta(_sizeTheta), sizePhi(_sizePhi) {
+		cells.resize(sizeTheta * sizePhi, 0);
+	}
+
+	unsigned int GetNumCells() const { return cells.size(); }
+
+	// the direction through point <u, v> (both in [0, 1)) of cell <cellIdx>
+	math::vec3f GetCellDir(unsigned int cellIdx, float u, float v) const {
+		return (math::UniformSphereSample(((cellIdx / sizePhi) + u) / sizeTheta, ((cellIdx % sizePhi) + v) / sizePhi));
+	}
+
+	// cells can be set by multiple threads as long as
+	// none of them sets the same cell as another one
+	void SetCell(unsigned int cellIdx, bool occupied) { cells[cellIdx] = occupied; }
+
+	// marks the (direct) neighbors of every occupied cell as
+	// occupied too, since narrow geometry can fall between the
+	// probes of a cell, and collects all occupied cells
+	void Finalize() {
+		std::vector<unsigned char> dilated(cells.size(), 0);
+
+		for (unsigned int t = 0; t < sizeTheta; t++) {
+			for (unsigned int p = 0; p < sizePhi; p++) {
+				if (!cells[t * sizePhi + p]) {
+					continue;
+				}
+
+				for (unsigned int dt = ((t > 0)? (t - 1): t); dt <= std::min(t + 1, sizeTheta - 1); dt++) {
+					// phi wraps around, theta does not
+					dilated[dt * sizePhi + (p + sizePhi - 1) % sizePhi] = 1;
+					dilated[dt * sizePhi + (p              )          ] = 1;
+					dilated[dt * sizePhi + (p            + 1) % sizePhi] = 1;
+				}
+			}
+		}
+
+		cells.swap(dilated);
+		occupiedCells.clear();
+
+		for (unsigned int cellIdx = 0; cellIdx < cells.size(); cellIdx++) {
+			if (cells[cellIdx]) {
+				occupiedCells.push_back(cellIdx);
+			}
+		}
+	}
+
+	// fraction of the sphere of directions covered by occupied
+	// cells; photons emitted only through those cells must have
+	// their power multiplied by this
+	float GetCoverage() const { return (occupiedCells.size() / float(cells.size())); }
+
+	// pick a uniformly distributed direction among all occupied
+	// cells; returns false if there are none
+	bool SampleDirection(RNGflt64* rng, math::vec3f* dir) const {
+		return (SampleDirection((*rng)(), (*rng)(), dir));
+	}
+
+	// same, but warps the point <s, t> of the unit square: the
+	// integer part of s * #cells selects the cell, its fraction
+	// and t select the position within (so stratification in s
+	// carries over to the cells)
+	bool SampleDirection(double s, double t, math::vec3f* dir) const {
+		if (occupiedCells.empty()) {
+			return false;
+		}
+
+		const double x = s * occupiedCells.size();
+		const unsigned int n = std::min(occupiedCells.size() - 1, size_t(x));
+
+		*dir = GetCellDir(occupiedCells[n], std::min(0.999999, x - n), t);
+		return true;
+	}
+
+private:
+	unsigned int sizeTheta;
+	unsigned int sizePhi;
+
+	std::vector<unsigned char> cells;
+	std::vector<unsigned int> occupiedCells;
+};
+
+#endif
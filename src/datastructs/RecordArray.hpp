@@ -0,0 +1,171 @@
+#ifndef KIRAN_RECORD_ARRAY_HDR
+#define KIRAN_RECORD_ARRAY_HDR
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+// growable array of records of type T (which must be copyable
+// as raw bytes); the capacity doubles whenever it runs out, up
+// to an optional limit, so an array that might hold many more
+// records than it ends up with only costs what it holds (with
+// glibc, large blocks are also remapped rather than copied when
+// they grow)
+//
+// the records can also be kept in a memory-mapped (scratch) file
+// instead, see MapFile; the OS can then write pages of records
+// back to disk and evict them, so the array is not limited by
+// the amount of memory
+//
+// NOTE: growing may move the records, so pointers to them are
+// only stable once nothing is added anymore
+template<typename T> class RecordArray {
+public:
+	RecordArray(): records(NULL), numRecords(0), maxRecords(0), recordLimit(0), fileDesc(-1) {}
+	~RecordArray() { Free(); }
+
+	// keep the records in <fileName> from now on (those already
+	// added are moved there); the file is unlinked right away so
+	// it only takes up disk space while the array exists, even if
+	// the process does not exit cleanly
+	bool MapFile(const std::string& fileName) {
+		if (fileDesc >= 0) {
+			return true;
+		}
+
+		const int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+		if (fd < 0) {
+			return false;
+		}
+
+		unlink(fileName.c_str());
+
+		T* memRecords = records;
+
+		const size_t memNumRecords = numRecords;
+		const size_t memMaxRecords = maxRecords;
+
+		records = NULL;
+		maxRecords = 0;
+		fileDesc = fd;
+
+		if (!Reserve(std::max(size_t(1024), memMaxRecords))) {
+			close(fd);
+
+			records = memRecords;
+			maxRecords = memMaxRecords;
+			fileDesc = -1;
+			return false;
+		}
+
+		memcpy(reinterpret_cast<void*>(records), reinterpret_cast<const void*>(memRecords), memNumRecords * sizeof(T));
+		free(reinterpret_cast<void*>(memRecords));
+		return true;
+	}
+
+	// make room for (at least) <n> records in total
+	bool Reserve(size_t n) {
+		if (n <= maxRecords) {
+			return true;
+		}
+
+		if (fileDesc >= 0) {
+			// the new mapping shows the same pages as the old
+			// one, so nothing needs to be copied
+			if (ftruncate(fileDesc, n * sizeof(T)) != 0) {
+				return false;
+			}
+
+			void* data = mmap(NULL, n * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fileDesc, 0);
+
+			if (data == MAP_FAILED) {
+				return false;
+			}
+
+			if (records != NULL) {
+				munmap(reinterpret_cast<void*>(records), maxRecords * sizeof(T));
+			}
+
+			records = reinterpret_cast<T*>(data);
+			maxRecords = n;
+			return true;
+		}
+
+		T* data = reinterpret_cast<T*>(realloc(reinterpret_cast<void*>(records), n * sizeof(T)));
+
+		if (data == NULL) {
+			return false;
+		}
+
+		records = data;
+		maxRecords = n;
+		return true;
+	}
+
+	// fails if the array holds <recordLimit> (if non-zero) records
+	// already, or if there is no memory left to grow it
+	bool AddRecord(const T& record) {
+		if (numRecords == maxRecords) {
+			size_t n = std::max(size_t(1024), maxRecords * 2);
+
+			if (recordLimit > 0) {
+				n = std::min(n, recordLimit);
+			}
+
+			if (n <= maxRecords || !Reserve(n)) {
+				return false;
+			}
+		}
+
+		new (&records[numRecords++]) T(record);
+		return true;
+	}
+
+	void Free() {
+		if (fileDesc >= 0) {
+			if (records != NULL) {
+				munmap(reinterpret_cast<void*>(records), maxRecords * sizeof(T));
+			}
+
+			close(fileDesc);
+		} else {
+			free(reinterpret_cast<void*>(records));
+		}
+
+		records = NULL;
+		numRecords = 0;
+		maxRecords = 0;
+		fileDesc = -1;
+	}
+
+	void SetLimit(size_t n) { recordLimit = n; }
+	bool IsMapped() const { return (fileDesc >= 0); }
+
+	      T& operator [] (size_t i)       { return records[i]; }
+	const T& operator [] (size_t i) const { return records[i]; }
+
+	size_t GetSize() const { return numRecords; }
+	size_t GetCapacity() const { return maxRecords; }
+
+private:
+	RecordArray(const RecordArray&);
+	void operator = (const RecordArray&);
+
+	T* records;
+
+	size_t numRecords;
+	size_t maxRecords;
+	size_t recordLimit;
+
+	// scratch file, if any
+	int fileDesc;
+};
+
+#endif
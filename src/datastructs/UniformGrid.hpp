@@ -7,6 +7,7 @@
 #include "../math/vec3fwd.hpp"
 #include "../math/vec3.hpp"
 #include "./NodeVolumeQuery.hpp"
+#include "./NodeRangeQuery.hpp"
 
 #define INDEX_1D(idx, gsize) ((idx.z) * (gsize.y * gsize.x) + (idx.y) * (gsize.x) + (idx.x))
 
@@ -27,7 +28,7 @@ public:
 		cells.clear();
 	}
 
-	void GetNodes(NodeVolumeQuery<T>* query) {
+	template<typename Q> void GetNodes(Q* query) {
 		// 1. find the (index of) the grid-cell encompassing <pos>
 		// 2. find the number of grid-cells corresponding to <radius>
 		//    (note: we still search the immediate neighbor cells even
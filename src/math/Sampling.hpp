@@ -0,0 +1,125 @@
+#ifndef KIRAN_SAMPLING_HDR
+#define KIRAN_SAMPLING_HDR
+
+#include <algorithm>
+#include <cmath>
+
+#include "./vec3fwd.hpp"
+#include "./vec3.hpp"
+
+// closed-form warps from the unit square to directions; unlike
+// rejection-sampling these consume a fixed number of uniform
+// numbers per sample, so stratified or quasi-random points on
+// the square stay well-distributed after being warped
+namespace math {
+	// tangent <t> and bitangent <b> completing unit vector <n>
+	// into an orthonormal basis
+	inline void OrthonormalBasis(const vec3f& n, vec3f* t, vec3f* b) {
+		const vec3f& a = (fabsf(n.x) > 0.9f)? YVECf: XVECf;
+
+		*t = (a.cross(n)).norm();
+		*b = n.cross(*t);
+	}
+
+	// jittered point <u, v> in the <i>'th of <n> equally sized
+	// strata of the unit square; the strata form a grid whose
+	// columns are the largest divisor of <n> not above sqrt(n)
+	// (so e.g. a prime <n> is stratified along u only)
+	inline void StratifiedSample(unsigned int i, unsigned int n, float ju, float jv, float* u, float* v) {
+		unsigned int cols = std::max(1U, (unsigned int) (sqrtf(n)));
+
+		while ((n % cols) != 0) {
+			cols--;
+		}
+
+		const unsigned int rows = n / cols;
+
+		*u = ((i / cols) + ju) / rows;
+		*v = ((i % cols) + jv) / cols;
+	}
+
+	// uniformly distributed point <dx, dy> on the unit disk
+	// (concentric mapping: preserves the relative areas and
+	// adjacency of strata on the square [Shirley, 1997])
+	inline void ConcentricDiskSample(float u, float v, float* dx, float* dy) {
+		const float a = 2.0f * u - 1.0f;
+		const float b = 2.0f * v - 1.0f;
+
+		if (a == 0.0f && b == 0.0f) {
+			*dx = 0.0f;
+			*dy = 0.0f;
+			return;
+		}
+
+		float r;
+		float phi;
+
+		if (fabsf(a) > fabsf(b)) {
+			r = a;
+			phi = (M_PI * 0.25f) * (b / a);
+		} else {
+			r = b;
+			phi = (M_PI * 0.5f) - (M_PI * 0.25f) * (a / b);
+		}
+
+		*dx = r * cosf(phi);
+		*dy = r * sinf(phi);
+	}
+
+	// uniformly distributed direction on the unit sphere
+	// (cos(theta) is uniform in [-1, 1], phi in [0, 2 PI))
+	inline vec3f UniformSphereSample(float u, float v) {
+		const float cosTheta = 1.0f - 2.0f * u;
+		const float sinTheta = sqrtf(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		const float phi = 2.0f * M_PI * v;
+
+		return (vec3f(sinTheta * cosf(phi), cosTheta, sinTheta * sinf(phi)));
+	}
+
+	// uniformly distributed direction on the hemisphere
+	// around <nrm>; the sphere-sample is mirrored into it
+	inline vec3f UniformHemisphereSample(const vec3f& nrm, float u, float v) {
+		const vec3f dir = UniformSphereSample(u, v);
+
+		if (dir.dot3D(nrm) < 0.0f)
+			return -dir;
+
+		return dir;
+	}
+
+	// direction on the hemisphere around <nrm> with density
+	// cos(theta) / PI, by projecting a disk-sample up onto it
+	// (the distribution of both Lambertian reflection and of
+	// emission from a diffuse surface)
+	inline vec3f CosineHemisphereSample(const vec3f& nrm, float u, float v) {
+		vec3f t;
+		vec3f b;
+		float dx;
+		float dy;
+
+		OrthonormalBasis(nrm, &t, &b);
+		ConcentricDiskSample(u, v, &dx, &dy);
+
+		const float dz = sqrtf(std::max(0.0f, 1.0f - dx * dx - dy * dy));
+
+		return ((t * dx + b * dy + nrm * dz).norm());
+	}
+
+	// uniformly distributed direction within the cone (or the
+	// spherical cap) around <axis> of directions making angles
+	// with it whose cosines are at least <cosThetaMax>
+	inline vec3f UniformConeSample(const vec3f& axis, float cosThetaMax, float u, float v) {
+		vec3f t;
+		vec3f b;
+
+		OrthonormalBasis(axis, &t, &b);
+
+		const float cosTheta = 1.0f - u * (1.0f - cosThetaMax);
+		const float sinTheta = sqrtf(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		const float phi = 2.0f * M_PI * v;
+
+		return ((t * (sinTheta * cosf(phi)) + b * (sinTheta * sinf(phi)) + axis * cosTheta).norm());
+	}
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <sstream>
 
 #include "./vec3.hpp"
+#include "./Sampling.hpp"
 #include "../system/RNG.hpp"
 
 namespace math {
@@ -15,22 +16,12 @@ namespace math {
 	}
 
 	template<> vec3<float>& vec3<float>::rrandomize(RNGflt64* rng) {
-		x = 1.0f;
-		y = 1.0f;
-		z = 1.0f;
+		// generate a uniformly distributed random unit vector
+		// (in closed form rather than by rejection-sampling)
+		const float u = (*rng)();
+		const float v = (*rng)();
 
-		// generate a random vector in the unit-sphere via
-		// rejection-sampling; this is used when emitting
-		// photons in uniformly distributed directions from
-		// (diffuse) point-lights, as well as to pick random
-		// surface positions for area-lights for soft-shadows
-		while (sqLen3D() > 1.0f) {
-			x = 2.0f * (*rng)() - 1.0f;
-			y = 2.0f * (*rng)() - 1.0f;
-			z = 2.0f * (*rng)() - 1.0f;
-		}
-
-		return (inorm());
+		return (*this = UniformSphereSample(u, v));
 	}
 
 	template<> std::string vec3<float>::str() const {
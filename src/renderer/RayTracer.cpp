@@ -2,6 +2,11 @@
 #include <boost/thread/barrier.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <sstream>
 #include <vector>
 
 #include <cassert>
@@ -13,21 +18,211 @@
 #include "../system/Defines.hpp"
 
 #include "./RayTracer.hpp"
+#include "./RenderContext.hpp"
 #include "./Scene.hpp"
 #include "./SceneLight.hpp"
 #include "./SceneObject.hpp"
 #include "./Material.hpp"
 #include "./MaterialReflectionModel.hpp"
 #include "./Camera.hpp"
+#include "../datastructs/ImportanceGrid.hpp"
+#include "../datastructs/IrradianceCache.hpp"
 #include "../datastructs/PhotonMap.hpp"
+#include "../datastructs/ProjectionMap.hpp"
 #include "../math/Ray.hpp"
+#include "../math/Sampling.hpp"
 #include "../system/LuaParser.hpp"
 #include "../system/Profiler.hpp"
 #include "../system/SDLWindow.hpp"
+#include "../system/ThreadPool.hpp"
 #include "../system/RNG.hpp"
+#include "../system/QRNG.hpp"
+
+#if (BENCHMARK_IRRADIANCE_QUERY_BATCHING == 1 || BENCHMARK_PHOTON_SAMPLING == 1)
+#include "../system/Benchmark.hpp"
+#endif
+
+// a deferred irradiance query kept for the whole progressive
+// render, along with its photon statistics [Hachisuka, 2009]
+struct RayTracer::VisiblePoint {
+	VisiblePoint(): radius(0.0f), count(0.0f), pixel(0) {}
+
+	math::vec3f pos;
+	math::vec3f nrm;
+	math::vec3f wgt;
+	// accumulated (radius-corrected) photon power
+	math::vec3f flux;
+
+	float radius;
+	float count;
+
+	unsigned int pixel;
+};
+
+// a cell of the lattice of irradiance queries spanned by the
+// (tile-pixel) corners <x0, y0> and <x1, y1>
+struct RayTracer::IrradianceCell {
+	IrradianceCell(unsigned int _x0, unsigned int _y0, unsigned int _x1, unsigned int _y1): x0(_x0), y0(_y0), x1(_x1), y1(_y1) {}
+
+	unsigned int x0, y0;
+	unsigned int x1, y1;
+};
+
+// irradiance queries issued while tracing the pixels of one
+// tile; each query contributes <weights[id]> times its final
+// estimate to the tile-pixel with (tile-local) index <pixels[id]>
+struct RayTracer::IrradianceBatch {
+	IrradianceBatch(): pixelIdx(0), active(false), seedRadius(0.0f), numQueries(0), numInterpolated(0) {}
+
+	void Clear() {
+		queries.clear();
+		weights.clear();
+		pixels.clear();
+		objects.clear();
+		depths.clear();
+	}
+
+	// how the estimate of a query was obtained
+	enum {
+		QUERY_STATE_PENDING      = 0,
+		QUERY_STATE_INTERPOLATED = 1,
+		QUERY_STATE_EVALUATED    = 2,
+	};
+
+	std::vector<PhotonMap::IrradianceQuery> queries;
+	std::vector<math::vec3f> weights;
+	std::vector<unsigned int> pixels;
+	// per query the object it is made on and its distance
+	// to the camera, or NULL and 0 if the query was not made
+	// at the first surface seen through its pixel
+	std::vector<const ISceneObject*> objects;
+	std::vector<float> depths;
+	// queries of the thread's band in progressive mode
+	std::vector<VisiblePoint> points;
+
+	// tile-pixel currently being traced
+	unsigned int pixelIdx;
+	// whether gathers are currently being deferred
+	bool active;
+	// search radius of the next immediate query in the tile
+	float seedRadius;
+
+	// number of deferred queries, and of those interpolated
+	unsigned int numQueries;
+	unsigned int numInterpolated;
+};
+
+// per-thread batch of photons traced one bounce at a time; the
+// path state is kept as separate arrays so a whole bounce can be
+// intersected in one sweep, and deposits are added to the map in
+// bulk once the batch is done
+struct RayTracer::PhotonStream {
+	void Clear() {
+		pos.clear();
+		dir.clear();
+		pwr.clear();
+		inside.clear();
+		deposits.clear();
+	}
+	void Push(const math::vec3f& p, const math::vec3f& d, const math::vec3f& w) {
+		pos.push_back(p);
+		dir.push_back(d);
+		pwr.push_back(w);
+		inside.push_back(0);
+	}
+	void Resize(unsigned int n) {
+		pos.resize(n);
+		dir.resize(n);
+		pwr.resize(n);
+		inside.resize(n);
+	}
+
+	unsigned int GetSize() const { return pos.size(); }
+
+	std::vector<math::vec3f> pos;
+	std::vector<math::vec3f> dir;
+	std::vector<math::vec3f> pwr;
+	std::vector<unsigned char> inside;
+
+	std::vector<PhotonMap::Photon> deposits;
+};
+
+// tiles (indices in row-major order) still to be traced by
+// one thread; the owner takes them from the front, other
+// threads steal from the back
+struct RayTracer::TileQueue {
+	boost::mutex mutex;
+	std::deque<unsigned int> tiles;
+};
+
+// point <x, y> at distance <d> along the Hilbert curve that
+// fills an <n> by <n> grid (n must be a power of two)
+static void HilbertCurvePoint(unsigned int n, unsigned int d, unsigned int* x, unsigned int* y) {
+	*x = 0;
+	*y = 0;
+
+	for (unsigned int s = 1; s < n; s <<= 1) {
+		const unsigned int rx = 1 & (d >> 1);
+		const unsigned int ry = 1 & (d ^ rx);
+
+		// rotate the quadrant
+		if (ry == 0) {
+			if (rx == 1) {
+				*x = s - 1 - *x;
+				*y = s - 1 - *y;
+			}
+
+			std::swap(*x, *y);
+		}
+
+		*x += (s * rx);
+		*y += (s * ry);
+		d >>= 2;
+	}
+}
+
+// consecutive photons of one light that are emitted together
+struct RayTracer::PhotonChunk {
+	PhotonChunk(const ISceneLight* l, unsigned int n, unsigned int i, unsigned int k): light(l), lightNum(n), firstPhoton(i), numPhotons(k) {}
+
+	const ISceneLight* light;
 
-RayTracer::RayTracer(LuaParser& parser, const Scene& scene): numThreads(1), mapNumPhotons(0) {
+	unsigned int lightNum;
+	// index in photonSequence
+	unsigned int firstPhoton;
+	unsigned int numPhotons;
+};
+
+struct RayTracer::PathGroup {
+	PathGroup(): traced(false) {}
+
+	PhotonMap::PhotonGroup record;
+
+	// photons deposited by the group's paths, until they are
+	// added to the map (after all groups are done)
+	std::vector<PhotonMap::Photon> photons;
+
+	// whether the group is re-traced this frame
+	bool traced;
+};
+
+// the first path (relative to the first of its light, which is
+// path <firstLightPhoton> of photonSequence) and the number of
+// paths of the light's path group <groupNum>
+static void GetPathGroup(
+	unsigned int firstLightPhoton,
+	unsigned int numLightPhotons,
+	unsigned int groupNum,
+	unsigned int* firstPath,
+	unsigned int* numPaths
+) {
+	*firstPath = (groupNum + ANIMATION_PATH_GROUPS - (firstLightPhoton % ANIMATION_PATH_GROUPS)) % ANIMATION_PATH_GROUPS;
+	*numPaths = ((*firstPath) < numLightPhotons)? ((numLightPhotons - (*firstPath) - 1) / ANIMATION_PATH_GROUPS + 1): 0;
+}
+
+RayTracer::RayTracer(LuaParser& parser, const Scene& scene): numThreads(1), mapNumPhotons(0), progressiveDone(false), renderStartTime(0) {
 	const LuaTable* rootTable = parser.GetRootTbl();
+	const LuaTable* sceneTable = rootTable->GetTblVal("scene");
 	const LuaTable* tracerTable = rootTable->GetTblVal("raytracer");
 
 	const std::list<ISceneLight*>& lights = scene.GetLights();
@@ -42,62 +237,436 @@ RayTracer::RayTracer(LuaParser& parser, const Scene& scene): numThreads(1), mapN
 	numThreads = uint(tracerTable->GetFltVal("numThreads", boost::thread::hardware_concurrency()));
 	antiAliasing = bool(tracerTable->GetFltVal("antiAliasing", 0));
 	incrementalRender = bool(tracerTable->GetFltVal("incrementalRender", 1.0f));
+	pinThreads = bool(tracerTable->GetFltVal("pinThreads", 0));
 
 	assert(numThreads >= 1);
 
 	maxRayDepth = uint(tracerTable->GetFltVal("maxRayDepth", 1));
 	maxPhotonDepth = uint(tracerTable->GetFltVal("maxPhotonDepth", 0));
+	numImportons = uint(tracerTable->GetFltVal("numImportons", 0));
 
 	if (photonMapping) {
 		photonSearchCount = uint(tracerTable->GetFltVal("photonSearchCount", 1));
 		photonSearchRadius = tracerTable->GetFltVal("photonSearchRadius", 1.0f);
+		photonSearchEpsilon = tracerTable->GetFltVal("photonSearchEpsilon", 0.0f);
+		photonSearchMaxNodes = uint(tracerTable->GetFltVal("photonSearchMaxNodes", 0));
+		photonMapFile = tracerTable->GetStrVal("photonMapFile", "");
+		photonMapOutOfCore = bool(tracerTable->GetFltVal("photonMapOutOfCore", 0));
+		photonMapShared = bool(tracerTable->GetFltVal("photonMapShared", 0));
+		photonMapSharedPersist = bool(tracerTable->GetFltVal("photonMapSharedPersist", 0));
+		adaptivePhotonError = tracerTable->GetFltVal("adaptivePhotonError", 0.0f);
+		adaptivePhotonMaxRounds = std::max(1U, uint(tracerTable->GetFltVal("adaptivePhotonMaxRounds", 16)));
+		animationMode = bool(tracerTable->GetFltVal("animationMode", 0));
+		animationReuseRadius = tracerTable->GetFltVal("animationReuseRadius", photonSearchRadius * 0.1f);
+
+		progressiveRender = bool(tracerTable->GetFltVal("progressiveRender", 0));
+		progressivePasses = uint(tracerTable->GetFltVal("progressivePasses", 16));
+		progressiveTimeBudget = tracerTable->GetFltVal("progressiveTimeBudget", 0.0f);
+		progressiveAlpha = tracerTable->GetFltVal("progressiveAlpha", 0.7f);
+
+		irradianceCacheError = tracerTable->GetFltVal("irradianceCacheError", 0.3f);
+		irradianceCacheMinRadius = tracerTable->GetFltVal("irradianceCacheMinRadius", 0.5f);
+		irradianceCacheMaxRadius = tracerTable->GetFltVal("irradianceCacheMaxRadius", 10.0f);
+		irradianceCacheFile = tracerTable->GetStrVal("irradianceCacheFile", "");
+
+		#if (NUM_IRRADIANCE_GATHER_RAYS > 0 || DEBUG_RENDER_PHOTON_MAP == 1)
+		// gather rays need their estimates immediately, so
+		// there would be no queries to make progressive
+		progressiveRender = false;
+		#endif
+
+		if (progressivePasses == 0 && progressiveTimeBudget <= 0.0f) {
+			progressivePasses = 1;
+		}
+
+		if (progressiveRender || adaptivePhotonError <= 0.0f) {
+			adaptivePhotonError = 0.0f;
+			adaptivePhotonMaxRounds = 1;
+		}
+
+		// (only once the settings are normalized, so equivalent
+		// configurations hash the same)
+		photonMapHash = GetPhotonMapHash(rootTable);
+
+		assert(progressiveAlpha > 0.0f && progressiveAlpha < 1.0f);
+
+		assert(photonSearchEpsilon >= 0.0f);
+
+		// in adaptive mode, mapNumPhotons are traced per round (the
+		// map only grows by the photons of the rounds actually run)
+		photonMap = new PhotonMap::Map(mapNumPhotons * adaptivePhotonMaxRounds, PhotonMap::PHOTONMAP_GLOBAL);
+		photonMap->SetSearchEpsilon(photonSearchEpsilon);
+		photonMap->SetSearchNodeLimit(photonSearchMaxNodes);
+		photonRoundMap = NULL;
+
+		// if another process already published the map of this
+		// scene (except for the camera), attach to that one
+		photonMapShared = (photonMapShared && !progressiveRender);
+		photonMapLoaded = (photonMapShared && photonMap->LoadFromSharedMemory(photonMapHash, photonMapSharedPersist));
+
+		// if the scene did not change since the file was written,
+		// re-use the photons stored in it
+		photonMapLoaded = photonMapLoaded || (!progressiveRender && !photonMapFile.empty() && photonMap->LoadFromFile(photonMapFile, photonMapHash));
+
+		// otherwise, trace the photons into a scratch file and
+		// balance them straight into photonMapFile, so the map is
+		// never held in memory (a map that will be published to
+		// shared memory is kept in core until then)
+		photonMapOutOfCore = (photonMapOutOfCore && !photonMapLoaded && !photonMapShared && !progressiveRender && !photonMapFile.empty());
+		photonMapOutOfCore = (photonMapOutOfCore && photonMap->SetOutOfCore(photonMapFile, photonMapHash));
+
+		if (adaptivePhotonError > 0.0f && !photonMapLoaded) {
+			photonRoundMap = new PhotonMap::Map(mapNumPhotons, PhotonMap::PHOTONMAP_GLOBAL);
+			photonRoundMap->SetSearchEpsilon(photonSearchEpsilon);
+			photonRoundMap->SetSearchNodeLimit(photonSearchMaxNodes);
+		}
+
+		// otherwise, re-use the photons of every light that did
+		// not change since the previous frame (progressive passes
+		// each need fresh photons, and adaptive rounds need their
+		// own lights' photons to measure the error)
+		if (animationMode && !photonMapLoaded && !progressiveRender && photonRoundMap == NULL && !photonMapFile.empty()) {
+			const LuaTable* lightsTable = sceneTable->GetTblVal("lights");
+
+			std::list<int> lightIDs;
+			lightsTable->GetIntTblKeys(&lightIDs);
+
+			// same order as Scene::lights
+			for (std::list<int>::const_iterator it = lightIDs.begin(); it != lightIDs.end(); it++) {
+				const std::string lightPhotonsFile = GetLightPhotonsFile(lightPhotonsCached.size());
+
+				lightPhotonHashes.push_back(GetPhotonMapHash(rootTable, lightsTable->GetTblVal(*it)));
+				lightGroupHashes.push_back(GetPhotonMapHash(rootTable, lightsTable->GetTblVal(*it), false));
+				lightPhotonsCached.push_back(PhotonMap::Map::HavePhotons(lightPhotonsFile, lightPhotonHashes.back()));
+				lightPhotonGroups.push_back(std::vector<PhotonMap::PhotonGroup>());
+
+				// of a light that only moved, the path groups can
+				// be kept if their (quasi-random) paths are traced
+				// the same way every frame
+				if (USE_QMC_PHOTON_SAMPLING == 0 || lightPhotonsCached.back()) {
+					continue;
+				}
+
+				std::vector<PhotonMap::PhotonGroup> groups;
+
+				if (!PhotonMap::Map::LoadPhotonGroups(lightPhotonsFile, lightGroupHashes.back(), &groups) || groups.size() != ANIMATION_PATH_GROUPS) {
+					continue;
+				}
+
+				lightPhotonGroups.back().resize(ANIMATION_PATH_GROUPS);
+
+				for (std::vector<PhotonMap::PhotonGroup>::const_iterator git = groups.begin(); git != groups.end(); ++git) {
+					if (git->groupNum < ANIMATION_PATH_GROUPS) {
+						lightPhotonGroups.back()[git->groupNum] = *git;
+					}
+				}
+			}
 
-		photonMap = new PhotonMap::Map(mapNumPhotons, PhotonMap::PHOTONMAP_GLOBAL);
+			pathGroups.resize(ANIMATION_PATH_GROUPS);
+		}
 	} else {
 		photonSearchCount = 0;
 		photonSearchRadius = 0.0f;
+		photonSearchEpsilon = 0.0f;
+		photonSearchMaxNodes = 0;
+		photonMapOutOfCore = false;
+		photonMapShared = false;
+		photonMapSharedPersist = false;
+		photonMapLoaded = false;
+		photonMapHash = 0;
+		animationMode = false;
+		animationReuseRadius = 0.0f;
+		adaptivePhotonError = 0.0f;
+		adaptivePhotonMaxRounds = 1;
+
+		progressiveRender = false;
+		progressivePasses = 0;
+		progressiveTimeBudget = 0.0f;
+		progressiveAlpha = 0.0f;
+
+		irradianceCacheError = 0.0f;
+		irradianceCacheMinRadius = 0.0f;
+		irradianceCacheMaxRadius = 0.0f;
 
 		photonMap = NULL;
+		photonRoundMap = NULL;
+	}
+
+	photonRoundsDone = false;
+
+	{
+		// fixed (default) seed: every run uses the same points
+		RNGflt64 rotationRNG;
+
+		photonSequence = new QRNGHalton(&rotationRNG);
+		photonSequenceOffset = 0;
+		nextPhotonChunk = 0;
+	}
+
+	#if (USE_PROJECTION_MAPS == 1)
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
+		// area-lights sample a hemisphere per surface position
+		if ((*it)->GetRadius() <= 0.0f) {
+			projectionMaps.push_back(new ProjectionMap(PROJECTION_MAP_SIZE / 2, PROJECTION_MAP_SIZE));
+		} else {
+			projectionMaps.push_back(NULL);
+		}
+	}
+	#endif
+
+	importanceGrid = NULL;
+
+	#if (USE_IMPORTONS == 1)
+	if (photonMapping && numImportons > 0 && !photonMapLoaded) {
+		importanceGrid = new ImportanceGrid(scene.GetMinBounds(), scene.GetMaxBounds(), IMPORTANCE_GRID_SIZE);
+	}
+	#endif
+
+	irradianceCache = NULL;
+
+	#if (USE_IRRADIANCE_CACHE == 1 && NUM_IRRADIANCE_GATHER_RAYS > 0)
+	if (photonMapping && irradianceCacheError > 0.0f) {
+		irradianceCache = new IrradianceCache(scene.GetMinBounds(), scene.GetMaxBounds(), irradianceCacheError);
+
+		// the gathers of a static scene can be re-used as well
+		if (!irradianceCacheFile.empty()) {
+			irradianceCache->LoadFromFile(irradianceCacheFile, GetIrradianceCacheHash());
+		}
+	}
+	#endif
+
+	numShadowPhotons = uint(tracerTable->GetFltVal("numShadowPhotons", 0));
+	shadowPhotonSearchRadius = tracerTable->GetFltVal("shadowPhotonSearchRadius", 1.0f);
+
+	#if (USE_SHADOW_PHOTONS == 1)
+	if (numShadowPhotons > 0) {
+		for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
+			shadowPhotonMaps.push_back(new PhotonMap::Map(numShadowPhotons * SHADOW_PHOTON_MAX_DEPOSITS, PhotonMap::PHOTONMAP_GLOBAL));
+		}
 	}
+	#endif
 
 	profiler = new Profiler(numThreads, maxRayDepth, maxPhotonDepth, RAY_TYPE_LAST, PHOTON_MATINT_LAST);
 
+	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
+		irradianceBatches.push_back(new IrradianceBatch());
+		tileQueues.push_back(new TileQueue());
+	}
+
+	numTilesX = 0;
+	numTiles = 0;
+	numTilesDone = 0;
+
+	nextGBufferRow = 0;
+	useGBuffer = false;
+	rayRoulette = false;
+	mapsBuilt = false;
+
+	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
+		renderContexts.push_back(new RenderContext(threadNum));
+	}
+
+	threadPool = new ThreadPool(numThreads, pinThreads);
+
 	std::cout << "[RayTracer::RayTracer]" << std::endl;
 	std::cout << "\tnumThreads:        " << numThreads        << std::endl;
 	std::cout << "\tantiAliasing:      " << antiAliasing      << std::endl;
 	std::cout << "\tincrementalRender: " << incrementalRender << std::endl;
+	std::cout << "\tpinThreads:        " << pinThreads        << std::endl;
 	std::cout << std::endl;
 	std::cout << "\tMONTE_CARLO_SOFT_SHADOWS:              " << MONTE_CARLO_SOFT_SHADOWS              << std::endl;
 	std::cout << "\tNUM_MONTE_CARLO_LIGHT_SAMPLES:         " << NUM_MONTE_CARLO_LIGHT_SAMPLES         << std::endl;
+	std::cout << "\tSTREAMED_PHOTON_TRACING:               " << STREAMED_PHOTON_TRACING               << std::endl;
+	std::cout << "\tPHOTON_STREAM_SIZE:                    " << PHOTON_STREAM_SIZE                    << std::endl;
+	std::cout << "\tPHOTON_CHUNK_SIZE:                     " << PHOTON_CHUNK_SIZE                     << std::endl;
+	std::cout << "\tADAPTIVE_PHOTON_PROBE_STRIDE:          " << ADAPTIVE_PHOTON_PROBE_STRIDE          << std::endl;
+	std::cout << "\tUSE_QMC_PHOTON_SAMPLING:               " << USE_QMC_PHOTON_SAMPLING               << std::endl;
+	std::cout << "\tANIMATION_PATH_GROUPS:                 " << ANIMATION_PATH_GROUPS                 << std::endl;
+	std::cout << "\tANIMATION_PILOT_PATHS:                 " << ANIMATION_PILOT_PATHS                 << std::endl;
+	std::cout << "\tUSE_PROJECTION_MAPS:                   " << USE_PROJECTION_MAPS                   << std::endl;
+	std::cout << "\tPROJECTION_MAP_SIZE:                   " << PROJECTION_MAP_SIZE                   << std::endl;
+	std::cout << "\tUSE_IMPORTONS:                         " << USE_IMPORTONS                         << std::endl;
+	std::cout << "\tIMPORTANCE_GRID_SIZE:                  " << IMPORTANCE_GRID_SIZE                  << std::endl;
+	std::cout << "\tIMPORTANCE_MIN_PROBABILITY:            " << IMPORTANCE_MIN_PROBABILITY            << std::endl;
+	std::cout << "\tUSE_SHADOW_PHOTONS:                    " << USE_SHADOW_PHOTONS                    << std::endl;
+	std::cout << "\tSHADOW_PHOTON_SEARCH_COUNT:            " << SHADOW_PHOTON_SEARCH_COUNT            << std::endl;
+	std::cout << "\tSHADOW_PHOTON_MIN_COUNT:               " << SHADOW_PHOTON_MIN_COUNT               << std::endl;
 	std::cout << "\tPHOTON_ENERGY_CONSERVATION:            " << PHOTON_ENERGY_CONSERVATION            << std::endl;
 	std::cout << "\tPHOTON_MAP_INDIRECT_ILLUMINATION_ONLY: " << PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY << std::endl;
 	std::cout << "\tIRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY: " << IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY << std::endl;
 	std::cout << "\tNUM_IRRADIANCE_GATHER_RAYS:            " << NUM_IRRADIANCE_GATHER_RAYS            << std::endl;
+	std::cout << "\tUSE_IRRADIANCE_CACHE:                  " << USE_IRRADIANCE_CACHE                  << std::endl;
 	std::cout << "\tIRRADIANCE_GATHER_RAY_WEIGHT:          " << IRRADIANCE_GATHER_RAY_WEIGHT          << std::endl;
+	std::cout << "\tIRRADIANCE_LOD_QUERIES:                " << IRRADIANCE_LOD_QUERIES                << std::endl;
+	std::cout << "\tIRRADIANCE_LOD_SOLID_ANGLE:            " << IRRADIANCE_LOD_SOLID_ANGLE            << std::endl;
+	std::cout << "\tRENDER_TILE_SIZE:                      " << RENDER_TILE_SIZE                      << std::endl;
+	std::cout << "\tBATCHED_IRRADIANCE_QUERIES:            " << BATCHED_IRRADIANCE_QUERIES            << std::endl;
+	std::cout << "\tADAPTIVE_IRRADIANCE_SAMPLING:          " << ADAPTIVE_IRRADIANCE_SAMPLING          << std::endl;
+	std::cout << "\tIRRADIANCE_LATTICE_SPACING:            " << IRRADIANCE_LATTICE_SPACING            << std::endl;
+	std::cout << "\tUSE_PRIMARY_GBUFFER:                   " << USE_PRIMARY_GBUFFER                   << std::endl;
+	std::cout << "\tRAY_THROUGHPUT_CUTOFF:                 " << RAY_THROUGHPUT_CUTOFF                 << std::endl;
+	std::cout << "\tRAY_ROULETTE_MIN_DEPTH:                " << RAY_ROULETTE_MIN_DEPTH                << std::endl;
 	std::cout << std::endl;
-	std::cout << "\tmaxRayDepth:        " << maxRayDepth        << std::endl;
-	std::cout << "\tmaxPhotonDepth:     " << maxPhotonDepth     << std::endl;
-	std::cout << "\tmapNumPhotons:      " << mapNumPhotons      << std::endl;
-	std::cout << "\tphotonSearchCount:  " << photonSearchCount  << std::endl;
-	std::cout << "\tphotonSearchRadius: " << photonSearchRadius << std::endl;
+	std::cout << "\tnumImportons:             " << numImportons             << std::endl;
+	std::cout << "\tnumShadowPhotons:         " << numShadowPhotons         << std::endl;
+	std::cout << "\tshadowPhotonSearchRadius: " << shadowPhotonSearchRadius << std::endl;
+	std::cout << std::endl;
+	std::cout << "\tmaxRayDepth:          " << maxRayDepth          << std::endl;
+	std::cout << "\tmaxPhotonDepth:       " << maxPhotonDepth       << std::endl;
+	std::cout << "\tmapNumPhotons:        " << mapNumPhotons        << std::endl;
+	std::cout << "\tphotonSearchCount:    " << photonSearchCount    << std::endl;
+	std::cout << "\tphotonSearchRadius:   " << photonSearchRadius   << std::endl;
+	std::cout << "\tphotonSearchEpsilon:  " << photonSearchEpsilon  << std::endl;
+	std::cout << "\tphotonSearchMaxNodes: " << photonSearchMaxNodes << std::endl;
+	std::cout << "\tphotonMapFile:        " << photonMapFile        << std::endl;
+	std::cout << "\tphotonMapOutOfCore:   " << photonMapOutOfCore   << std::endl;
+	std::cout << "\tphotonMapShared:      " << photonMapShared      << std::endl;
+	std::cout << "\tphotonMapSharedPersist: " << photonMapSharedPersist << std::endl;
+	std::cout << "\tphotonMapLoaded:      " << photonMapLoaded      << std::endl;
+	std::cout << "\tanimationMode:        " << animationMode        << std::endl;
+	std::cout << "\tanimationReuseRadius: " << animationReuseRadius << std::endl;
+	std::cout << "\tadaptivePhotonError:     " << adaptivePhotonError     << std::endl;
+	std::cout << "\tadaptivePhotonMaxRounds: " << adaptivePhotonMaxRounds << std::endl;
+	std::cout << "\tlightPhotonsCached:   " << std::count(lightPhotonsCached.begin(), lightPhotonsCached.end(), true) << " of " << lightPhotonsCached.size() << std::endl;
+	std::cout << "\tprogressiveRender:     " << progressiveRender     << std::endl;
+	std::cout << "\tprogressivePasses:     " << progressivePasses     << std::endl;
+	std::cout << "\tprogressiveTimeBudget: " << progressiveTimeBudget << std::endl;
+	std::cout << "\tprogressiveAlpha:      " << progressiveAlpha      << std::endl;
+	std::cout << "\tirradianceCacheError:     " << irradianceCacheError     << std::endl;
+	std::cout << "\tirradianceCacheMinRadius: " << irradianceCacheMinRadius << std::endl;
+	std::cout << "\tirradianceCacheMaxRadius: " << irradianceCacheMaxRadius << std::endl;
+	std::cout << "\tirradianceCacheFile:      " << irradianceCacheFile      << std::endl;
 }
 
 RayTracer::~RayTracer() {
 	if (photonMapping) {
 		delete photonMap;
+		delete photonRoundMap;
+	}
+
+	// stop the workers before anything they use is deleted
+	delete threadPool;
+
+	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
+		delete irradianceBatches[threadNum];
+		delete tileQueues[threadNum];
+		delete renderContexts[threadNum];
+	}
+
+	for (unsigned int lightNum = 0; lightNum < shadowPhotonMaps.size(); lightNum++) {
+		delete shadowPhotonMaps[lightNum];
+	}
+
+	for (unsigned int lightNum = 0; lightNum < projectionMaps.size(); lightNum++) {
+		delete projectionMaps[lightNum];
 	}
 
+	delete photonSequence;
+	delete importanceGrid;
+	delete irradianceCache;
+
 	delete profiler;
 }
 
+// everything the stored photons depend on: the scene minus
+// its camera, the photon-tracing parameters and the defines
+// that change what is stored in (or precomputed for) the map;
+// if <lightTable> is given, the hash instead covers only the
+// photons of that light (so all other lights are skipped), and
+// without <lightPlacement> not its position and direction (so
+// it covers where the light's paths can lead, but not where
+// they start)
+uint64_t RayTracer::GetPhotonMapHash(const LuaTable* rootTable, const LuaTable* lightTable, bool lightPlacement) const {
+	const LuaTable* sceneTable = rootTable->GetTblVal("scene");
+	const LuaTable* windowTable = rootTable->GetTblVal("window");
+
+	const bool useImportons = (USE_IMPORTONS == 1 && numImportons > 0);
+
+	std::list<std::string> skipKeys;
+
+	// with importons, what gets stored depends on the view
+	if (!useImportons) {
+		skipKeys.push_back("camera");
+	}
+	if (lightTable != NULL) {
+		skipKeys.push_back("lights");
+	}
+
+	std::size_t hash = sceneTable->GetHash(&skipKeys);
+
+	if (lightTable != NULL) {
+		std::list<std::string> lightSkipKeys;
+
+		if (!lightPlacement) {
+			lightSkipKeys.push_back("position");
+			lightSkipKeys.push_back("direction");
+		}
+
+		boost::hash_combine(hash, lightTable->GetHash(&lightSkipKeys));
+	}
+
+	boost::hash_combine(hash, maxPhotonDepth);
+	boost::hash_combine(hash, mapNumPhotons);
+	boost::hash_combine(hash, adaptivePhotonError);
+	boost::hash_combine(hash, adaptivePhotonMaxRounds);
+	boost::hash_combine(hash, PHOTON_ENERGY_CONSERVATION);
+	boost::hash_combine(hash, PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY);
+	boost::hash_combine(hash, PRECOMPUTE_IRRADIANCE_ESTIMATES);
+	boost::hash_combine(hash, USE_PROJECTION_MAPS);
+	boost::hash_combine(hash, USE_QMC_PHOTON_SAMPLING);
+
+	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
+	boost::hash_combine(hash, photonSearchRadius);
+	boost::hash_combine(hash, photonSearchCount);
+	#endif
+
+	if (useImportons) {
+		// importons are shot through (random) window pixels
+		// and followed for up to maxRayDepth bounces, and the
+		// importance grid decides where photons are kept
+		boost::hash_combine(hash, numImportons);
+		boost::hash_combine(hash, maxRayDepth);
+		boost::hash_combine(hash, windowTable->GetFltVal("xsize", 640.0f));
+		boost::hash_combine(hash, windowTable->GetFltVal("ysize", 480.0f));
+		boost::hash_combine(hash, IMPORTANCE_GRID_SIZE);
+		boost::hash_combine(hash, IMPORTANCE_MIN_PROBABILITY);
+	}
+
+	return hash;
+}
+
+// everything the records of the irradiance cache depend on
+// besides the photons: the final-gather parameters
+uint64_t RayTracer::GetIrradianceCacheHash() const {
+	std::size_t hash = photonMapHash;
+
+	boost::hash_combine(hash, photonSearchRadius);
+	boost::hash_combine(hash, photonSearchCount);
+	boost::hash_combine(hash, photonSearchEpsilon);
+	boost::hash_combine(hash, photonSearchMaxNodes);
+	boost::hash_combine(hash, irradianceCacheMinRadius);
+	boost::hash_combine(hash, irradianceCacheMaxRadius);
+	boost::hash_combine(hash, NUM_IRRADIANCE_GATHER_RAYS);
+	boost::hash_combine(hash, IRRADIANCE_LOD_QUERIES);
+	boost::hash_combine(hash, IRRADIANCE_LOD_SOLID_ANGLE);
+	boost::hash_combine(hash, IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY);
+
+	return hash;
+}
+
+std::string RayTracer::GetLightPhotonsFile(unsigned int lightNum) const {
+	std::stringstream ss;
+	ss << photonMapFile << ".light" << lightNum;
+	return (ss.str());
+}
+
 
 
 math::vec3f RayTracer::SampleDirectIllumination(
-	unsigned int threadNum,
+	RenderContext* ctx,
 	const Scene& scene,
 	const math::RaySegment& ray,
 	const math::RayIntersection& rayInt,
-	RNGflt64* rng,
 	unsigned int rayDepth
 ) const {
 	math::vec3f irr;
@@ -128,8 +697,10 @@ math::vec3f RayTracer::SampleDirectIllumination(
 	 */
 	const std::list<ISceneLight*>& lights = scene.GetLights();
 
+	unsigned int lightNum = 0;
+
 	// if ray is inside an object, don't sample light-sources (?)
-	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
 		const ISceneLight* light = *it;
 		// vector from intersection position to the light
 		const math::vec3f L = (light->GetPos() - rayInt.GetPos()).norm();
@@ -138,6 +709,23 @@ math::vec3f RayTracer::SampleDirectIllumination(
 
 		math::RayIntersection lightRayInt;
 
+		#if (USE_SHADOW_PHOTONS == 1)
+		if (!shadowPhotonMaps.empty()) {
+			const float shadowFraction = shadowPhotonMaps[lightNum]->GetShadowFraction(rayInt.GetPos(), rayInt.GetNrm(), shadowPhotonSearchRadius, SHADOW_PHOTON_SEARCH_COUNT, SHADOW_PHOTON_MIN_COUNT, &ctx->queryBuffer);
+
+			// fully occluded, nothing to add
+			if (shadowFraction == 1.0f) {
+				continue;
+			}
+
+			// fully lit, all shadow-rays would reach the light
+			if (shadowFraction == 0.0f) {
+				irr += objMatRefMod->GetIntensity(objMat, light, ray, lightRay, &rayInt);
+				continue;
+			}
+		}
+		#endif
+
 		if (light->GetRadius() > 0.0f) {
 			// area light, so must probe visibility to
 			// various points on the light's "surface"
@@ -151,7 +739,6 @@ math::vec3f RayTracer::SampleDirectIllumination(
 
 			math::vec3f areaLightPos;
 			math::vec3f areaLightDir;
-			math::vec3f emissionDir;
 
 			for (unsigned int i = 0; i < numLightSamples; i++) {
 				lightRayInt.SetObj(NULL);
@@ -159,7 +746,7 @@ math::vec3f RayTracer::SampleDirectIllumination(
 				#if (MONTE_CARLO_SOFT_SHADOWS == 0)
 				areaLightPos = light->GetPos() + (areaLightSurfacePosOffsets[i] * light->GetRadius());
 				#else
-				areaLightPos = light->GetPos() + (emissionDir.rrandomize(rng) * light->GetRadius());
+				areaLightPos = SampleAreaLightPos(light, rayInt.GetPos(), i, numLightSamples, ctx->rng);
 				#endif
 
 				// vector toward the light surface position
@@ -169,7 +756,7 @@ math::vec3f RayTracer::SampleDirectIllumination(
 
 				// note: areaLightPos must fall within the scene bounds
 				// note: take the light's own radius into account here?
-				const bool haveShadowCaster = (scene.GetOccludingObject(threadNum, areaLightRay, &lightRayInt, light->GetPos()) != NULL);
+				const bool haveShadowCaster = (scene.GetOccludingObject(ctx, areaLightRay, &lightRayInt, light->GetPos()) != NULL);
 				const bool fakeShadowCaster = haveShadowCaster &&
 					((lightRayInt.GetPos() - rayInt.GetPos()).sqLen3D() >
 					(light->GetPos() - rayInt.GetPos()).sqLen3D());
@@ -178,7 +765,7 @@ math::vec3f RayTracer::SampleDirectIllumination(
 					hitLightSamples++;
 				}
 
-				profiler->IncCounter(Profiler::COUNTER_RAY, threadNum, rayDepth, RAY_TYPE_SHADOW);
+				profiler->IncCounter(Profiler::COUNTER_RAY, ctx->threadNum, rayDepth, RAY_TYPE_SHADOW);
 			}
 
 			// scale the intensity by how many light "surface"
@@ -202,7 +789,7 @@ math::vec3f RayTracer::SampleDirectIllumination(
 				*/
 			lightRayInt.SetObj(NULL);
 
-			const bool haveShadowCaster = (scene.GetOccludingObject(threadNum, lightRay, &lightRayInt, light->GetPos()) != NULL);
+			const bool haveShadowCaster = (scene.GetOccludingObject(ctx, lightRay, &lightRayInt, light->GetPos()) != NULL);
 			const bool fakeShadowCaster = haveShadowCaster &&
 				((lightRayInt.GetPos() - rayInt.GetPos()).sqLen3D() >
 				(light->GetPos() - rayInt.GetPos()).sqLen3D());
@@ -210,7 +797,6 @@ math::vec3f RayTracer::SampleDirectIllumination(
 			if (!haveShadowCaster || fakeShadowCaster) {
 				// evaluate non-approximate direct illumination under
 				// point-lights with ordinary shadow rays [Jensen, ch9]
-				// note: could also use "shadow photons" for this step
 				irr += objMatRefMod->GetIntensity(objMat, light, ray, lightRay, &rayInt); 
 
 				#if (DEBUG_ASSERTS_RAYTRACER == 1)
@@ -221,13 +807,19 @@ math::vec3f RayTracer::SampleDirectIllumination(
 			}
 		}
 
-		profiler->IncCounter(Profiler::COUNTER_RAY, threadNum, rayDepth, RAY_TYPE_SHADOW);
+		profiler->IncCounter(Profiler::COUNTER_RAY, ctx->threadNum, rayDepth, RAY_TYPE_SHADOW);
 	}
 
 	return irr;
 }
 
-math::vec3f RayTracer::GatherIrradianceEstimate(unsigned int threadNum, const math::RayIntersection* rayInt, const Scene& scene, RNGflt64* rng) {
+math::vec3f RayTracer::GatherIrradianceEstimate(
+	RenderContext* ctx,
+	const math::RayIntersection* rayInt,
+	const Scene& scene,
+	unsigned int rayDepth,
+	math::vec3f pathWgt
+) {
 	math::vec3f irr;
 	math::vec3f est;
 
@@ -235,71 +827,285 @@ math::vec3f RayTracer::GatherIrradianceEstimate(unsigned int threadNum, const ma
 	const Material*     objMat = obj->GetMaterial();
 
 	#if (NUM_IRRADIANCE_GATHER_RAYS <= 0)
-		threadNum = -1;
-		rng = rng;
+		IrradianceBatch* batch = irradianceBatches[ctx->threadNum];
+
+		if (batch->active) {
+			// defer the query until the current tile is done (or,
+			// in progressive mode, turn it into a visible point);
+			// the estimate will be added into the pixel by caller
+			math::vec3f wgt = pathWgt;
+			#if (IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY == 1)
+			wgt *= objMat->GetDiffuseReflectiveness();
+			#endif
+
+			batch->queries.push_back(PhotonMap::IrradianceQuery(rayInt->GetPos(), rayInt->GetNrm(), batch->weights.size()));
+			batch->weights.push_back(wgt);
+			batch->pixels.push_back(batch->pixelIdx);
+			batch->objects.push_back((rayDepth == 0)? obj: NULL);
+			batch->depths.push_back((rayDepth == 0)? (rayInt->GetPos() - scene.GetCamera()->GetPos()).len3D(): 0.0f);
+			return irr;
+		}
 
-		est = photonMap->GetIrradianceEstimate(rayInt->GetPos(), rayInt->GetNrm(), photonSearchRadius, photonSearchCount);
+		est = photonMap->GetSeededIrradianceEstimate(rayInt->GetPos(), rayInt->GetNrm(), photonSearchRadius, photonSearchCount, &batch->seedRadius, &ctx->queryBuffer);
 		#if (IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY == 1)
 		est *= objMat->GetDiffuseReflectiveness();
 		#endif
 		irr = est;
 	#else
+		rayDepth = rayDepth;
+		pathWgt = pathWgt;
+
 		// note: a (weighted) average over multiple diffuse rays
 		// reduces noise, but destroys caustics since these are
 		// stored in the same photon-map
-		unsigned int numSpecularObjects = 0;
-
-		for (unsigned int i = 0; i < NUM_IRRADIANCE_GATHER_RAYS; i++) {
-			math::vec3f gatherRayDir = -rayInt->GetNrm();
+		unsigned int numGatherRays = NUM_IRRADIANCE_GATHER_RAYS;
 
-			while (gatherRayDir.dot3D(rayInt->GetNrm()) < 0.0f) {
-				gatherRayDir.rrandomize(rng);
+		if (irradianceCache != NULL) {
+			// the cached gathers are averages over all rays
+			if (!irradianceCache->GetIrradiance(rayInt->GetPos(), rayInt->GetNrm(), &irr)) {
+				irr = GatherIrradianceRecord(ctx, rayInt, scene);
 			}
 
-			math::RaySegment gatherRay(rayInt->GetPos() + (gatherRayDir * 0.01f), gatherRayDir, false);
-			math::RayIntersection gatherRayInt;
+			irr *= numGatherRays;
+		} else {
+			RNGflt64* rng = ctx->rng;
 
-			if (scene.GetClosestObject(threadNum, gatherRay, &gatherRayInt) != NULL) {
-				const ISceneObject* gObj    = gatherRayInt.GetObj();
-				const Material*     gObjMat = gObj->GetMaterial();
+			for (unsigned int i = 0; i < NUM_IRRADIANCE_GATHER_RAYS; i++) {
+				// one ray per stratum, cosine-weighted so that the
+				// plain average of the estimates is the irradiance
+				float u;
+				float v;
 
-				if (!gObjMat->IsSpecularlyReflective()) {
-					est = photonMap->GetIrradianceEstimate(gatherRayInt.GetPos(), gatherRayInt.GetNrm(), photonSearchRadius, photonSearchCount);
-					#if (IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY == 1)
-					est *= gObjMat->GetDiffuseReflectiveness();
-					#endif
+				math::StratifiedSample(i, NUM_IRRADIANCE_GATHER_RAYS, (*rng)(), (*rng)(), &u, &v);
+
+				const math::vec3f gatherRayDir = math::CosineHemisphereSample(rayInt->GetNrm(), u, v);
+				const math::RaySegment gatherRay(rayInt->GetPos() + (gatherRayDir * 0.01f), gatherRayDir, false);
+
+				math::RayIntersection gatherRayInt;
+
+				if (TraceGatherRay(ctx, scene, gatherRay, &gatherRayInt, &est) == NULL)
+					continue;
+
+				if (!gatherRayInt.GetObj()->GetMaterial()->IsSpecularlyReflective()) {
 					irr += est;
 				} else {
-					numSpecularObjects += 1;
+					numGatherRays -= 1;
 				}
 			}
 		}
 
 		irr *= (IRRADIANCE_GATHER_RAY_WEIGHT);
-		est = photonMap->GetIrradianceEstimate(rayInt->GetPos(), rayInt->GetNrm(), photonSearchRadius, photonSearchCount);
+		// (the gather-ray hits are too scattered to seed queries)
+		est = photonMap->GetSeededIrradianceEstimate(rayInt->GetPos(), rayInt->GetNrm(), photonSearchRadius, photonSearchCount, &(irradianceBatches[ctx->threadNum]->seedRadius), &ctx->queryBuffer);
 		#if (IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY == 1)
 		est *= objMat->GetDiffuseReflectiveness();
 		#endif
 		est *= (1.0f - IRRADIANCE_GATHER_RAY_WEIGHT);
 		irr += est;
-		irr /= (NUM_IRRADIANCE_GATHER_RAYS + 1 - numSpecularObjects);
+		irr /= (numGatherRays + 1);
 	#endif
 
 	return irr;
 }
 
+// traces a final-gather ray; returns the object it hit (NULL if
+// none) and, unless that is specular, sets <est> to the estimate
+// of the irradiance the ray carries back
+const ISceneObject* RayTracer::TraceGatherRay(
+	RenderContext* ctx,
+	const Scene& scene,
+	const math::RaySegment& gatherRay,
+	math::RayIntersection* gatherRayInt,
+	math::vec3f* est
+) {
+	const ISceneObject* gObj = scene.GetClosestObject(ctx, gatherRay, gatherRayInt);
+
+	if (gObj == NULL) {
+		return NULL;
+	}
+
+	const Material* gObjMat = gObj->GetMaterial();
+
+	if (gObjMat->IsSpecularlyReflective()) {
+		return gObj;
+	}
+
+	#if (IRRADIANCE_LOD_QUERIES == 1)
+	*est = photonMap->GetIrradianceEstimateLOD(gatherRayInt->GetPos(), gatherRayInt->GetNrm(), gatherRay.GetPos(), photonSearchRadius, photonSearchCount);
+	#else
+	*est = photonMap->GetIrradianceEstimate(gatherRayInt->GetPos(), gatherRayInt->GetNrm(), photonSearchRadius, photonSearchCount, false, &ctx->queryBuffer);
+	#endif
+	#if (IRRADIANCE_ESTIMATE_MATERIAL_MULTIPLY == 1)
+	*est *= gObjMat->GetDiffuseReflectiveness();
+	#endif
+
+	return gObj;
+}
+
+// gathers the irradiance at <rayInt> over a grid of M (theta) by
+// N (phi) cosine-weighted strata of its hemisphere, and adds it
+// with its gradients (computed from the same strata) and its
+// validity radius to the irradiance cache [Ward and Heckbert,
+// 1992]; like the uncached gather, rays hitting a specular
+// surface count as the average of the others
+math::vec3f RayTracer::GatherIrradianceRecord(
+	RenderContext* ctx,
+	const math::RayIntersection* rayInt,
+	const Scene& scene
+) {
+	RNGflt64* rng = ctx->rng;
+
+	const unsigned int numRays = std::max(1, NUM_IRRADIANCE_GATHER_RAYS);
+
+	unsigned int M = std::max(1U, (unsigned int) (sqrtf(numRays)));
+
+	while ((numRays % M) != 0) {
+		M--;
+	}
+
+	const unsigned int N = numRays / M;
+	const float maxDist = std::numeric_limits<float>::max();
+
+	const math::vec3f& nrm = rayInt->GetNrm();
+
+	math::vec3f t;
+	math::vec3f b;
+	math::OrthonormalBasis(nrm, &t, &b);
+
+	// per stratum (j * N + k) the estimate and the hit distance
+	std::vector<math::vec3f>& ests = ctx->gatherEsts;
+	std::vector<float>& dists = ctx->gatherDists;
+	std::vector<unsigned char>& specular = ctx->gatherSpecular;
+
+	ests.assign(numRays, math::vec3f());
+	dists.assign(numRays, maxDist);
+	specular.assign(numRays, 0);
+
+	IrradianceCache::Record record;
+	math::vec3f estSum;
+
+	unsigned int numDiffuseRays = 0;
+	float invDistSum = 0.0f;
+
+	for (unsigned int j = 0; j < M; j++) {
+		for (unsigned int k = 0; k < N; k++) {
+			const unsigned int i = j * N + k;
+
+			// sin^2(theta) is uniform for cosine-weighted directions
+			const float sinTheta = sqrtf((j + (*rng)()) / M);
+			const float cosTheta = sqrtf(std::max(0.0f, 1.0f - sinTheta * sinTheta));
+			const float phi = 2.0f * M_PI * ((k + (*rng)()) / N);
+
+			const math::vec3f gatherRayDir = ((t * (sinTheta * cosf(phi)) + b * (sinTheta * sinf(phi)) + nrm * cosTheta).norm());
+			const math::RaySegment gatherRay(rayInt->GetPos() + (gatherRayDir * 0.01f), gatherRayDir, false);
+
+			math::RayIntersection gatherRayInt;
+
+			if (TraceGatherRay(ctx, scene, gatherRay, &gatherRayInt, &ests[i]) != NULL) {
+				dists[i] = (gatherRayInt.GetPos() - rayInt->GetPos()).len3D();
+				specular[i] = gatherRayInt.GetObj()->GetMaterial()->IsSpecularlyReflective();
+			}
+
+			if (!specular[i]) {
+				estSum += ests[i];
+				numDiffuseRays += 1;
+			}
+
+			invDistSum += (1.0f / std::max(dists[i], 1e-3f));
+
+			// rotational gradient: tilting the normal towards
+			// <gatherRayDir> raises the cosine weight of this
+			// stratum by tan(theta) per radian
+			record.rotGrad[0] += (nrm.cross(gatherRayDir) * (ests[i].x / std::max(cosTheta, 0.1f)));
+			record.rotGrad[1] += (nrm.cross(gatherRayDir) * (ests[i].y / std::max(cosTheta, 0.1f)));
+			record.rotGrad[2] += (nrm.cross(gatherRayDir) * (ests[i].z / std::max(cosTheta, 0.1f)));
+		}
+	}
+
+	const math::vec3f estAvg = (numDiffuseRays > 0)? (estSum / numDiffuseRays): math::vec3f();
+
+	for (unsigned int i = 0; i < numRays; i++) {
+		if (specular[i]) {
+			ests[i] = estAvg;
+		}
+	}
+
+	for (unsigned int c = 0; c < 3; c++) {
+		record.rotGrad[c] /= numRays;
+	}
+
+	// translational gradient: the change in the solid angles of
+	// (and in the occlusion between) neighboring strata as the
+	// point moves, which depends on the distances to their hits
+	for (unsigned int k = 0; k < N; k++) {
+		const float phiC = 2.0f * M_PI * ((k + 0.5f) / N);
+		const float phiM = 2.0f * M_PI * (k / float(N));
+
+		const math::vec3f uk = t * cosf(phiC) + b * sinf(phiC);
+		const math::vec3f vk = t * cosf(phiM + M_PI * 0.5f) + b * sinf(phiM + M_PI * 0.5f);
+
+		const unsigned int km = (k + N - 1) % N;
+
+		for (unsigned int j = 0; j < M; j++) {
+			const float sinThetaM = sqrtf(j / float(M));
+			const float sinThetaP = sqrtf((j + 1) / float(M));
+
+			const unsigned int i = j * N + k;
+
+			if (j > 0) {
+				const unsigned int ij = (j - 1) * N + k;
+				const float wgt = (2.0f * M_PI / N) * sinThetaM * (1.0f - sinThetaM * sinThetaM) / std::min(dists[i], dists[ij]);
+
+				for (unsigned int c = 0; c < 3; c++) {
+					record.trnGrad[c] += (uk * (wgt * (ests[i][c] - ests[ij][c]) * M_1_PI));
+				}
+			}
+
+			if (N > 1) {
+				const unsigned int ik = j * N + km;
+				const float wgt = (sinThetaP - sinThetaM) / std::min(dists[i], dists[ik]);
+
+				for (unsigned int c = 0; c < 3; c++) {
+					record.trnGrad[c] += (vk * (wgt * (ests[i][c] - ests[ik][c]) * M_1_PI));
+				}
+			}
+		}
+	}
+
+	record.pos = rayInt->GetPos();
+	record.nrm = nrm;
+	record.irr = estAvg;
+	record.radius = numRays / invDistSum;
+
+	// the gradients predict the irradiance poorly beyond the
+	// distance over which they would change it completely
+	for (unsigned int c = 0; c < 3; c++) {
+		const float gradLen = record.trnGrad[c].len3D();
+
+		if (gradLen > 0.0f) {
+			record.radius = std::min(record.radius, record.irr[c] / gradLen);
+		}
+	}
+
+	record.radius = std::max(irradianceCacheMinRadius, std::min(irradianceCacheMaxRadius, record.radius));
+
+	irradianceCache->AddRecord(record);
+	return record.irr;
+}
+
 
 
 
 
 
 math::vec3f RayTracer::ShadeRayPM(
-	unsigned int threadNum,
+	RenderContext* ctx,
 	const math::RaySegment& ray,
 	const math::RayIntersection& rayInt,
 	const Scene& scene,
-	RNGflt64* rng,
-	unsigned int rayDepth
+	unsigned int rayDepth,
+	const math::vec3f& pathWgt,
+	const math::vec3f& rayWgt
 ) {
 	math::vec3f irr;
 
@@ -312,13 +1118,13 @@ math::vec3f RayTracer::ShadeRayPM(
 	// illumination, then any surface visible from
 	// the light-source will not be counted twice)
 	if (objMat->IsSpecularlyReflective()) {
-		irr += SampleDirectIllumination(threadNum, scene, ray, rayInt, rng, rayDepth);
+		irr += SampleDirectIllumination(ctx, scene, ray, rayInt, rayDepth);
 	}
 	#endif
 
 	if (!objMat->IsSpecularlyReflective()) {
 		// completely non-specular surface, use the irradiance estimate
-		irr += GatherIrradianceEstimate(threadNum, &rayInt, scene, rng);
+		irr += GatherIrradianceEstimate(ctx, &rayInt, scene, rayDepth, pathWgt * rayWgt);
 	} else {
 		// note: lights are not treated as intersectable objects, so
 		// when PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY is 0 specular
@@ -330,7 +1136,7 @@ math::vec3f RayTracer::ShadeRayPM(
 		const math::RaySegment reflectRay(P, R, ray.IsInside());
 
 		// evaluate via standard raytracing
-		irr += (TraceRay(threadNum, reflectRay, scene, rng, rayDepth + 1, RAY_TYPE_REFLECT) * objMat->GetSpecularReflectiveness());
+		PushRay(ctx, reflectRay, rayWgt * objMat->GetSpecularReflectiveness(), rayDepth + 1, RAY_TYPE_REFLECT);
 
 		if (objMat->IsSpecularlyRefractive()) {
 			// if going out of an object, switch refr. indices and invert normal
@@ -345,7 +1151,6 @@ math::vec3f RayTracer::ShadeRayPM(
 			if (R != N) {
 				if (objMat->GetBeerCoefficient() > 0.0f) {
 					const math::vec3f absorbance = objMat->GetDiffuseReflectiveness() * objMat->GetBeerCoefficient() * -(rayInt.GetDistance());
-					const math::vec3f refractIrr = (TraceRay(threadNum, refractRay, scene, rng, rayDepth + 1, RAY_TYPE_REFRACT) * objMat->GetSpecularRefractiveness());
 
 					math::vec3f transparency;
 						transparency.x = expf(absorbance.x);
@@ -353,17 +1158,11 @@ math::vec3f RayTracer::ShadeRayPM(
 						transparency.z = expf(absorbance.z);
 
 					if (transparency.sqLen3D() > 0.001f) {
-						irr += (refractIrr * transparency.norm());
+						PushRay(ctx, refractRay, rayWgt * objMat->GetSpecularRefractiveness() * transparency.norm(), rayDepth + 1, RAY_TYPE_REFRACT);
 					}
 				} else {
-					irr += (TraceRay(threadNum, refractRay, scene, rng, rayDepth + 1, RAY_TYPE_REFRACT) * objMat->GetSpecularRefractiveness());
+					PushRay(ctx, refractRay, rayWgt * objMat->GetSpecularRefractiveness(), rayDepth + 1, RAY_TYPE_REFRACT);
 				}
-
-				#if (DEBUG_ASSERTS_RAYTRACER == 1)
-				assert(irr.x != M_INF() && irr.x != M_NAN());
-				assert(irr.y != M_INF() && irr.y != M_NAN());
-				assert(irr.z != M_INF() && irr.z != M_NAN());
-				#endif
 			} else {
 				// total internal reflection; spawn a
 				// dedicated internal reflection ray
@@ -378,17 +1177,17 @@ math::vec3f RayTracer::ShadeRayPM(
 
 
 math::vec3f RayTracer::ShadeRayRT(
-	unsigned int threadNum,
+	RenderContext* ctx,
 	const math::RaySegment& ray,
 	const math::RayIntersection& rayInt,
 	const Scene& scene,
-	RNGflt64* rng,
-	unsigned int rayDepth
+	unsigned int rayDepth,
+	const math::vec3f& rayWgt
 ) {
 	const ISceneObject* obj    = rayInt.GetObj();
 	const Material*     objMat = obj->GetMaterial();
 
-	math::vec3f irr = SampleDirectIllumination(threadNum, scene, ray, rayInt, rng, rayDepth);
+	math::vec3f irr = SampleDirectIllumination(ctx, scene, ray, rayInt, rayDepth);
 
 	if (objMat->IsSpecularlyReflective()) {
 		const math::vec3f& N = (ray.IsInside())? (-rayInt.GetNrm()): (rayInt.GetNrm());
@@ -396,13 +1195,7 @@ math::vec3f RayTracer::ShadeRayRT(
 		const math::vec3f  P = rayInt.GetPos() + R * 0.01f;
 		const math::RaySegment reflectRay(P, R, ray.IsInside());
 
-		irr += (TraceRay(threadNum, reflectRay, scene, rng, rayDepth + 1, RAY_TYPE_REFLECT) * objMat->GetSpecularReflectiveness());
-
-		#if (DEBUG_ASSERTS_RAYTRACER == 1)
-		assert(irr.x != M_INF() && irr.x != M_NAN());
-		assert(irr.y != M_INF() && irr.y != M_NAN());
-		assert(irr.z != M_INF() && irr.z != M_NAN());
-		#endif
+		PushRay(ctx, reflectRay, rayWgt * objMat->GetSpecularReflectiveness(), rayDepth + 1, RAY_TYPE_REFLECT);
 	}
 
 	if (objMat->IsSpecularlyRefractive()) {
@@ -439,7 +1232,6 @@ math::vec3f RayTracer::ShadeRayRT(
 
 			if (objMat->GetBeerCoefficient() > 0.0f) {
 				const math::vec3f absorbance = objMat->GetDiffuseReflectiveness() * objMat->GetBeerCoefficient() * -(rayInt.GetDistance());
-				const math::vec3f refractIrr = (TraceRay(threadNum, refractRay, scene, rng, rayDepth + 1, RAY_TYPE_REFRACT) * objMat->GetSpecularRefractiveness());
 
 				math::vec3f transparency;
 					transparency.x = expf(absorbance.x);
@@ -447,17 +1239,11 @@ math::vec3f RayTracer::ShadeRayRT(
 					transparency.z = expf(absorbance.z);
 
 				if (transparency.sqLen3D() > 0.001f) {
-					irr += (refractIrr * transparency.norm());
+					PushRay(ctx, refractRay, rayWgt * objMat->GetSpecularRefractiveness() * transparency.norm(), rayDepth + 1, RAY_TYPE_REFRACT);
 				}
 			} else {
-				irr += (TraceRay(threadNum, refractRay, scene, rng, rayDepth + 1, RAY_TYPE_REFRACT) * objMat->GetSpecularRefractiveness());
+				PushRay(ctx, refractRay, rayWgt * objMat->GetSpecularRefractiveness(), rayDepth + 1, RAY_TYPE_REFRACT);
 			}
-
-			#if (DEBUG_ASSERTS_RAYTRACER == 1)
-			assert(irr.x != M_INF() && irr.x != M_NAN());
-			assert(irr.y != M_INF() && irr.y != M_NAN());
-			assert(irr.z != M_INF() && irr.z != M_NAN());
-			#endif
 		} else {
 			// total internal reflection; see ShadeRayPM
 		}
@@ -468,391 +1254,624 @@ math::vec3f RayTracer::ShadeRayRT(
 
 
 
+// traces <ray> and every reflected or refracted ray spawned
+// below it; instead of recursing, ShadeRay* push those onto
+// the context's ray-stack along with their throughput and the
+// stack is drained here, so each branch's irradiance is added
+// scaled by the throughput it was queued with (<pathWgt> is
+// that of the whole tree, for deferred queries) and branches
+// can be culled before they are ever traced, see PushRay
+//
+// if <rayInt> is not NULL it holds the closest intersection
+// of <ray> (found earlier, eg. into the G-buffer) which will
+// not be searched for again
 math::vec3f RayTracer::TraceRay(
-	unsigned int threadNum,
+	RenderContext* ctx,
 	const math::RaySegment& ray,
 	const Scene& scene,
-	RNGflt64* rng,
 	unsigned int rayDepth,
-	unsigned int rayType
+	unsigned int rayType,
+	const math::vec3f& pathWgt,
+	const math::RayIntersection* rayInt
 ) {
 	math::vec3f irr;
 
-	if (rayDepth < maxRayDepth) {
-		profiler->IncCounter(Profiler::COUNTER_RAY, threadNum, rayDepth, rayType);
+	if (rayDepth >= maxRayDepth) {
+		return irr;
+	}
 
-		// get the closest object this ray intersects (if any)
-		math::RayIntersection rayInt;
+	// get the closest object this ray intersects (if any)
+	math::RayIntersection rootInt;
 
-		if (scene.GetClosestObject(threadNum, ray, &rayInt) != NULL) {
-			if (photonMapping) {
-				#if (DEBUG_RENDER_PHOTON_MAP == 1)
-				irr = photonMap->GetIrradianceEstimate(rayInt.GetPos(), rayInt.GetNrm(), 0.05f, 1);
-				irr = ((irr.sqLen3D() > 0.0f)? math::UVECf: math::NVECf);
-				#else
-				irr += ShadeRayPM(threadNum, ray, rayInt, scene, rng, rayDepth);
-				#endif
-			} else {
-				irr += ShadeRayRT(threadNum, ray, rayInt, scene, rng, rayDepth);
-			}
+	if (rayInt == NULL) {
+		profiler->IncCounter(Profiler::COUNTER_RAY, ctx->threadNum, rayDepth, rayType);
 
-			#if (DEBUG_ASSERTS_RAYTRACER == 1)
-			assert(irr.x != M_INF() && irr.x != M_NAN());
-			assert(irr.y != M_INF() && irr.y != M_NAN());
-			assert(irr.z != M_INF() && irr.z != M_NAN());
-			#endif
+		if (scene.GetClosestObject(ctx, ray, &rootInt) == NULL) {
+			return irr;
 		}
-	}
 
-	return irr;
-}
+		rayInt = &rootInt;
+	}
 
+	// rays below the stack's current top belong to an outer
+	// TraceRay call (if any) and are not ours to trace
+	std::vector<RenderContext::PendingRay>& rayStack = ctx->rayStack;
+	const size_t stackBase = rayStack.size();
 
+	irr += ShadeRay(ctx, ray, *rayInt, scene, rayDepth, pathWgt, math::UVECf);
 
-void RayTracer::TraceRayThread(unsigned int threadNum, SDLWindow& window, const Scene& scene, RNGflt64* rng) {
-	static boost::mutex progressMutex;
+	while (rayStack.size() > stackBase) {
+		// copy, ShadeRay can push new rays
+		const RenderContext::PendingRay node = rayStack.back();
 
-	const unsigned int rows = window.GetSizeY() / numThreads;
-	const unsigned int rest = (threadNum == (numThreads - 1))? (window.GetSizeY() % numThreads): 0;
-	const unsigned int ymin = threadNum * rows;
-	const unsigned int ymax = ymin + rows + rest;
+		rayStack.pop_back();
 
-	const float yrange = ymax - ymin;
-	const Camera* camera = scene.GetCamera();
+		profiler->IncCounter(Profiler::COUNTER_RAY, ctx->threadNum, node.depth, node.type);
 
-	unsigned int prevProgress = 0;
-	unsigned int currProgress = 0;
+		math::RayIntersection nodeInt;
 
-	if (camera->RenderDOF()) {
-		// Depth of Field (use more advanced camera model)
-		// note: the focal-plane faces *toward* the camera
-		// so we must displace it by a *negative* distance
-		// along the viewing direction
-		const PlaneSceneObject focalPlane(math::Plane(-camera->GetZDir(), -camera->GetFocalPlaneDistance()));
+		if (scene.GetClosestObject(ctx, node.ray, &nodeInt) != NULL) {
+			irr += (ShadeRay(ctx, node.ray, nodeInt, scene, node.depth, pathWgt, node.wgt) * node.wgt);
+		}
+	}
+
+	return irr;
+}
+
+// shades the (already found) intersection <rayInt> of <ray>,
+// which reaches the eye with throughput <rayWgt>; the result
+// is not yet scaled by it
+math::vec3f RayTracer::ShadeRay(
+	RenderContext* ctx,
+	const math::RaySegment& ray,
+	const math::RayIntersection& rayInt,
+	const Scene& scene,
+	unsigned int rayDepth,
+	math::vec3f pathWgt,
+	const math::vec3f& rayWgt
+) {
+	math::vec3f irr;
+
+	if (photonMapping) {
+		#if (DEBUG_RENDER_PHOTON_MAP == 1)
+		pathWgt = pathWgt;
+
+		irr = photonMap->GetIrradianceEstimate(rayInt.GetPos(), rayInt.GetNrm(), 0.05f, 1, false, &ctx->queryBuffer);
+		irr = ((irr.sqLen3D() > 0.0f)? math::UVECf: math::NVECf);
+		#else
+		irr += ShadeRayPM(ctx, ray, rayInt, scene, rayDepth, pathWgt, rayWgt);
+		#endif
+	} else {
+		irr += ShadeRayRT(ctx, ray, rayInt, scene, rayDepth, rayWgt);
+	}
+
+	#if (DEBUG_ASSERTS_RAYTRACER == 1)
+	assert(irr.x != M_INF() && irr.x != M_NAN());
+	assert(irr.y != M_INF() && irr.y != M_NAN());
+	assert(irr.z != M_INF() && irr.z != M_NAN());
+	#endif
+
+	return irr;
+}
+
+// queues a ray spawned at depth <rayDepth> - 1 for TraceRay,
+// unless it is too deep or would contribute too little: rays
+// with no throughput component above RAY_THROUGHPUT_CUTOFF are
+// dropped outright, and (if rayRoulette) from RAY_ROULETTE_MIN_DEPTH
+// onward the rest survive with a probability equal to their largest
+// such component (by which their throughput is then divided, so the
+// expected contribution stays the same) [Arvo and Kirk, 1990]
+void RayTracer::PushRay(
+	RenderContext* ctx,
+	const math::RaySegment& ray,
+	const math::vec3f& rayWgt,
+	unsigned int rayDepth,
+	unsigned int rayType
+) {
+	if (rayDepth >= maxRayDepth) {
+		return;
+	}
+
+	const float maxWgt = std::max(rayWgt.x, std::max(rayWgt.y, rayWgt.z));
+
+	if (maxWgt < RAY_THROUGHPUT_CUTOFF) {
+		return;
+	}
+
+	if (rayRoulette && rayDepth >= RAY_ROULETTE_MIN_DEPTH && maxWgt < 1.0f) {
+		if ((*ctx->rng)() >= maxWgt) {
+			return;
+		}
+
+		ctx->rayStack.push_back(RenderContext::PendingRay(ray, rayWgt / maxWgt, rayDepth, rayType));
+	} else {
+		ctx->rayStack.push_back(RenderContext::PendingRay(ray, rayWgt, rayDepth, rayType));
+	}
+}
+
+
+
+// traces all primary rays for pixel <x, y>; the returned value
+// is already normalized by the number of rays, and each path's
+// (pre-normalized) weight is passed down for deferred queries
+math::vec3f RayTracer::TracePixel(
+	RenderContext* ctx,
+	const SDLWindow& window,
+	const Scene& scene,
+	unsigned int x,
+	unsigned int y
+) {
+	const Camera* camera = scene.GetCamera();
+
+	math::vec3f pxlIrr;
+
+	if (camera->RenderDOF()) {
+		// Depth of Field (use more advanced camera model)
+		// note: the focal-plane faces *toward* the camera
+		// so we must displace it by a *negative* distance
+		// along the viewing direction
+		const PlaneSceneObject focalPlane(math::Plane(-camera->GetZDir(), -camera->GetFocalPlaneDistance()));
 
 		const int   maxLensAperture = camera->GetLensAperture();
 		const int   minLensAperture = -maxLensAperture;
 		const float dofNormalizer   = float((maxLensAperture * 2.0f + 1.0f) * (maxLensAperture * 2.0f + 1.0f));
 
-		for (unsigned int y = ymin; y < ymax; y++) {
-			for (unsigned int x = 0; x < window.GetSizeX(); x++) {
-				if (antiAliasing) {
-					// TODO: combine AA with DOF
-				} else {
-					math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
-					math::RayIntersection fplaneInt;
-
-					math::vec3f pxlIrr(math::NVECf);
+		if (antiAliasing) {
+			// TODO: combine AA with DOF
+		} else {
+			math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+			math::RayIntersection fplaneInt;
 
-					if (focalPlane.IntersectRay(pxlRay, &fplaneInt)) {
-						for (int n = minLensAperture; n <= maxLensAperture; n++) {
-							for (int m = minLensAperture; m <= maxLensAperture; m++) {
-								const math::vec3f pxlLocation(camera->GetPixelPos(window, x + m, y + n));
+			if (focalPlane.IntersectRay(pxlRay, &fplaneInt)) {
+				for (int n = minLensAperture; n <= maxLensAperture; n++) {
+					for (int m = minLensAperture; m <= maxLensAperture; m++) {
+						const math::vec3f pxlLocation(camera->GetPixelPos(window, x + m, y + n));
 
-								pxlRay.SetPos(pxlLocation);
-								pxlRay.SetDir((fplaneInt.GetPos()).norm());
-								pxlIrr += TraceRay(threadNum, pxlRay, scene, rng, 0, RAY_TYPE_PRIMARY_FP);
-							}
-						}
+						pxlRay.SetPos(pxlLocation);
+						pxlRay.SetDir((fplaneInt.GetPos()).norm());
+						pxlIrr += TraceRay(ctx, pxlRay, scene, 0, RAY_TYPE_PRIMARY_FP, math::UVECf / dofNormalizer);
 					}
+				}
+			}
+
+			pxlIrr /= dofNormalizer;
+		}
+	} else {
+		// use Pinhole camera
+		if (antiAliasing) {
+			math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+			pxlIrr += TraceRay(ctx, pxlRay, scene, 0, RAY_TYPE_PRIMARY, math::UVECf / 9.0f);
+
+			for (int i = -1; i <= 1; i++) {
+				for (int j = -1; j <= 1; j++) {
+					if (i == 0 && j == 0)
+						continue;
 
-					window.SetPixel(x, y, pxlIrr / dofNormalizer);
+					pxlRay.SetDir((((pxlRay.GetDir() + camera->GetPixelDir(window, x + i, y + j))) * 0.5f).norm());
+					pxlIrr += TraceRay(ctx, pxlRay, scene, 0, RAY_TYPE_PRIMARY_AA, math::UVECf / 9.0f);
 				}
 			}
 
-			if (incrementalRender) {
-				window.SwapBuffers(numThreads);
+			pxlIrr /= 9.0f;
+		} else {
+			const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+
+			if (useGBuffer) {
+				// the ray was already traced (and counted)
+				const math::RayIntersection& pxlRayInt = gBuffer[y * window.GetSizeX() + x];
+
+				if (pxlRayInt.GetObj() != NULL) {
+					pxlIrr += TraceRay(ctx, pxlRay, scene, 0, RAY_TYPE_PRIMARY, math::UVECf, &pxlRayInt);
+				}
+			} else {
+				pxlIrr += TraceRay(ctx, pxlRay, scene, 0, RAY_TYPE_PRIMARY, math::UVECf);
 			}
+		}
+	}
+
+	return pxlIrr;
+}
+
+// resolve all deferred queries of the current tile and add
+// their weighted contributions to the tile-pixel buffer
+void RayTracer::ResolveIrradianceBatch(RenderContext* ctx, IrradianceBatch* batch, math::vec3f* tilePixels) {
+	if (batch->queries.empty()) {
+		return;
+	}
+
+	#if (ADAPTIVE_IRRADIANCE_SAMPLING == 1)
+	// estimates only the queries that can not be interpolated
+	ResolveIrradianceLattice(ctx, batch);
+	#else
+	photonMap->GetIrradianceEstimates(batch->queries, photonSearchRadius, photonSearchCount, &ctx->queryBuffer);
+	#endif
 
-			currProgress = ((y - ymin) / yrange) * 100;
+	for (size_t i = 0; i < batch->queries.size(); i++) {
+		const PhotonMap::IrradianceQuery& query = batch->queries[i];
+
+		tilePixels[batch->pixels[query.id]] += (batch->weights[query.id] * query.irr);
+	}
 
-			if ((currProgress > prevProgress) && ((currProgress % 10) == 0)) {
-				prevProgress = currProgress;
+	batch->numQueries += batch->queries.size();
+	batch->Clear();
+}
 
-				boost::mutex::scoped_lock lock(progressMutex);
+#if (ADAPTIVE_IRRADIANCE_SAMPLING == 1)
+// resolves the queries of a tile's batch (in place), making
+// those at the first surfaces seen through the tile's pixels
+// only at the corners of a lattice that is refined wherever
+// the pixels of a cell can not be interpolated from these
+void RayTracer::ResolveIrradianceLattice(RenderContext* ctx, IrradianceBatch* batch) {
+	const unsigned int tileSize = RENDER_TILE_SIZE;
+	const unsigned int cellSize = IRRADIANCE_LATTICE_SPACING;
+
+	std::vector<PhotonMap::IrradianceQuery>& queries = batch->queries;
+	std::vector<PhotonMap::IrradianceQuery> evalQueries;
+
+	// per tile-pixel the query made at the first surface seen
+	// through it, or -1 if none or (eg. with anti-aliasing or
+	// depth of field) more than one was made
+	std::vector<int> pixelQueries(tileSize * tileSize, -1);
+	std::vector<int> pixelCounts(tileSize * tileSize, 0);
+	// per query whether it was evaluated or interpolated
+	std::vector<unsigned char> queryStates(queries.size(), IrradianceBatch::QUERY_STATE_PENDING);
+
+	for (unsigned int i = 0; i < queries.size(); i++) {
+		if (batch->objects[i] != NULL) {
+			pixelQueries[batch->pixels[i]] = i;
+			pixelCounts[batch->pixels[i]] += 1;
+		}
+	}
 
-				std::cout << "[RayTracer::TraceRayThread]";
-				std::cout << " thread: " << threadNum << ", progress: " << currProgress << "%";
-				std::cout << " (row " << (y - ymin) << " of " << (ymax - ymin) << ")";
-				std::cout << std::endl;
+	for (unsigned int i = 0; i < queries.size(); i++) {
+		if (batch->objects[i] == NULL || pixelCounts[batch->pixels[i]] != 1) {
+			if (batch->objects[i] != NULL) {
+				pixelQueries[batch->pixels[i]] = -1;
 			}
+
+			queryStates[i] = IrradianceBatch::QUERY_STATE_EVALUATED;
+			evalQueries.push_back(queries[i]);
 		}
-	} else {
-		// use Pinhole camera
-		for (unsigned int y = ymin; y < ymax; y++) {
-			for (unsigned int x = 0; x < window.GetSizeX(); x++) {
-				if (antiAliasing) {
-					math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
-					math::vec3f pxlIrr(TraceRay(threadNum, pxlRay, scene, rng, 0, RAY_TYPE_PRIMARY));
-
-					for (int i = -1; i <= 1; i++) {
-						for (int j = -1; j <= 1; j++) {
-							if (i == 0 && j == 0)
-								continue;
-
-							pxlRay.SetDir((((pxlRay.GetDir() + camera->GetPixelDir(window, x + i, y + j))) * 0.5f).norm());
-							pxlIrr += TraceRay(threadNum, pxlRay, scene, rng, 0, RAY_TYPE_PRIMARY_AA);
-						}
-					}
+	}
 
-					window.SetPixel(x, y, pxlIrr / 9.0f);
-				} else {
-					const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
-					const math::vec3f& pxlIrr = TraceRay(threadNum, pxlRay, scene, rng, 0, RAY_TYPE_PRIMARY);
+	std::vector<IrradianceCell> cells;
+	std::vector<IrradianceCell> nextCells;
+
+	for (unsigned int y = 0; y < (tileSize - 1); y += cellSize) {
+		for (unsigned int x = 0; x < (tileSize - 1); x += cellSize) {
+			cells.push_back(IrradianceCell(x, y, std::min(x + cellSize, tileSize - 1), std::min(y + cellSize, tileSize - 1)));
+		}
+	}
 
-					window.SetPixel(x, y, pxlIrr);
+	// every level evaluates the corners of its cells as one batch
+	while (!cells.empty() || !evalQueries.empty()) {
+		for (unsigned int n = 0; n < cells.size(); n++) {
+			const IrradianceCell& cell = cells[n];
+			const int corners[4] = {
+				pixelQueries[cell.y0 * tileSize + cell.x0],
+				pixelQueries[cell.y0 * tileSize + cell.x1],
+				pixelQueries[cell.y1 * tileSize + cell.x0],
+				pixelQueries[cell.y1 * tileSize + cell.x1],
+			};
+
+			for (unsigned int k = 0; k < 4; k++) {
+				if (corners[k] >= 0 && queryStates[corners[k]] != IrradianceBatch::QUERY_STATE_EVALUATED) {
+					queryStates[corners[k]] = IrradianceBatch::QUERY_STATE_EVALUATED;
+					evalQueries.push_back(queries[corners[k]]);
 				}
 			}
+		}
 
-			if (incrementalRender) {
-				window.SwapBuffers(numThreads);
-			}
+		photonMap->GetIrradianceEstimates(evalQueries, photonSearchRadius, photonSearchCount, &ctx->queryBuffer);
+
+		for (unsigned int i = 0; i < evalQueries.size(); i++) {
+			queries[evalQueries[i].id].irr = evalQueries[i].irr;
+		}
 
-			currProgress = ((y - ymin) / yrange) * 100;
+		evalQueries.clear();
+		nextCells.clear();
 
-			if ((currProgress > prevProgress) && ((currProgress % 10) == 0)) {
-				prevProgress = currProgress;
+		for (unsigned int n = 0; n < cells.size(); n++) {
+			const IrradianceCell& cell = cells[n];
 
-				boost::mutex::scoped_lock lock(progressMutex);
+			if (InterpolateIrradianceCell(batch, cell, pixelQueries, &queryStates)) {
+				continue;
+			}
+
+			// split the cell in half along each axis it spans
+			// more than one pixel-step in (cells that are one
+			// step wide have nothing but corners)
+			const unsigned int xm = ((cell.x1 - cell.x0) > 1)? ((cell.x0 + cell.x1) >> 1): cell.x1;
+			const unsigned int ym = ((cell.y1 - cell.y0) > 1)? ((cell.y0 + cell.y1) >> 1): cell.y1;
 
-				std::cout << "[RayTracer::TraceRayThread]";
-				std::cout << " thread: " << threadNum << ", progress: " << currProgress << "%";
-				std::cout << " (row " << (y - ymin) << " of " << (ymax - ymin) << ")";
-				std::cout << std::endl;
+			if (xm == cell.x1 && ym == cell.y1) {
+				continue;
 			}
+
+			nextCells.push_back(IrradianceCell(cell.x0, cell.y0, xm, ym));
+
+			if (xm != cell.x1) { nextCells.push_back(IrradianceCell(xm, cell.y0, cell.x1, ym)); }
+			if (ym != cell.y1) { nextCells.push_back(IrradianceCell(cell.x0, ym, xm, cell.y1)); }
+			if (xm != cell.x1 && ym != cell.y1) { nextCells.push_back(IrradianceCell(xm, ym, cell.x1, cell.y1)); }
 		}
+
+		cells.swap(nextCells);
+	}
+
+	for (unsigned int i = 0; i < queries.size(); i++) {
+		batch->numInterpolated += (queryStates[i] == IrradianceBatch::QUERY_STATE_INTERPOLATED);
 	}
 }
 
+// if every pixel of <cell> with a first-surface query matches
+// the (evaluated) corner queries closely enough, set all those
+// not evaluated to the bilinear interpolation of the corners
+bool RayTracer::InterpolateIrradianceCell(
+	IrradianceBatch* batch,
+	const IrradianceCell& cell,
+	const std::vector<int>& pixelQueries,
+	std::vector<unsigned char>* queryStates
+) {
+	const unsigned int tileSize = RENDER_TILE_SIZE;
+	std::vector<PhotonMap::IrradianceQuery>& queries = batch->queries;
+
+	const int corners[4] = {
+		pixelQueries[cell.y0 * tileSize + cell.x0],
+		pixelQueries[cell.y0 * tileSize + cell.x1],
+		pixelQueries[cell.y1 * tileSize + cell.x0],
+		pixelQueries[cell.y1 * tileSize + cell.x1],
+	};
 
+	float minIrr = std::numeric_limits<float>::max();
+	float maxIrr = 0.0f;
 
+	for (unsigned int k = 0; k < 4; k++) {
+		if (corners[k] < 0) {
+			return false;
+		}
 
+		const math::vec3f& irr = queries[corners[k]].irr;
 
+		minIrr = std::min(minIrr, irr.x + irr.y + irr.z);
+		maxIrr = std::max(maxIrr, irr.x + irr.y + irr.z);
+	}
 
-void RayTracer::TracePhoton(
-	unsigned int threadNum,
-	const Scene& scene,
-	PhotonMap::Map* map,
-	PhotonMap::Photon* photon,
-	RNGflt64* rng,
-	unsigned int photonDepth,
-	bool inside
-) {
-	if (photonDepth < maxPhotonDepth) {
-		math::RaySegment ray(photon->GetPos(), photon->GetDirection());
-		math::RayIntersection rayInt;
+	if ((maxIrr - minIrr) > (maxIrr * IRRADIANCE_INTERP_MAX_IRRADIANCE_CHANGE)) {
+		return false;
+	}
 
-		if (scene.GetClosestObject(threadNum, ray, &rayInt) != NULL) {
-			const ISceneObject* obj    = rayInt.GetObj();
-			const Material*     objMat = obj->GetMaterial();
+	const PhotonMap::IrradianceQuery& query = queries[corners[0]];
+	const ISceneObject* object = batch->objects[corners[0]];
 
-			const float r = (*rng)();
+	const float cellSizeX = std::max(1U, cell.x1 - cell.x0);
+	const float cellSizeY = std::max(1U, cell.y1 - cell.y0);
 
-			const math::vec3f& diffReflectiveness = objMat->GetDiffuseReflectiveness();
-			const math::vec3f& specReflectiveness = objMat->GetSpecularReflectiveness();
-			const math::vec3f& specRefractiveness = objMat->GetSpecularRefractiveness();
-			const float diffReflectivenessAvg = (diffReflectiveness.x + diffReflectiveness.y + diffReflectiveness.z) / 3.0f;
-			const float specReflectivenessAvg = (specReflectiveness.x + specReflectiveness.y + specReflectiveness.z) / 3.0f;
-			const float specRefractivenessAvg = (specRefractiveness.x + specRefractiveness.y + specRefractiveness.z) / 3.0f;
+	// the geometry of all pixels is checked first
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		for (unsigned int y = cell.y0; y <= cell.y1; y++) {
+			for (unsigned int x = cell.x0; x <= cell.x1; x++) {
+				const int q = pixelQueries[y * tileSize + x];
 
-			// perform Russian Roulette with the photon's fate (5.2.4)
-			if ((r > 0.0f) && (r < diffReflectivenessAvg)) {
-				// diffuse reflection
-				profiler->IncCounter(Profiler::COUNTER_PHOTON, threadNum, photonDepth, PHOTON_MATINT_REFLECTION_DIFFUSE);
+				if (q < 0) {
+					continue;
+				}
 
-				// generate random direction on hemisphere above surface
-				// (taking the surface normal orientation into account)
-				// http.developer.nvidia.com/GPUGems/gpugems_ch17.html
-				math::vec3f reflectDir = -rayInt.GetNrm();
+				// bilinear weights of the corners
+				const float u = (x - cell.x0) / cellSizeX;
+				const float v = (y - cell.y0) / cellSizeY;
+				const float w[4] = {(1.0f - u) * (1.0f - v), u * (1.0f - v), (1.0f - u) * v, u * v};
 
-				while (reflectDir.dot3D(rayInt.GetNrm()) < 0.0f) {
-					reflectDir.rrandomize(rng);
-				}
+				if (pass == 0) {
+					float depth = 0.0f;
 
-				#if (PHOTON_ENERGY_CONSERVATION == 1)
-				const math::vec3f pwr = photon->GetPwr() * (diffReflectiveness / diffReflectivenessAvg);
-				#else
-				const math::vec3f pwr = photon->GetPwr() * (diffReflectiveness);
-				#endif
+					for (unsigned int k = 0; k < 4; k++) {
+						depth += (batch->depths[corners[k]] * w[k]);
+					}
 
-				photon->SetPos(rayInt.GetPos());
-				photon->SetDirection(ray.GetDir());
-				photon->SetPwr(pwr);
-
-				// NOTE: only store if surface is non-specular (in all three bands)
-				// NOTE:
-				//     specular objects give a poor estimation since RR will result
-				//     in more specular reflection  where we won't store the photon.
-				//     Therefore direct illumination is needed to estimate the color
-				//     cq. energy of specular objects and it is not needed to store
-				//     photons on these surfaces.
-				if (!objMat->IsSpecularlyReflective()) {
-					if (!scene.PosInBounds(photon->GetPos())) {
-						return;
+					if (batch->objects[q] != object)
+						return false;
+					if ((queries[q].nrm).dot3D(query.nrm) < IRRADIANCE_INTERP_MIN_NORMAL_DOT)
+						return false;
+					if (fabsf(batch->depths[q] - depth) > (depth * IRRADIANCE_INTERP_MAX_DEPTH_CHANGE))
+						return false;
+				} else {
+					if ((*queryStates)[q] != IrradianceBatch::QUERY_STATE_PENDING) {
+						continue;
 					}
 
-					#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
-					photon->SetNrm(rayInt.GetNrm());
-					#endif
+					math::vec3f irr;
 
-					#if (PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY == 1)
-					if (photonDepth > 0) {
-						map->AddPhoton(photon);
+					for (unsigned int k = 0; k < 4; k++) {
+						irr += (queries[corners[k]].irr * w[k]);
 					}
-					#else
-					map->AddPhoton(photon);
-					#endif
+
+					(*queryStates)[q] = IrradianceBatch::QUERY_STATE_INTERPOLATED;
+					// the pixel may still become the corner of a
+					// cell split later, and then be evaluated
+					queries[q].irr = irr;
 				}
+			}
+		}
+	}
 
-				photon->SetDirection(reflectDir.norm());
-				photon->SetPos(photon->GetPos() + (photon->GetDirection() * 0.01f));
+	return true;
+}
+#endif
 
-				TracePhoton(threadNum, scene, map, photon, rng, photonDepth + 1, inside);
-			} else if ((r >= diffReflectivenessAvg) && (r < (diffReflectivenessAvg + specReflectivenessAvg))) {
-				// specular reflection
-				profiler->IncCounter(Profiler::COUNTER_PHOTON, threadNum, photonDepth, PHOTON_MATINT_REFLECTION_SPECULAR);
+// traces the first hit of the primary ray through each pixel
+// of every G-buffer row not yet claimed by another thread
+void RayTracer::TraceGBufferRows(RenderContext* ctx, const SDLWindow& window, const Scene& scene) {
+	const Camera* camera = scene.GetCamera();
 
-				#if (PHOTON_ENERGY_CONSERVATION == 1)
-				const math::vec3f pwr = photon->GetPwr() * (specReflectiveness / specReflectivenessAvg);
-				#else
-				const math::vec3f pwr = photon->GetPwr() * (specReflectiveness);
-				#endif
+	for (unsigned int y = __sync_fetch_and_add(&nextGBufferRow, 1); y < window.GetSizeY(); y = __sync_fetch_and_add(&nextGBufferRow, 1)) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x++) {
+			const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
 
-				photon->SetPos(rayInt.GetPos());
-				photon->SetDirection((ray.GetDir()).reflect(rayInt.GetNrm()));
-				photon->SetPwr(pwr);
+			profiler->IncCounter(Profiler::COUNTER_RAY, ctx->threadNum, 0, RAY_TYPE_PRIMARY);
+			scene.GetClosestObject(ctx, pxlRay, &gBuffer[y * window.GetSizeX() + x]);
+		}
+	}
+}
 
-				TracePhoton(threadNum, scene, map, photon, rng, photonDepth + 1, inside);
+// deals the tiles of the window out to the thread queues: the
+// tiles are ordered along a Hilbert curve (so that consecutive
+// tiles, and hence the tiles of each thread, are adjacent) and
+// every thread gets an equally long stretch of the curve
+void RayTracer::ScheduleRenderTiles(const SDLWindow& window) {
+	const unsigned int tileSize = RENDER_TILE_SIZE;
 
-			} else if ((r >= (diffReflectivenessAvg + specReflectivenessAvg)) && (r < (diffReflectivenessAvg + specReflectivenessAvg + specRefractivenessAvg))) {
-				// refraction
-				// note: temporary, refractions should be handled as S-reflections
-				profiler->IncCounter(Profiler::COUNTER_PHOTON, threadNum, photonDepth, PHOTON_MATINT_REFRACTION);
+	numTilesX = (window.GetSizeX() + tileSize - 1) / tileSize;
+	numTiles = numTilesX * ((window.GetSizeY() + tileSize - 1) / tileSize);
+	numTilesDone = 0;
 
-				// if going out of an object, switch refr. indices and invert normal
-				const math::vec3f& N = (inside)? (-rayInt.GetNrm()): (rayInt.GetNrm());
-				const float n1 = (inside)? (objMat->GetRefractionIndex()): (1.0f);
-				const float n2 = (inside)? (1.0f): (objMat->GetRefractionIndex());
+	unsigned int curveSize = 1;
 
-				const math::vec3f R = (ray.GetDir()).refract(N, n1, n2);
-				const math::vec3f P = rayInt.GetPos() + R * 0.01f;
+	while (curveSize < numTilesX || (curveSize * numTilesX) < numTiles) {
+		curveSize <<= 1;
+	}
 
-				photon->SetDirection(R);
-				photon->SetPos(P);
+	unsigned int tileNum = 0;
 
-				if (R != N) {
-					TracePhoton(threadNum, scene, map, photon, rng, photonDepth + 1, !inside);
-				}
-			} else {
-				// absorption
-				profiler->IncCounter(Profiler::COUNTER_PHOTON, threadNum, photonDepth, PHOTON_MATINT_ABSORPTION);
+	for (unsigned int d = 0; d < (curveSize * curveSize); d++) {
+		unsigned int x;
+		unsigned int y;
 
-				photon->SetPos(rayInt.GetPos());
-				photon->SetDirection(ray.GetDir());
+		HilbertCurvePoint(curveSize, d, &x, &y);
 
-				if (!objMat->IsSpecularlyReflective()) {
-					if (!scene.PosInBounds(photon->GetPos())) {
-						return;
-					}
+		// the curve covers a power-of-two square around the window
+		if (x >= numTilesX || (y * numTilesX + x) >= numTiles) {
+			continue;
+		}
 
-					#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
-					photon->SetNrm(rayInt.GetNrm());
-					#endif
+		tileQueues[(tileNum++ * numThreads) / numTiles]->tiles.push_back(y * numTilesX + x);
+	}
 
-					#if (PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY == 1)
-					if (photonDepth > 0) {
-						map->AddPhoton(photon);
-					}
-					#else
-					map->AddPhoton(photon);
-					#endif
-				}
-			}
+	assert(tileNum == numTiles);
+}
+
+// takes the next tile from our own queue or, once that is
+// empty, from the back of the first non-empty queue after it;
+// false if no tiles are left anywhere
+bool RayTracer::GetRenderTile(unsigned int threadNum, unsigned int* tileIdx, bool* stolen) {
+	for (unsigned int n = 0; n < numThreads; n++) {
+		TileQueue* queue = tileQueues[(threadNum + n) % numThreads];
+		boost::mutex::scoped_lock lock(queue->mutex);
+
+		if (queue->tiles.empty()) {
+			continue;
+		}
+
+		if (n == 0) {
+			*tileIdx = queue->tiles.front();
+			queue->tiles.pop_front();
+		} else {
+			*tileIdx = queue->tiles.back();
+			queue->tiles.pop_back();
 		}
+
+		*stolen = (n != 0);
+		return true;
 	}
+
+	return false;
 }
 
-void RayTracer::TracePhotonThread(
-	unsigned int threadNum,
-	boost::barrier* barrier,
-	const Scene& scene,
-	PhotonMap::Map* map,
-	RNGflt64* rng
-) {
-	const std::list<ISceneLight*>& lights = scene.GetLights();
+void RayTracer::TraceRayThread(unsigned int threadNum, SDLWindow& window, const Scene& scene) {
+	static boost::mutex progressMutex;
 
-	/*
-	 *  note: we distinguish absorption and three types of transmission events:
-	 *      1. (diffuse) reflection
-	 *     2A. (specular) reflection
-	 *     2B. (specular) refraction
-	 *  this is because for both S-reflection and S-refraction the direction of
-	 *  the incoming photon is changed anisotropically; if an individual photon
-	 *  is neither diffusely reflected nor absorbed, we must make the decision
-	 *  whether to S-reflect or S-refract separately
-	 */
+	RenderContext* ctx = renderContexts[threadNum];
 
-	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++) {
-		const ISceneLight* light = *it;
+	// every pixel of a tile is written to the window only
+	// after the deferred irradiance queries for the whole
+	// tile were resolved
+	const unsigned int tileSize = RENDER_TILE_SIZE;
+
+	std::vector<math::vec3f>& tilePixels = ctx->tilePixels;
+	IrradianceBatch* batch = irradianceBatches[threadNum];
+
+	tilePixels.resize(tileSize * tileSize);
+
+	#if (BATCHED_IRRADIANCE_QUERIES == 1 && NUM_IRRADIANCE_GATHER_RAYS <= 0 && DEBUG_RENDER_PHOTON_MAP == 0)
+	batch->active = photonMapping;
+	#endif
+
+	const unsigned int startTime = SDL_GetTicks();
 
-		const unsigned int photonsPerThread = light->GetNumPhotons() / numThreads;
-		const unsigned int photonsRemaining = light->GetNumPhotons() % photonsPerThread;
+	unsigned int tileIdx = 0;
+	unsigned int numTracedTiles = 0;
+	unsigned int numStolenTiles = 0;
 
-		const unsigned int numThreadPhotons = photonsPerThread + ((threadNum == (numThreads - 1))? photonsRemaining: 0);
+	bool stolen = false;
 
-		math::vec3f emissionPos; // surface emission-position (world-space)
-		math::vec3f emissionVec; // normalized vector from pos to emissionPos
-		math::vec3f emissionDir; // actual emission direction from emissionPos
+	while (GetRenderTile(threadNum, &tileIdx, &stolen)) {
+		const unsigned int tx = (tileIdx % numTilesX) * tileSize;
+		const unsigned int ty = (tileIdx / numTilesX) * tileSize;
+		const unsigned int txmax = std::min(tx + tileSize, window.GetSizeX());
+		const unsigned int tymax = std::min(ty + tileSize, window.GetSizeY());
 
-		if (light->GetRadius() <= 0.0f) {
-			for (unsigned int n = 0; n < numThreadPhotons; n++) {
-				emissionPos = light->GetPos();
-				emissionDir = emissionDir.rrandomize(rng);
+		batch->seedRadius = 0.0f;
 
-				PhotonMap::Photon photon(emissionPos, emissionDir, light->GetPower());
-				TracePhoton(threadNum, scene, map, &photon, rng, 0, false);
+		for (unsigned int y = ty; y < tymax; y++) {
+			for (unsigned int x = tx; x < txmax; x++) {
+				batch->pixelIdx = (y - ty) * tileSize + (x - tx);
+				tilePixels[batch->pixelIdx] = TracePixel(ctx, window, scene, x, y);
 			}
-		} else {
-			// note: direction probability needs to be proportional to cos(angle)
-			for (unsigned int n = 0; n < numThreadPhotons; n++) {
-				emissionPos = light->GetPos() + (emissionPos.rrandomize(rng) * light->GetRadius());
-				emissionVec = (emissionPos - light->GetPos()) / light->GetRadius();
-				emissionDir = -emissionVec;
-
-				while (emissionDir.dot3D(emissionVec) < 0.0f) {
-					emissionDir.rrandomize(rng);
-				}
+		}
+
+		ResolveIrradianceBatch(ctx, batch, &tilePixels[0]);
 
-				PhotonMap::Photon photon(emissionPos, emissionDir, light->GetPower());
-				TracePhoton(threadNum, scene, map, &photon, rng, 0, false);
+		for (unsigned int y = ty; y < tymax; y++) {
+			for (unsigned int x = tx; x < txmax; x++) {
+				window.SetPixel(x, y, tilePixels[(y - ty) * tileSize + (x - tx)]);
 			}
 		}
 
-		// all threads need to be done tracing photons
-		// (for this light-source) before we can scale
-		barrier->wait();
+		numTracedTiles += 1;
+		numStolenTiles += stolen;
 
-		if (threadNum == 0) {
-			// scale the power of all photons for this light-source
-			map->ScalePhotonPower(math::UVECf * (1.0f / light->GetNumPhotons()));
+		const unsigned int numDone = __sync_add_and_fetch(&numTilesDone, 1);
+
+		// about once per row of tiles
+		if (incrementalRender && (numDone % numTilesX) == 0) {
+			window.SwapBuffers(numThreads);
 		}
 
-		// wait until first thread has scaled the photons, so that it
-		// can proceed to Finalize safely after the last light-source
-		barrier->wait();
+		// report every multiple of 10 percent (once)
+		if (((numDone * 10) / numTiles) > (((numDone - 1) * 10) / numTiles)) {
+			boost::mutex::scoped_lock lock(progressMutex);
+
+			std::cout << "[RayTracer::TraceRayThread]";
+			std::cout << " thread: " << threadNum << ", progress: " << ((numDone * 100) / numTiles) << "%";
+			std::cout << " (tile " << numDone << " of " << numTiles << ")";
+			std::cout << std::endl;
+		}
 	}
 
-	if (threadNum == 0) {
-		map->Finalize();
+	{
+		// time until our last tile was done; equal times
+		// across threads mean the load was balanced
+		boost::mutex::scoped_lock lock(progressMutex);
+
+		std::cout << "[RayTracer::TraceRayThread]";
+		std::cout << " thread: " << threadNum << ", busy time: " << (SDL_GetTicks() - startTime) << "ms";
+		std::cout << ", tiles: " << numTracedTiles << " (" << numStolenTiles << " stolen)";
+		std::cout << std::endl;
 	}
 
-	// wait until first thread has finalized the map
-	barrier->wait();
+	batch->active = false;
 
-	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
-	map->PrecomputeIrradianceEstimates(numThreads, threadNum, photonSearchRadius, photonSearchCount);
-	// wait until all irradiance values are precomputed
-	barrier->wait();
+	#if (ADAPTIVE_IRRADIANCE_SAMPLING == 1)
+	if (batch->numQueries > 0) {
+		boost::mutex::scoped_lock lock(progressMutex);
+
+		std::cout << "[RayTracer::TraceRayThread]";
+		std::cout << " thread: " << threadNum << ", interpolated irradiance estimates: ";
+		std::cout << batch->numInterpolated << " of " << batch->numQueries;
+		std::cout << std::endl;
+	}
+
+	batch->numQueries = 0;
+	batch->numInterpolated = 0;
 	#endif
 }
 
@@ -861,46 +1880,1563 @@ void RayTracer::TracePhotonThread(
 
 
 
-void RayTracer::RenderThread(
-	unsigned int threadNum,
-	boost::barrier* barrier,
-	SDLWindow& window,
+// one interaction of a photon that travels from <pos> along <dir>
+// (with power <pwr>) with the scene: on return, the arguments hold
+// the photon's next path segment; the result is false if it was
+// absorbed or lost instead. if *store is set, <deposit> is what
+// should be added to the photon-map at the interaction point
+bool RayTracer::ScatterPhoton(
+	RenderContext* ctx,
 	const Scene& scene,
-	RNGflt64* rng
+	const double* bounceSample,
+	unsigned int photonDepth,
+	math::vec3f* pos,
+	math::vec3f* dir,
+	math::vec3f* pwr,
+	bool* inside,
+	PhotonMap::Photon* deposit,
+	bool* store
 ) {
-	if (photonMapping) {
-		TracePhotonThread(threadNum, barrier, scene, photonMap, rng);
+	RNGflt64* rng = ctx->rng;
+
+	const math::RaySegment ray(*pos, *dir);
+	math::RayIntersection rayInt;
+
+	*store = false;
+
+	if (scene.GetClosestObject(ctx, ray, &rayInt) == NULL) {
+		return false;
 	}
 
-	TraceRayThread(threadNum, window, scene, rng);
-}
+	const ISceneObject* obj    = rayInt.GetObj();
+	const Material*     objMat = obj->GetMaterial();
 
-void RayTracer::Render(SDLWindow& window, const Scene& scene) {
-	profiler->StartTask("[Render]", SDL_GetTicks());
+	// if non-NULL, <bounceSample> holds the quasi-random
+	// numbers for the roulette and the diffuse direction
+	const float r = (bounceSample != NULL)? bounceSample[0]: (*rng)();
+
+	const math::vec3f& diffReflectiveness = objMat->GetDiffuseReflectiveness();
+	const math::vec3f& specReflectiveness = objMat->GetSpecularReflectiveness();
+	const math::vec3f& specRefractiveness = objMat->GetSpecularRefractiveness();
+	const float diffReflectivenessAvg = (diffReflectiveness.x + diffReflectiveness.y + diffReflectiveness.z) / 3.0f;
+	const float specReflectivenessAvg = (specReflectiveness.x + specReflectiveness.y + specReflectiveness.z) / 3.0f;
+	const float specRefractivenessAvg = (specRefractiveness.x + specRefractiveness.y + specRefractiveness.z) / 3.0f;
+
+	// perform Russian Roulette with the photon's fate (5.2.4)
+	if ((r > 0.0f) && (r < diffReflectivenessAvg)) {
+		// diffuse reflection
+		profiler->IncCounter(Profiler::COUNTER_PHOTON, ctx->threadNum, photonDepth, PHOTON_MATINT_REFLECTION_DIFFUSE);
+
+		// generate a cosine-distributed direction on the hemisphere
+		// above the surface (Lambertian reflection), so the power
+		// of the photon does not need to be weighted by cos(angle)
+		const math::vec3f reflectDir = (bounceSample != NULL)?
+			math::CosineHemisphereSample(rayInt.GetNrm(), bounceSample[1], bounceSample[2]):
+			math::CosineHemisphereSample(rayInt.GetNrm(), (*rng)(), (*rng)());
+
+		#if (PHOTON_ENERGY_CONSERVATION == 1)
+		*pwr = (*pwr) * (diffReflectiveness / diffReflectivenessAvg);
+		#else
+		*pwr = (*pwr) * (diffReflectiveness);
+		#endif
 
-	std::vector<boost::thread*> threads(numThreads, NULL);
-	std::vector<RNGflt64*> rngs(numThreads, NULL);
+		// NOTE: only store if surface is non-specular (in all three bands)
+		// NOTE:
+		//     specular objects give a poor estimation since RR will result
+		//     in more specular reflection  where we won't store the photon.
+		//     Therefore direct illumination is needed to estimate the color
+		//     cq. energy of specular objects and it is not needed to store
+		//     photons on these surfaces.
+		if (!objMat->IsSpecularlyReflective()) {
+			if (!scene.PosInBounds(rayInt.GetPos())) {
+				return false;
+			}
 
-	boost::barrier threadBarrier(numThreads);
+			*deposit = PhotonMap::Photon(rayInt.GetPos(), ray.GetDir(), *pwr);
+			*store = (PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY == 0 || photonDepth > 0);
 
-	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
-		#define threadFunc boost::bind(&RayTracer::RenderThread, this,  threadNum, &threadBarrier, boost::ref(window), boost::cref(scene), rngs[threadNum])
+			#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
+			deposit->SetNrm(rayInt.GetNrm());
+			#endif
+		}
+
+		*dir = reflectDir;
+		*pos = rayInt.GetPos() + (reflectDir * 0.01f);
+		return true;
+	}
+
+	if ((r >= diffReflectivenessAvg) && (r < (diffReflectivenessAvg + specReflectivenessAvg))) {
+		// specular reflection
+		profiler->IncCounter(Profiler::COUNTER_PHOTON, ctx->threadNum, photonDepth, PHOTON_MATINT_REFLECTION_SPECULAR);
 
-		// note: each RNG must use a different seed
-		rngs[threadNum] = new RNGflt64(SDL_GetTicks() % random());
-		threads[threadNum] = new boost::thread(threadFunc);
+		#if (PHOTON_ENERGY_CONSERVATION == 1)
+		*pwr = (*pwr) * (specReflectiveness / specReflectivenessAvg);
+		#else
+		*pwr = (*pwr) * (specReflectiveness);
+		#endif
 
-		#undef threadFunc
+		*pos = rayInt.GetPos();
+		*dir = (ray.GetDir()).reflect(rayInt.GetNrm());
+		return true;
 	}
 
-	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
-		threads[threadNum]->join();
-		delete threads[threadNum];
-		delete rngs[threadNum];
+	if ((r >= (diffReflectivenessAvg + specReflectivenessAvg)) && (r < (diffReflectivenessAvg + specReflectivenessAvg + specRefractivenessAvg))) {
+		// refraction
+		// note: temporary, refractions should be handled as S-reflections
+		profiler->IncCounter(Profiler::COUNTER_PHOTON, ctx->threadNum, photonDepth, PHOTON_MATINT_REFRACTION);
+
+		// if going out of an object, switch refr. indices and invert normal
+		const math::vec3f& N = (*inside)? (-rayInt.GetNrm()): (rayInt.GetNrm());
+		const float n1 = (*inside)? (objMat->GetRefractionIndex()): (1.0f);
+		const float n2 = (*inside)? (1.0f): (objMat->GetRefractionIndex());
+
+		const math::vec3f R = (ray.GetDir()).refract(N, n1, n2);
+
+		if (R == N) {
+			return false;
+		}
+
+		*dir = R;
+		*pos = rayInt.GetPos() + R * 0.01f;
+		*inside = !(*inside);
+		return true;
+	}
+
+	// absorption
+	profiler->IncCounter(Profiler::COUNTER_PHOTON, ctx->threadNum, photonDepth, PHOTON_MATINT_ABSORPTION);
+
+	if (!objMat->IsSpecularlyReflective()) {
+		if (!scene.PosInBounds(rayInt.GetPos())) {
+			return false;
+		}
+
+		*deposit = PhotonMap::Photon(rayInt.GetPos(), ray.GetDir(), *pwr);
+		*store = (PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY == 0 || photonDepth > 0);
+
+		#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
+		deposit->SetNrm(rayInt.GetNrm());
+		#endif
+	}
+
+	return false;
+}
+
+// follow <photon> one bounce at a time until it is absorbed, lost
+// or reaches maxPhotonDepth; <photon> is overwritten with whatever
+// gets deposited along the way (which is added to <deposits>, or
+// to <map> if that is NULL)
+void RayTracer::TracePhoton(
+	RenderContext* ctx,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	std::vector<PhotonMap::Photon>* deposits,
+	PhotonMap::Photon* photon,
+	const double* bounceSample,
+	unsigned int photonDepth,
+	bool inside
+) {
+	RNGflt64* rng = ctx->rng;
+
+	math::vec3f pos = photon->GetPos();
+	math::vec3f dir = photon->GetDirection();
+	math::vec3f pwr = photon->GetPwr();
+
+	for (; photonDepth < maxPhotonDepth; photonDepth++) {
+		bool store = false;
+
+		const bool scattered = ScatterPhoton(ctx, scene, bounceSample, photonDepth, &pos, &dir, &pwr, &inside, photon, &store);
+
+		if (store && KeepPhoton(photon, rng)) {
+			if (deposits != NULL) {
+				deposits->push_back(*photon);
+			} else {
+				map->AddPhoton(photon);
+			}
+		}
+
+		if (!scattered) {
+			break;
+		}
+
+		// only the first bounce is quasi-random
+		bounceSample = NULL;
+	}
+}
+
+// with importons, decide whether <photon> (about to be stored)
+// is kept; the power of kept photons is compensated for their
+// probability of being kept
+bool RayTracer::KeepPhoton(PhotonMap::Photon* photon, RNGflt64* rng) const {
+	#if (USE_IMPORTONS == 1)
+	if (importanceGrid != NULL) {
+		const float q = importanceGrid->GetProbability(photon->GetPos());
+
+		if (q < 1.0f) {
+			if ((*rng)() >= q) {
+				return false;
+			}
+
+			photon->SetPwr(photon->GetPwr() / q);
+		}
+	}
+	#else
+	photon = photon;
+	rng = rng;
+	#endif
+
+	return true;
+}
+
+// follow an importance particle from the camera through specular
+// bounces to the diffuse surface where the irradiance is queried
+// (and, with gather rays, one diffuse bounce beyond that)
+void RayTracer::TraceImporton(
+	RenderContext* ctx,
+	const Scene& scene,
+	const math::RaySegment& ray,
+	unsigned int rayDepth
+) {
+	RNGflt64* rng = ctx->rng;
+
+	if (rayDepth >= maxRayDepth) {
+		return;
+	}
+
+	math::RayIntersection rayInt;
+
+	if (scene.GetClosestObject(ctx, ray, &rayInt) == NULL) {
+		return;
+	}
+
+	const Material* objMat = rayInt.GetObj()->GetMaterial();
+
+	if (!objMat->IsSpecularlyReflective()) {
+		importanceGrid->AddImporton(rayInt.GetPos());
+
+		#if (NUM_IRRADIANCE_GATHER_RAYS > 0)
+		if (rayDepth == 0 || (*rng)() < IRRADIANCE_GATHER_RAY_WEIGHT) {
+			const math::vec3f gatherRayDir = math::CosineHemisphereSample(rayInt.GetNrm(), (*rng)(), (*rng)());
+
+			const math::RaySegment gatherRay(rayInt.GetPos() + (gatherRayDir * 0.01f), gatherRayDir, false);
+			math::RayIntersection gatherRayInt;
+
+			if (scene.GetClosestObject(ctx, gatherRay, &gatherRayInt) != NULL) {
+				importanceGrid->AddImporton(gatherRayInt.GetPos());
+			}
+		}
+		#endif
+
+		return;
+	}
+
+	// pick one of the specular paths at random, tracing both
+	// would make the number of importons grow with depth
+	if (!objMat->IsSpecularlyRefractive() || (*rng)() < 0.5f) {
+		const math::vec3f& N = (ray.IsInside())? (-rayInt.GetNrm()): (rayInt.GetNrm());
+		const math::vec3f  R = (ray.GetDir()).reflect(N);
+		const math::RaySegment reflectRay(rayInt.GetPos() + R * 0.01f, R, ray.IsInside());
+
+		TraceImporton(ctx, scene, reflectRay, rayDepth + 1);
+	} else {
+		const math::vec3f& N = (ray.IsInside())? (-rayInt.GetNrm()): (rayInt.GetNrm());
+		const float n1 = (ray.IsInside())? (objMat->GetRefractionIndex()): (1.0f);
+		const float n2 = (ray.IsInside())? (1.0f): (objMat->GetRefractionIndex());
+
+		const math::vec3f R = (ray.GetDir()).refract(N, n1, n2);
+		const math::RaySegment refractRay(rayInt.GetPos() + R * 0.01f, R, !ray.IsInside());
+
+		if (R != N) {
+			TraceImporton(ctx, scene, refractRay, rayDepth + 1);
+		}
+	}
+}
+
+void RayTracer::TraceImportonThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const SDLWindow& window,
+	const Scene& scene
+) {
+	RenderContext* ctx = renderContexts[threadNum];
+	RNGflt64* rng = ctx->rng;
+
+	const Camera* camera = scene.GetCamera();
+
+	const unsigned int importonsPerThread = numImportons / numThreads;
+	const unsigned int importonsRemaining = numImportons % numThreads;
+	const unsigned int numThreadImportons = importonsPerThread + ((threadNum == (numThreads - 1))? importonsRemaining: 0);
+
+	for (unsigned int n = 0; n < numThreadImportons; n++) {
+		const unsigned int x = std::min(window.GetSizeX() - 1, (unsigned int) ((*rng)() * window.GetSizeX()));
+		const unsigned int y = std::min(window.GetSizeY() - 1, (unsigned int) ((*rng)() * window.GetSizeY()));
+
+		const math::RaySegment ray(camera->GetPos(), camera->GetPixelDir(window, x, y));
+
+		TraceImporton(ctx, scene, ray, 0);
+	}
+
+	// all threads need to be done tracing importons
+	barrier->wait();
+
+	if (threadNum == 0) {
+		importanceGrid->Finalize(IMPORTANCE_MIN_PROBABILITY);
+	}
+
+	// wait until first thread has finalized the grid
+	barrier->wait();
+}
+
+// deposit a direct photon where the ray leaving the light first
+// hits the scene and shadow photons (which carry no power) where
+// it would hit the scene again if passing through each surface
+void RayTracer::TraceShadowPhoton(
+	RenderContext* ctx,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	const math::vec3f& emissionPos,
+	const math::vec3f& emissionDir
+) {
+	math::RaySegment ray(emissionPos, emissionDir);
+
+	for (unsigned int n = 0; n < SHADOW_PHOTON_MAX_DEPOSITS; n++) {
+		math::RayIntersection rayInt;
+
+		if (scene.GetClosestObject(ctx, ray, &rayInt) == NULL) {
+			return;
+		}
+		if (!scene.PosInBounds(rayInt.GetPos())) {
+			return;
+		}
+
+		PhotonMap::Photon photon(rayInt.GetPos(), emissionDir, ((n == 0)? math::UVECf: math::NVECf));
+
+		#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1 || USE_SPHERE_COMPRESSION == 1)
+		photon.SetNrm(rayInt.GetNrm());
+		#endif
+
+		if (!map->AddPhoton(&photon)) {
+			return;
+		}
+
+		ray.SetPos(rayInt.GetPos() + (emissionDir * 0.01f));
+	}
+}
+
+void RayTracer::TraceShadowPhotonThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const Scene& scene
+) {
+	RenderContext* ctx = renderContexts[threadNum];
+	RNGflt64* rng = ctx->rng;
+
+	const std::list<ISceneLight*>& lights = scene.GetLights();
+
+	const unsigned int photonsPerThread = numShadowPhotons / numThreads;
+	const unsigned int photonsRemaining = numShadowPhotons % numThreads;
+	const unsigned int numThreadPhotons = photonsPerThread + ((threadNum == (numThreads - 1))? photonsRemaining: 0);
+
+	math::vec3f emissionPos;
+	math::vec3f emissionDir;
+
+	unsigned int lightNum = 0;
+
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
+		for (unsigned int n = 0; n < numThreadPhotons; n++) {
+			SampleEmission(*it, lightNum, rng, NULL, &emissionPos, &emissionDir);
+			TraceShadowPhoton(ctx, scene, shadowPhotonMaps[lightNum], emissionPos, emissionDir);
+		}
+	}
+
+	// all threads need to be done tracing shadow photons
+	barrier->wait();
+
+	if (threadNum == 0) {
+		for (lightNum = 0; lightNum < shadowPhotonMaps.size(); lightNum++) {
+			shadowPhotonMaps[lightNum]->Finalize();
+		}
+	}
+
+	// wait until first thread has finalized the maps
+	barrier->wait();
+}
+
+// pick the position and direction of a photon leaving <light>
+// (the <lightNum>'th light); returns the factor by which the
+// power of the photon must be scaled
+float RayTracer::SampleEmission(
+	const ISceneLight* light,
+	unsigned int lightNum,
+	RNGflt64* rng,
+	const double* emissionSample,
+	math::vec3f* emissionPos,
+	math::vec3f* emissionDir
+) const {
+	double randomSample[4];
+
+	if (emissionSample == NULL) {
+		for (unsigned int n = 0; n < 4; n++) {
+			randomSample[n] = (*rng)();
+		}
+
+		emissionSample = &randomSample[0];
+	}
+
+	if (light->GetRadius() <= 0.0f) {
+		*emissionPos = light->GetPos();
+
+		#if (USE_PROJECTION_MAPS == 1)
+		if (lightNum < projectionMaps.size() && projectionMaps[lightNum] != NULL) {
+			if (projectionMaps[lightNum]->SampleDirection(emissionSample[0], emissionSample[1], emissionDir)) {
+				return (projectionMaps[lightNum]->GetCoverage());
+			}
+		}
+		#else
+		lightNum = lightNum;
+		#endif
+
+		*emissionDir = math::UniformSphereSample(emissionSample[0], emissionSample[1]);
+	} else {
+		// normalized vector from light pos to emissionPos; every
+		// surface point emits diffusely, ie. with a direction
+		// probability proportional to cos(angle) to the normal
+		const math::vec3f emissionVec = math::UniformSphereSample(emissionSample[0], emissionSample[1]);
+
+		*emissionPos = light->GetPos() + (emissionVec * light->GetRadius());
+		*emissionDir = math::CosineHemisphereSample(emissionVec, emissionSample[2], emissionSample[3]);
+	}
+
+	return 1.0f;
+}
+
+// position on the surface of area-light <light> for the <i>'th
+// of <n> (stratified) visibility samples seen from <pos>; only
+// the cap of the light's sphere that faces <pos> is sampled, at
+// uniform solid angle (unless <pos> is inside the sphere)
+math::vec3f RayTracer::SampleAreaLightPos(
+	const ISceneLight* light,
+	const math::vec3f& pos,
+	unsigned int i,
+	unsigned int n,
+	RNGflt64* rng
+) const {
+	const math::vec3f lightVec = light->GetPos() - pos;
+
+	const float lightDistSq = lightVec.sqLen3D();
+	const float lightRadSq = light->GetRadius() * light->GetRadius();
+
+	float u;
+	float v;
+
+	math::StratifiedSample(i, n, (*rng)(), (*rng)(), &u, &v);
+
+	if (lightDistSq <= lightRadSq) {
+		return (light->GetPos() + math::UniformSphereSample(u, v) * light->GetRadius());
+	}
+
+	const math::vec3f lightAxis = lightVec / sqrtf(lightDistSq);
+	const math::vec3f sampleDir = math::UniformConeSample(lightAxis, sqrtf(1.0f - lightRadSq / lightDistSq), u, v);
+
+	// distance along sampleDir to the near side of the sphere
+	const float proj = lightVec.dot3D(sampleDir);
+	const float dist = proj - sqrtf(std::max(0.0f, lightRadSq - (lightDistSq - proj * proj)));
+
+	return (pos + sampleDir * dist);
+}
+
+// trace photons firstPhoton + k * photonStride (k < numPhotons)
+// of the <lightNum>'th light; with <quasiRandom> photon i uses
+// point i of photonSequence (shifted by photonSequenceOffset),
+// whose first four dimensions are used for emission and the
+// next three for the first bounce. with STREAMED_PHOTON_TRACING,
+// photons are traced PHOTON_STREAM_SIZE at a time bounce by
+// bounce, otherwise one at a time path by path; the deposits
+// are added to <deposits>, or to <map> if that is NULL
+void RayTracer::EmitPhotons(
+	RenderContext* ctx,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	const ISceneLight* light,
+	unsigned int lightNum,
+	unsigned int firstPhoton,
+	unsigned int numPhotons,
+	unsigned int photonStride,
+	unsigned int numLightPhotons,
+	bool quasiRandom,
+	std::vector<PhotonMap::Photon>* deposits
+) {
+	RNGflt64* rng = ctx->rng;
+
+	// every photon carries its share of the light's power
+	const math::vec3f photonPower = light->GetPower() * (1.0f / numLightPhotons);
+
+	math::vec3f emissionPos; // surface emission-position (world-space)
+	math::vec3f emissionDir; // actual emission direction from emissionPos
+
+	double samples[QRNGHalton::NUM_DIMS];
+
+	#if (STREAMED_PHOTON_TRACING == 1)
+	PhotonStream stream;
+
+	for (unsigned int batchPhoton = 0; batchPhoton < numPhotons; batchPhoton += PHOTON_STREAM_SIZE) {
+		const unsigned int batchSize = std::min(PHOTON_STREAM_SIZE, numPhotons - batchPhoton);
+
+		stream.Clear();
+
+		for (unsigned int k = batchPhoton; k < (batchPhoton + batchSize); k++) {
+			if (quasiRandom) {
+				for (unsigned int dim = 0; dim < 4; dim++) {
+					samples[dim] = (*photonSequence)(photonSequenceOffset + firstPhoton + k * photonStride, dim);
+				}
+			}
+
+			const float emissionScale = SampleEmission(light, lightNum, rng, (quasiRandom? &samples[0]: NULL), &emissionPos, &emissionDir);
+
+			stream.Push(emissionPos, emissionDir, photonPower * emissionScale);
+		}
+
+		for (unsigned int photonDepth = 0; photonDepth < maxPhotonDepth && stream.GetSize() > 0; photonDepth++) {
+			// the photons still in flight are moved to the front
+			unsigned int numScattered = 0;
+
+			for (unsigned int i = 0; i < stream.GetSize(); i++) {
+				// before the first compaction, photon i is still
+				// at its emission index (so its sequence point)
+				if (quasiRandom && photonDepth == 0) {
+					for (unsigned int dim = 4; dim < 7; dim++) {
+						samples[dim] = (*photonSequence)(photonSequenceOffset + firstPhoton + (batchPhoton + i) * photonStride, dim);
+					}
+				}
+
+				PhotonMap::Photon deposit;
+
+				bool inside = stream.inside[i];
+				bool store = false;
+
+				const bool scattered = ScatterPhoton(
+					ctx, scene, ((quasiRandom && photonDepth == 0)? &samples[4]: NULL), photonDepth,
+					&stream.pos[i], &stream.dir[i], &stream.pwr[i], &inside, &deposit, &store
+				);
+
+				if (store && KeepPhoton(&deposit, rng)) {
+					stream.deposits.push_back(deposit);
+				}
+
+				if (!scattered) {
+					continue;
+				}
+
+				stream.pos[numScattered] = stream.pos[i];
+				stream.dir[numScattered] = stream.dir[i];
+				stream.pwr[numScattered] = stream.pwr[i];
+				stream.inside[numScattered] = inside;
+				numScattered++;
+			}
+
+			stream.Resize(numScattered);
+		}
+
+		if (deposits != NULL) {
+			deposits->insert(deposits->end(), stream.deposits.begin(), stream.deposits.end());
+		} else {
+			map->AddPhotons(stream.deposits);
+		}
+	}
+	#else
+	for (unsigned int k = 0; k < numPhotons; k++) {
+		if (quasiRandom) {
+			for (unsigned int dim = 0; dim < QRNGHalton::NUM_DIMS; dim++) {
+				samples[dim] = (*photonSequence)(photonSequenceOffset + firstPhoton + k * photonStride, dim);
+			}
+		}
+
+		const float emissionScale = SampleEmission(light, lightNum, rng, (quasiRandom? &samples[0]: NULL), &emissionPos, &emissionDir);
+
+		PhotonMap::Photon photon(emissionPos, emissionDir, photonPower * emissionScale);
+		TracePhoton(ctx, scene, map, deposits, &photon, (quasiRandom? &samples[4]: NULL), 0, false);
+	}
+	#endif
+}
+
+// mark the cells of every projection-map through which photons
+// can reach the scene; cells are divided among all threads
+void RayTracer::BuildProjectionMapsThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const Scene& scene
+) {
+	RenderContext* ctx = renderContexts[threadNum];
+	RNGflt64* rng = ctx->rng;
+
+	const std::list<ISceneLight*>& lights = scene.GetLights();
+
+	unsigned int lightNum = 0;
+
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
+		const ISceneLight* light = *it;
+		ProjectionMap* projectionMap = projectionMaps[lightNum];
+
+		if (projectionMap == NULL) {
+			continue;
+		}
+
+		for (unsigned int cellIdx = threadNum; cellIdx < projectionMap->GetNumCells(); cellIdx += numThreads) {
+			bool occupied = false;
+
+			for (unsigned int n = 0; n < PROJECTION_MAP_PROBES && !occupied; n++) {
+				const math::vec3f probeDir = projectionMap->GetCellDir(cellIdx, (*rng)(), (*rng)());
+
+				// same test as IMaterialReflectionModel::GetIntensity
+				if (RAD2DEG(acosf((light->GetDir()).dot3D(probeDir))) >= (light->GetFOV() * 0.5f)) {
+					continue;
+				}
+
+				const math::RaySegment probeRay(light->GetPos(), probeDir);
+				math::RayIntersection probeRayInt;
+
+				if (scene.GetClosestObject(ctx, probeRay, &probeRayInt) != NULL) {
+					occupied = scene.PosInBounds(probeRayInt.GetPos());
+				}
+			}
+
+			projectionMap->SetCell(cellIdx, occupied);
+		}
+	}
+
+	// all threads need to be done probing
+	barrier->wait();
+
+	if (threadNum == 0) {
+		std::cout << "[RayTracer::BuildProjectionMapsThread]" << std::endl;
+
+		for (lightNum = 0; lightNum < projectionMaps.size(); lightNum++) {
+			if (projectionMaps[lightNum] == NULL) {
+				continue;
+			}
+
+			projectionMaps[lightNum]->Finalize();
+
+			std::cout << "\tlight " << lightNum << " coverage: " << projectionMaps[lightNum]->GetCoverage() << std::endl;
+		}
+	}
+
+	// wait until first thread has finalized the maps
+	barrier->wait();
+}
+
+void RayTracer::TracePhotonThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	const SDLWindow* window
+) {
+	/*
+	 *  note: we distinguish absorption and three types of transmission events:
+	 *      1. (diffuse) reflection
+	 *     2A. (specular) reflection
+	 *     2B. (specular) refraction
+	 *  this is because for both S-reflection and S-refraction the direction of
+	 *  the incoming photon is changed anisotropically; if an individual photon
+	 *  is neither diffusely reflected nor absorbed, we must make the decision
+	 *  whether to S-reflect or S-refract separately
+	 */
+
+	// index of the first photon of each light in photonSequence
+	unsigned int lightPhotonIdx = 0;
+	unsigned int roundNum = 0;
+
+	if (photonRoundMap == NULL) {
+		TracePhotonRound(threadNum, barrier, scene, map, &lightPhotonIdx);
+	} else {
+		// every light emits its photons into the round-map once
+		// per round, until the irradiance error is small enough
+		while (!photonRoundsDone) {
+			TracePhotonRound(threadNum, barrier, scene, photonRoundMap, &lightPhotonIdx);
+
+			if (threadNum == 0) {
+				EndPhotonRound(map, ++roundNum);
+			}
+
+			// wait until first thread has decided on another round
+			barrier->wait();
+		}
+	}
+
+	if (threadNum == 0) {
+		map->Finalize();
+
+		if (window != NULL && useGBuffer) {
+			std::cout << "[RayTracer::TracePhotonThread]" << std::endl;
+			std::cout << "\tG-buffer rows traced during Finalize: ";
+			std::cout << std::min(nextGBufferRow, window->GetSizeY()) << " of " << window->GetSizeY();
+			std::cout << std::endl;
+		}
+
+		// the next pass (if any) continues the sequence
+		photonSequenceOffset += lightPhotonIdx;
+
+		#if (BENCHMARK_PHOTON_MAP_QUERIES == 1)
+		map->BenchmarkQueries(photonSearchRadius, photonSearchCount);
+		#endif
+	}
+
+	// primary visibility does not depend on the photons, so
+	// the other threads trace it while the map is finalized
+	// (and the first thread helps out with what remains)
+	if (window != NULL && useGBuffer) {
+		TraceGBufferRows(renderContexts[threadNum], *window, scene);
+	}
+
+	// wait until first thread has finalized the map
+	barrier->wait();
+
+	#if (PRECOMPUTE_IRRADIANCE_ESTIMATES == 1)
+	map->PrecomputeIrradianceEstimates(numThreads, threadNum, photonSearchRadius, photonSearchCount);
+	// wait until all irradiance values are precomputed
+	barrier->wait();
+	#endif
+
+	// out of core, Finalize already wrote the map to its file
+	if (!photonMapFile.empty() && !progressiveRender && !photonMapOutOfCore) {
+		// the map is only read from here on, so the other
+		// threads can start rendering while this is saved
+		// (unless it is moved to shared memory next)
+		if (threadNum == 0) {
+			map->SaveToFile(photonMapFile, photonMapHash);
+		}
+	}
+
+	if (photonMapShared) {
+		if (threadNum == 0) {
+			// publish the map for other processes; if one of
+			// them was first (or this fails), keep the own one
+			map->MoveToSharedMemory(photonMapHash, photonMapSharedPersist);
+		}
+
+		// nobody may query the map while it is being moved
+		barrier->wait();
+	}
+}
+
+// traces the photons of every light into <map> once; the
+// threads take chunks of PHOTON_CHUNK_SIZE photons (of any
+// light) from a shared counter until none are left, so none
+// of them idles before the last chunk is handed out
+void RayTracer::TracePhotonRound(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	unsigned int* lightPhotonIdx
+) {
+	// in animation mode, photons are traced (or kept) per group
+	if (!lightPhotonHashes.empty()) {
+		TracePhotonGroups(threadNum, barrier, scene, map, lightPhotonIdx);
+		return;
+	}
+
+	RenderContext* ctx = renderContexts[threadNum];
+
+	const std::list<ISceneLight*>& lights = scene.GetLights();
+
+	std::vector<PhotonChunk> chunks;
+
+	unsigned int lightNum = 0;
+
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
+		const ISceneLight* light = *it;
+
+		for (unsigned int n = 0; n < light->GetNumPhotons(); n += PHOTON_CHUNK_SIZE) {
+			chunks.push_back(PhotonChunk(light, lightNum, (*lightPhotonIdx) + n, std::min(PHOTON_CHUNK_SIZE, light->GetNumPhotons() - n)));
+		}
+
+		(*lightPhotonIdx) += light->GetNumPhotons();
+	}
+
+	for (unsigned int c = __sync_fetch_and_add(&nextPhotonChunk, 1); c < chunks.size(); c = __sync_fetch_and_add(&nextPhotonChunk, 1)) {
+		const PhotonChunk& chunk = chunks[c];
+
+		// every photon gets its share of the light's power when emitted
+		EmitPhotons(ctx, scene, map, chunk.light, chunk.lightNum, chunk.firstPhoton, chunk.numPhotons, 1, chunk.light->GetNumPhotons(), USE_QMC_PHOTON_SAMPLING);
+	}
+
+	// all threads need to be done with the chunks
+	// before the counter can be reset
+	barrier->wait();
+
+	if (threadNum == 0) {
+		nextPhotonChunk = 0;
+	}
+
+	barrier->wait();
+}
+
+// animation mode: the paths of every light are traced in groups
+// (see ANIMATION_PATH_GROUPS) whose photons are kept separately
+// in the light's file, so that they can be re-used per group in
+// the next frame; a light that did not change at all is loaded
+// whole, and of one that only moved, first the pilot paths of
+// all groups are traced and then only the groups whose pilots
+// moved (the photons of the others are loaded)
+void RayTracer::TracePhotonGroups(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	const Scene& scene,
+	PhotonMap::Map* map,
+	unsigned int* lightPhotonIdx
+) {
+	RenderContext* ctx = renderContexts[threadNum];
+
+	const std::list<ISceneLight*>& lights = scene.GetLights();
+
+	unsigned int lightNum = 0;
+
+	for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
+		const ISceneLight* light = *it;
+
+		// index of the light's first path in photonSequence
+		const unsigned int firstLightPhoton = *lightPhotonIdx;
+		const unsigned int numLightPhotons = light->GetNumPhotons();
+
+		(*lightPhotonIdx) += numLightPhotons;
+
+		if (lightPhotonsCached[lightNum]) {
+			if (threadNum == 0) {
+				map->LoadPhotons(GetLightPhotonsFile(lightNum), lightGroupHashes[lightNum]);
+			}
+
+			continue;
+		}
+
+		const std::vector<PhotonMap::PhotonGroup>& cachedGroups = lightPhotonGroups[lightNum];
+
+		for (unsigned int g = __sync_fetch_and_add(&nextPhotonChunk, 1); g < ANIMATION_PATH_GROUPS; g = __sync_fetch_and_add(&nextPhotonChunk, 1)) {
+			PathGroup& group = pathGroups[g];
+
+			TracePilotPaths(ctx, scene, light, lightNum, firstLightPhoton, numLightPhotons, g, &group.record);
+
+			group.traced = (cachedGroups.empty() || PilotPathsMoved(cachedGroups[g], group.record));
+		}
+
+		// all threads need to be done with the pilots
+		// before the counter can be reset
+		barrier->wait();
+
+		if (threadNum == 0) {
+			nextPhotonChunk = 0;
+		}
+
+		barrier->wait();
+
+		for (unsigned int g = __sync_fetch_and_add(&nextPhotonChunk, 1); g < ANIMATION_PATH_GROUPS; g = __sync_fetch_and_add(&nextPhotonChunk, 1)) {
+			PathGroup& group = pathGroups[g];
+
+			if (!group.traced) {
+				continue;
+			}
+
+			unsigned int firstPath = 0;
+			unsigned int numPaths = 0;
+
+			GetPathGroup(photonSequenceOffset + firstLightPhoton, numLightPhotons, g, &firstPath, &numPaths);
+
+			// every photon gets its share of the light's power when emitted
+			EmitPhotons(ctx, scene, map, light, lightNum, firstLightPhoton + firstPath, numPaths, ANIMATION_PATH_GROUPS, numLightPhotons, USE_QMC_PHOTON_SAMPLING, &group.photons);
+		}
+
+		barrier->wait();
+
+		if (threadNum == 0) {
+			StorePhotonGroups(map, lightNum);
+			nextPhotonChunk = 0;
+		}
+
+		barrier->wait();
+	}
+}
+
+// traces the first ANIMATION_PILOT_PATHS paths of path group
+// <groupNum> of a light up to their first hit, which depends
+// only on their emission samples (and so on nothing that can
+// differ between frames except for the light's placement)
+void RayTracer::TracePilotPaths(
+	RenderContext* ctx,
+	const Scene& scene,
+	const ISceneLight* light,
+	unsigned int lightNum,
+	unsigned int firstLightPhoton,
+	unsigned int numLightPhotons,
+	unsigned int groupNum,
+	PhotonMap::PhotonGroup* group
+) const {
+	unsigned int firstPath = 0;
+	unsigned int numPaths = 0;
+
+	GetPathGroup(photonSequenceOffset + firstLightPhoton, numLightPhotons, groupNum, &firstPath, &numPaths);
+
+	*group = PhotonMap::PhotonGroup();
+	group->groupNum = groupNum;
+	group->numPilots = std::min(numPaths, ANIMATION_PILOT_PATHS);
+
+	double samples[4];
+
+	for (unsigned int k = 0; k < group->numPilots; k++) {
+		for (unsigned int dim = 0; dim < 4; dim++) {
+			samples[dim] = (*photonSequence)(photonSequenceOffset + firstLightPhoton + firstPath + k * ANIMATION_PATH_GROUPS, dim);
+		}
+
+		math::vec3f emissionPos;
+		math::vec3f emissionDir;
+		math::RayIntersection rayInt;
+
+		group->powerScale = SampleEmission(light, lightNum, ctx->rng, &samples[0], &emissionPos, &emissionDir);
+
+		if (scene.GetClosestObject(ctx, math::RaySegment(emissionPos, emissionDir), &rayInt) != NULL) {
+			group->pilotHits[k] = rayInt.GetPos();
+			group->pilotNrms[k] = rayInt.GetNrm();
+		} else {
+			group->pilotHits[k] = math::NVECf;
+			group->pilotNrms[k] = math::NVECf;
+		}
+	}
+}
+
+// whether the photons traced along with the pilot paths of
+// <cachedGroup> (in an earlier frame) are no longer those that
+// the paths of <group> would deposit, ie. whether any pilot now
+// hits another surface or a point more than animationReuseRadius
+// away (or now misses the scene where it hit it, or vice versa)
+bool RayTracer::PilotPathsMoved(const PhotonMap::PhotonGroup& cachedGroup, const PhotonMap::PhotonGroup& group) const {
+	if (cachedGroup.numPilots != group.numPilots || cachedGroup.powerScale <= 0.0f) {
+		return true;
+	}
+
+	for (unsigned int k = 0; k < group.numPilots; k++) {
+		const bool cachedHit = (cachedGroup.pilotNrms[k].sqLen3D() > 0.0f);
+		const bool pilotHit = (group.pilotNrms[k].sqLen3D() > 0.0f);
+
+		if (cachedHit != pilotHit) {
+			return true;
+		}
+		if (!pilotHit) {
+			continue;
+		}
+
+		if ((cachedGroup.pilotHits[k] - group.pilotHits[k]).sqLen3D() > (animationReuseRadius * animationReuseRadius)) {
+			return true;
+		}
+		if ((cachedGroup.pilotNrms[k]).dot3D(group.pilotNrms[k]) < 0.999f) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// adds the photons of all path groups of light <lightNum> to
+// <map>: those of the unchanged groups from the light's file of
+// the previous frame (with their power adjusted to the current
+// emission scale) and those just traced for the others, whose
+// previous photons are dropped; then saves them for the next
+// frame, with the pilots each group's photons were traced with
+void RayTracer::StorePhotonGroups(PhotonMap::Map* map, unsigned int lightNum) {
+	const std::vector<PhotonMap::PhotonGroup>& cachedGroups = lightPhotonGroups[lightNum];
+	const std::string lightPhotonsFile = GetLightPhotonsFile(lightNum);
+
+	const unsigned int firstPhoton = map->GetMapSize() + 1;
+
+	std::vector<PhotonMap::PhotonGroup> groups;
+	std::vector<float> groupScales(ANIMATION_PATH_GROUPS, 0.0f);
+
+	unsigned int numKeptGroups = 0;
+
+	for (unsigned int g = 0; g < ANIMATION_PATH_GROUPS; g++) {
+		if (pathGroups[g].traced) {
+			continue;
+		}
+
+		groupScales[g] = pathGroups[g].record.powerScale / cachedGroups[g].powerScale;
+		numKeptGroups++;
+	}
+
+	if (numKeptGroups > 0 && !map->LoadPhotons(lightPhotonsFile, lightGroupHashes[lightNum], &groupScales, &groups)) {
+		// the file changed since the frame started
+		std::cout << "[RayTracer::StorePhotonGroups] lost the kept photons of light " << lightNum << std::endl;
+	}
+
+	for (unsigned int g = 0; g < ANIMATION_PATH_GROUPS; g++) {
+		PathGroup& group = pathGroups[g];
+
+		if (!group.traced) {
+			continue;
+		}
+
+		group.record.numPhotons = map->AddPhotons(group.photons);
+		groups.push_back(group.record);
+
+		std::vector<PhotonMap::Photon>().swap(group.photons);
+	}
+
+	map->SavePhotons(lightPhotonsFile, lightPhotonHashes[lightNum], lightGroupHashes[lightNum], firstPhoton, map->GetMapSize(), groups);
+
+	std::cout << "[RayTracer::StorePhotonGroups]" << std::endl;
+	std::cout << "\tlight " << lightNum << ": kept " << numKeptGroups << " of " << ANIMATION_PATH_GROUPS << " path groups" << std::endl;
+}
+
+// collects the probes at which the adaptive photon count
+// measures the error (the non-specular primary-ray hits on
+// a grid of pixels)
+void RayTracer::FindPhotonProbes(const SDLWindow& window, const Scene& scene) {
+	const Camera* camera = scene.GetCamera();
+
+	photonProbes.clear();
+
+	for (unsigned int y = 0; y < window.GetSizeY(); y += ADAPTIVE_PHOTON_PROBE_STRIDE) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x += ADAPTIVE_PHOTON_PROBE_STRIDE) {
+			const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+			math::RayIntersection pxlRayInt;
+
+			if (scene.GetClosestObject(renderContexts[0], pxlRay, &pxlRayInt) == NULL)
+				continue;
+			if (pxlRayInt.GetObj()->GetMaterial()->IsSpecularlyReflective())
+				continue;
+
+			photonProbes.push_back(PhotonMap::IrradianceQuery(pxlRayInt.GetPos(), pxlRayInt.GetNrm(), photonProbes.size()));
+		}
+	}
+
+	photonProbeSums.clear();
+	photonProbeSums.resize(photonProbes.size(), 0.0);
+	photonProbeSqSums.clear();
+	photonProbeSqSums.resize(photonProbes.size(), 0.0);
+}
+
+// every round is an independent estimate of the irradiance at
+// each probe; the spread of these estimates over the rounds
+// gives the standard error of their mean, ie. of the estimate
+// made with the photons of all rounds (which are merged into
+// <map>), relative to the mean irradiance over all probes
+void RayTracer::EndPhotonRound(PhotonMap::Map* map, unsigned int roundNum) {
+	photonRoundMap->Finalize();
+
+	const double searchArea = M_PI * photonSearchRadius * photonSearchRadius;
+
+	double sumMeanSq = 0.0;
+	double sumVar = 0.0;
+
+	for (unsigned int n = 0; n < photonProbes.size(); n++) {
+		const PhotonMap::IrradianceQuery& probe = photonProbes[n];
+
+		unsigned int count = 0;
+
+		const math::vec3f flux = photonRoundMap->GetPhotonFlux(probe.pos, probe.nrm, photonSearchRadius, &count);
+		const double irr = (flux.x + flux.y + flux.z) / (3.0 * searchArea);
+
+		photonProbeSums[n] += irr;
+		photonProbeSqSums[n] += (irr * irr);
+
+		const double mean = photonProbeSums[n] / roundNum;
+
+		sumMeanSq += (mean * mean);
+
+		if (roundNum > 1) {
+			// unbiased variance of one round's estimate
+			sumVar += std::max(0.0, (photonProbeSqSums[n] - roundNum * mean * mean) / (roundNum - 1));
+		}
+	}
+
+	// infinite until there are at least two rounds
+	const double relError = (roundNum > 1 && sumMeanSq > 0.0)?
+		sqrt((sumVar / roundNum) / sumMeanSq):
+		std::numeric_limits<double>::max();
+
+	const unsigned int numMerged = map->MergePhotons(*photonRoundMap);
+	const bool mapFull = (numMerged < photonRoundMap->GetMapSize() || map->GetMapSize() == map->GetMapCapacity());
+
+	photonRoundsDone = (relError <= adaptivePhotonError || roundNum >= adaptivePhotonMaxRounds || mapFull);
+
+	std::cout << "[RayTracer::EndPhotonRound]" << std::endl;
+	std::cout << "\tround:          " << roundNum << std::endl;
+	std::cout << "\tnumProbes:      " << photonProbes.size() << std::endl;
+	std::cout << "\tstored photons: " << map->GetMapSize() << std::endl;
+	std::cout << "\trelative error: " << ((roundNum > 1)? relError: -1.0) << std::endl;
+
+	const unsigned int mapSize = photonRoundMap->GetMapCapacity();
+
+	delete photonRoundMap;
+	photonRoundMap = NULL;
+
+	if (photonRoundsDone) {
+		// the photons of all rounds together make up one map
+		map->ScalePhotonPower(math::UVECf * (1.0f / roundNum));
+	} else {
+		photonRoundMap = new PhotonMap::Map(mapSize, PhotonMap::PHOTONMAP_GLOBAL);
+		photonRoundMap->SetSearchEpsilon(photonSearchEpsilon);
+		photonRoundMap->SetSearchNodeLimit(photonSearchMaxNodes);
+	}
+}
+
+
+
+
+// trace all pixels of our band once and keep their (deferred)
+// irradiance queries as visible points for progressive passes
+void RayTracer::TraceVisiblePointsThread(unsigned int threadNum, const SDLWindow& window, const Scene& scene) {
+	RenderContext* ctx = renderContexts[threadNum];
+
+	const unsigned int rows = window.GetSizeY() / numThreads;
+	const unsigned int rest = (threadNum == (numThreads - 1))? (window.GetSizeY() % numThreads): 0;
+	const unsigned int ymin = threadNum * rows;
+	const unsigned int ymax = ymin + rows + rest;
+
+	IrradianceBatch* batch = irradianceBatches[threadNum];
+	batch->active = true;
+
+	for (unsigned int y = ymin; y < ymax; y++) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x++) {
+			batch->pixelIdx = y * window.GetSizeX() + x;
+			directPixels[batch->pixelIdx] = TracePixel(ctx, window, scene, x, y);
+		}
+	}
+
+	batch->active = false;
+	batch->points.resize(batch->queries.size());
+
+	for (size_t i = 0; i < batch->queries.size(); i++) {
+		const PhotonMap::IrradianceQuery& query = batch->queries[i];
+		VisiblePoint& point = batch->points[i];
+
+		point.pos = query.pos;
+		point.nrm = query.nrm;
+		point.wgt = batch->weights[query.id];
+		point.radius = photonSearchRadius;
+		point.pixel = batch->pixels[query.id];
+	}
+
+	batch->Clear();
+}
+
+// add the photons of the current pass-map to the visible points
+// of our band and write the band's pixels estimated from <numPasses>
+// passes (each pass-map has its power normalized separately)
+void RayTracer::UpdateVisiblePointsThread(unsigned int threadNum, SDLWindow& window, unsigned int numPasses) {
+	const unsigned int rows = window.GetSizeY() / numThreads;
+	const unsigned int rest = (threadNum == (numThreads - 1))? (window.GetSizeY() % numThreads): 0;
+	const unsigned int ymin = threadNum * rows;
+	const unsigned int ymax = ymin + rows + rest;
+
+	const unsigned int pxmin = ymin * window.GetSizeX();
+	const unsigned int pxmax = ymax * window.GetSizeX();
+
+	std::vector<VisiblePoint>& points = irradianceBatches[threadNum]->points;
+	std::vector<math::vec3f> bandPixels(directPixels.begin() + pxmin, directPixels.begin() + pxmax);
+
+	for (size_t i = 0; i < points.size(); i++) {
+		VisiblePoint& point = points[i];
+
+		unsigned int newCount = 0;
+		const math::vec3f newFlux = photonMap->GetPhotonFlux(point.pos, point.nrm, point.radius, &newCount);
+
+		if (newCount > 0) {
+			// keep only a fraction <alpha> of the new photons and
+			// shrink the radius so that the density is preserved
+			const float count = point.count + progressiveAlpha * newCount;
+			const float ratio = count / (point.count + newCount);
+
+			point.radius *= sqrtf(ratio);
+			point.flux = (point.flux + newFlux) * ratio;
+			point.count = count;
+		}
+
+		bandPixels[point.pixel - pxmin] += (point.wgt * point.flux * (1.0f / (M_PI * point.radius * point.radius * numPasses)));
+	}
+
+	for (unsigned int y = ymin; y < ymax; y++) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x++) {
+			window.SetPixel(x, y, bandPixels[y * window.GetSizeX() + x - pxmin]);
+		}
+	}
+
+	if (incrementalRender) {
+		window.SwapBuffers(numThreads);
+	}
+}
+
+void RayTracer::RenderProgressiveThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	SDLWindow& window,
+	const Scene& scene
+) {
+	TraceVisiblePointsThread(threadNum, window, scene);
+
+	for (unsigned int passNum = 1; !progressiveDone; passNum++) {
+		TracePhotonThread(threadNum, barrier, scene, photonMap, NULL);
+		UpdateVisiblePointsThread(threadNum, window, passNum);
+
+		// nobody may use the pass-map anymore when it is replaced
+		barrier->wait();
+
+		if (threadNum == 0) {
+			const unsigned int elapsedTime = SDL_GetTicks() - renderStartTime;
+
+			progressiveDone = progressiveDone || (progressivePasses > 0 && passNum >= progressivePasses);
+			progressiveDone = progressiveDone || (progressiveTimeBudget > 0.0f && elapsedTime >= (progressiveTimeBudget * 1000.0f));
+
+			std::cout << "[RayTracer::RenderProgressiveThread]";
+			std::cout << " pass: " << passNum << ", photons: " << (passNum * mapNumPhotons);
+			std::cout << ", time: " << elapsedTime << "ms";
+			std::cout << std::endl;
+
+			if (!progressiveDone) {
+				// discard the photons of this pass; memory use stays
+				// the same no matter how many passes are traced
+				delete photonMap;
+
+				photonMap = new PhotonMap::Map(mapNumPhotons, PhotonMap::PHOTONMAP_GLOBAL);
+				photonMap->SetSearchEpsilon(photonSearchEpsilon);
+				photonMap->SetSearchNodeLimit(photonSearchMaxNodes);
+
+				// the next pass overwrites every pixel
+				window.ResetPixelStats();
+			}
+		}
+
+		// wait until first thread has set up the next pass
+		barrier->wait();
+	}
+}
+
+
+
+
+
+
+#if (BENCHMARK_PHOTON_SAMPLING == 1)
+// trace photon-maps with 1/8, 1/4, 1/2 and all of the configured
+// number of photons, each with pseudo- and with quasi-random
+// emission, and compare their irradiance estimates on a grid of
+// primary-ray hits to those of a (pseudo-random) reference map
+// with BENCHMARK_PHOTON_SAMPLING_REFERENCE_SCALE times as many
+// photons; runs on the first thread only
+void RayTracer::BenchmarkPhotonSampling(const SDLWindow& window, const Scene& scene, RenderContext* ctx) {
+	const Camera* camera = scene.GetCamera();
+	const std::list<ISceneLight*>& lights = scene.GetLights();
+
+	const unsigned int pixelStride = BENCHMARK_PHOTON_SAMPLING_PIXEL_STRIDE;
+	const unsigned int numSizes = 4;
+
+	std::vector<PhotonMap::IrradianceQuery> queries;
+
+	for (unsigned int y = 0; y < window.GetSizeY(); y += pixelStride) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x += pixelStride) {
+			const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+			math::RayIntersection pxlRayInt;
+
+			if (scene.GetClosestObject(ctx, pxlRay, &pxlRayInt) == NULL)
+				continue;
+			if (pxlRayInt.GetObj()->GetMaterial()->IsSpecularlyReflective())
+				continue;
+
+			queries.push_back(PhotonMap::IrradianceQuery(pxlRayInt.GetPos(), pxlRayInt.GetNrm(), queries.size()));
+		}
+	}
+
+	if (queries.empty()) {
+		return;
+	}
+
+	std::vector<math::vec3f> refEstimates(queries.size());
+
+	std::cout << "[RayTracer::BenchmarkPhotonSampling]" << std::endl;
+	std::cout << "	numQueries: " << queries.size() << std::endl;
+
+	// the first run traces the reference map
+	for (unsigned int run = 0; run <= (numSizes * 2); run++) {
+		const bool reference = (run == 0);
+		const bool quasiRandom = (!reference && ((run - 1) % 2) == 1);
+
+		const float photonScale = (reference)?
+			float(BENCHMARK_PHOTON_SAMPLING_REFERENCE_SCALE):
+			(1.0f / (1 << (numSizes - 1 - ((run - 1) / 2))));
+
+		PhotonMap::Map map(mapNumPhotons * photonScale, PhotonMap::PHOTONMAP_GLOBAL);
+		map.SetSearchEpsilon(photonSearchEpsilon);
+		map.SetSearchNodeLimit(photonSearchMaxNodes);
+
+		Benchmark traceBench((reference)? "reference": ((quasiRandom)? "quasi-random": "pseudo-random"));
+		traceBench.Start();
+
+		unsigned int lightNum = 0;
+		unsigned int lightPhotonIdx = 0;
+		unsigned int numPhotons = 0;
+
+		for (std::list<ISceneLight*>::const_iterator it = lights.begin(); it != lights.end(); it++, lightNum++) {
+			const unsigned int numLightPhotons = std::max(1U, (unsigned int) ((*it)->GetNumPhotons() * photonScale));
+
+			EmitPhotons(ctx, scene, &map, *it, lightNum, lightPhotonIdx, numLightPhotons, 1, numLightPhotons, quasiRandom);
+
+			lightPhotonIdx += numLightPhotons;
+			numPhotons += numLightPhotons;
+		}
+
+		map.Finalize();
+		traceBench.Stop();
+
+		float sqErrorSum = 0.0f;
+
+		for (size_t i = 0; i < queries.size(); i++) {
+			const math::vec3f irr = map.GetIrradianceEstimate(queries[i].pos, queries[i].nrm, photonSearchRadius, photonSearchCount, false, &ctx->queryBuffer);
+
+			if (reference) {
+				refEstimates[i] = irr;
+			} else {
+				sqErrorSum += (irr - refEstimates[i]).sqLen3D();
+			}
+		}
+
+		std::cout << "	" << traceBench.GetName() << ":" << std::endl;
+		std::cout << "		photons:    " << numPhotons << std::endl;
+		std::cout << "		time (ms):  " << traceBench.GetElapsedTime() << std::endl;
+
+		if (!reference) {
+			std::cout << "		RMS error:  " << sqrtf(sqErrorSum / queries.size()) << std::endl;
+		}
+	}
+}
+#endif
+
+#if (BENCHMARK_IRRADIANCE_QUERY_BATCHING == 1)
+// compare resolving the irradiance estimates for all primary-
+// ray hits one at a time in scanline order (as done without
+// BATCHED_IRRADIANCE_QUERIES) with resolving them per tile in
+// Morton order through PhotonMap::Map::GetIrradianceEstimates
+void RayTracer::BenchmarkIrradianceQueries(const SDLWindow& window, const Scene& scene) {
+	const Camera* camera = scene.GetCamera();
+
+	const unsigned int tileSize = RENDER_TILE_SIZE;
+	const unsigned int numTilesX = (window.GetSizeX() + tileSize - 1) / tileSize;
+	const unsigned int numTilesY = (window.GetSizeY() + tileSize - 1) / tileSize;
+
+	std::vector<PhotonMap::IrradianceQuery> scanQueries;
+	std::vector< std::vector<PhotonMap::IrradianceQuery> > tileQueries(numTilesX * numTilesY);
+
+	for (unsigned int y = 0; y < window.GetSizeY(); y++) {
+		for (unsigned int x = 0; x < window.GetSizeX(); x++) {
+			const math::RaySegment pxlRay(camera->GetPos(), camera->GetPixelDir(window, x, y));
+			math::RayIntersection pxlRayInt;
+
+			if (scene.GetClosestObject(renderContexts[0], pxlRay, &pxlRayInt) == NULL)
+				continue;
+			if (pxlRayInt.GetObj()->GetMaterial()->IsSpecularlyReflective())
+				continue;
+
+			const PhotonMap::IrradianceQuery query(pxlRayInt.GetPos(), pxlRayInt.GetNrm(), scanQueries.size());
+
+			scanQueries.push_back(query);
+			tileQueries[(y / tileSize) * numTilesX + (x / tileSize)].push_back(query);
+		}
+	}
+
+	if (scanQueries.empty()) {
+		return;
+	}
+
+	std::vector<math::vec3f> scanEstimates(scanQueries.size());
+	std::vector<math::vec3f> tileEstimates(scanQueries.size());
+
+	Benchmark scanBench("scanline", true);
+	Benchmark tileBench("batched", true);
+
+	scanBench.Start();
+
+	// both use one query buffer (as the render threads do)
+	PhotonMap::QueryBuffer* queryBuffer = &renderContexts[0]->queryBuffer;
+
+	for (size_t i = 0; i < scanQueries.size(); i++) {
+		scanEstimates[i] = photonMap->GetIrradianceEstimate(scanQueries[i].pos, scanQueries[i].nrm, photonSearchRadius, photonSearchCount, false, queryBuffer);
+	}
+
+	scanBench.Stop();
+	tileBench.Start();
+
+	for (size_t n = 0; n < tileQueries.size(); n++) {
+		photonMap->GetIrradianceEstimates(tileQueries[n], photonSearchRadius, photonSearchCount, queryBuffer);
+	}
+
+	tileBench.Stop();
+
+	float maxDiff = 0.0f;
+
+	for (size_t n = 0; n < tileQueries.size(); n++) {
+		for (size_t i = 0; i < tileQueries[n].size(); i++) {
+			tileEstimates[tileQueries[n][i].id] = tileQueries[n][i].irr;
+		}
+	}
+	for (size_t i = 0; i < scanQueries.size(); i++) {
+		maxDiff = std::max(maxDiff, (scanEstimates[i] - tileEstimates[i]).len3D());
+	}
+
+	const Benchmark* benchmarks[2] = {&scanBench, &tileBench};
+
+	std::cout << "[RayTracer::BenchmarkIrradianceQueries]" << std::endl;
+	std::cout << "\tnumQueries:  " << scanQueries.size() << std::endl;
+	std::cout << "\ttileSize:    " << tileSize << std::endl;
+
+	for (unsigned int n = 0; n < 2; n++) {
+		const Benchmark* b = benchmarks[n];
+
+		std::cout << "\t" << b->GetName() << ":" << std::endl;
+		std::cout << "\t\ttime (ms):  " << b->GetElapsedTime() << std::endl;
+
+		if (b->HaveCounter(Benchmark::COUNTER_L1D_READ_MISSES))
+			std::cout << "\t\tL1D misses: " << b->GetCounter(Benchmark::COUNTER_L1D_READ_MISSES) << std::endl;
+		if (b->HaveCounter(Benchmark::COUNTER_LLC_MISSES))
+			std::cout << "\t\tLLC misses: " << b->GetCounter(Benchmark::COUNTER_LLC_MISSES) << std::endl;
+	}
+
+	std::cout << "\tmax. estimate difference: " << maxDiff << std::endl;
+}
+#endif
+
+
+
+
+
+
+void RayTracer::RenderThread(
+	unsigned int threadNum,
+	boost::barrier* barrier,
+	SDLWindow& window,
+	const Scene& scene
+) {
+	#if (USE_PROJECTION_MAPS == 1)
+	if (!projectionMaps.empty() && !mapsBuilt) {
+		BuildProjectionMapsThread(threadNum, barrier, scene);
+	}
+	#endif
+
+	#if (USE_SHADOW_PHOTONS == 1)
+	if (!shadowPhotonMaps.empty() && !mapsBuilt) {
+		TraceShadowPhotonThread(threadNum, barrier, scene);
+	}
+	#endif
+
+	#if (USE_IMPORTONS == 1)
+	if (importanceGrid != NULL && !mapsBuilt) {
+		TraceImportonThread(threadNum, barrier, window, scene);
+	}
+	#endif
+
+	if (progressiveRender) {
+		RenderProgressiveThread(threadNum, barrier, window, scene);
+		return;
+	}
+
+	if (photonMapping) {
+		if (!photonMapLoaded && !mapsBuilt) {
+			#if (BENCHMARK_PHOTON_SAMPLING == 1)
+			if (threadNum == 0) {
+				BenchmarkPhotonSampling(window, scene, renderContexts[threadNum]);
+			}
+
+			// keep the other threads idle while measuring
+			barrier->wait();
+			#endif
+
+			TracePhotonThread(threadNum, barrier, scene, photonMap, &window);
+		}
+
+		#if (BENCHMARK_IRRADIANCE_QUERY_BATCHING == 1)
+		if (threadNum == 0) {
+			BenchmarkIrradianceQueries(window, scene);
+		}
+
+		// keep the other threads idle while measuring
+		barrier->wait();
+		#endif
+	}
+
+	TraceRayThread(threadNum, window, scene);
+}
+
+void RayTracer::Render(SDLWindow& window, const Scene& scene) {
+	profiler->StartTask("[Render]", SDL_GetTicks());
+
+	boost::barrier threadBarrier(numThreads);
+
+	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
+		if (renderContexts[threadNum]->rng == NULL) {
+			// note: each RNG must use a different seed
+			renderContexts[threadNum]->rng = new RNGflt64(SDL_GetTicks() % random());
+		}
+	}
+
+	if (photonRoundMap != NULL && !mapsBuilt) {
+		FindPhotonProbes(window, scene);
+	}
+
+	if (!progressiveRender) {
+		ScheduleRenderTiles(window);
+	}
+
+	#if (USE_PRIMARY_GBUFFER == 1)
+	// the G-buffer is filled during the photon pass, and holds
+	// the only primary ray of each pixel (pinhole camera, no AA)
+	useGBuffer = photonMapping && !photonMapLoaded && !mapsBuilt && !progressiveRender;
+	useGBuffer = useGBuffer && !antiAliasing && !scene.GetCamera()->RenderDOF() && (maxRayDepth > 0);
+	#endif
+
+	// with a single primary ray per pixel, the noise of the
+	// roulette would show up as speckle instead of averaging out
+	rayRoulette = (antiAliasing || scene.GetCamera()->RenderDOF());
+
+	if (useGBuffer) {
+		gBuffer.assign(window.GetSizeX() * window.GetSizeY(), math::RayIntersection());
+		nextGBufferRow = 0;
+	}
+
+	if (progressiveRender) {
+		if (mapsBuilt) {
+			// the passes start over with an empty map (the
+			// previous call left its last pass's map behind)
+			delete photonMap;
+
+			photonMap = new PhotonMap::Map(mapNumPhotons, PhotonMap::PHOTONMAP_GLOBAL);
+			photonMap->SetSearchEpsilon(photonSearchEpsilon);
+			photonMap->SetSearchNodeLimit(photonSearchMaxNodes);
+
+			window.ResetPixelStats();
+		}
+
+		directPixels.clear();
+		directPixels.resize(window.GetSizeX() * window.GetSizeY());
+
+		progressiveDone = false;
+		renderStartTime = SDL_GetTicks();
+	}
+
+	threadPool->Run(boost::bind(&RayTracer::RenderThread, this, _1, &threadBarrier, boost::ref(window), boost::cref(scene)));
+
+	if (useGBuffer) {
+		std::vector<math::RayIntersection>().swap(gBuffer);
+		useGBuffer = false;
+	}
+
+	if (photonMapping) {
+		photonMap->PrintQueryStatistics();
+	}
+
+	if (irradianceCache != NULL) {
+		irradianceCache->PrintStatistics();
+
+		if (!irradianceCacheFile.empty()) {
+			irradianceCache->SaveToFile(irradianceCacheFile, GetIrradianceCacheHash());
+		}
 	}
 
-	threads.clear();
-	rngs.clear();
+	mapsBuilt = true;
 
 	window.NormalizeBuffers();
 	profiler->StopTask("[Render]", SDL_GetTicks());
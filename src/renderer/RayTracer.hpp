@@ -1,6 +1,9 @@
 #ifndef KIRAN_RAYTRACER_HDR
 #define KIRAN_RAYTRACER_HDR
 
+#include <string>
+#include <vector>
+#include <stdint.h>
 #include "../math/vec3fwd.hpp"
 
 namespace boost {
@@ -14,14 +17,25 @@ namespace math {
 }
 
 struct LuaParser;
+struct LuaTable;
 struct SDLWindow;
 class Scene;
+struct ISceneLight;
+struct ISceneObject;
 class Profiler;
+class ImportanceGrid;
+class IrradianceCache;
+class ProjectionMap;
 class RNGflt64;
+class QRNGHalton;
+class ThreadPool;
+struct RenderContext;
 
 namespace PhotonMap {
 	class Map;
 	struct Photon;
+	struct PhotonGroup;
+	struct IrradianceQuery;
 };
 
 class RayTracer {
@@ -50,32 +64,225 @@ public:
 	unsigned int GetNumThreads() const { return numThreads; }
 
 private:
-	math::vec3f GatherIrradianceEstimate(unsigned int, const math::RayIntersection*, const Scene&, RNGflt64*);
-	math::vec3f SampleDirectIllumination(unsigned int, const Scene&, const math::RaySegment&, const math::RayIntersection&, RNGflt64*, unsigned int) const;
-	math::vec3f ShadeRayPM(unsigned int, const math::RaySegment&, const math::RayIntersection&, const Scene&, RNGflt64*, unsigned int);
-	math::vec3f ShadeRayRT(unsigned int, const math::RaySegment&, const math::RayIntersection&, const Scene&, RNGflt64*, unsigned int);
-	math::vec3f TraceRay(unsigned int, const math::RaySegment&, const Scene&, RNGflt64*, unsigned int, unsigned int);
-	void TracePhoton(unsigned int, const Scene&, PhotonMap::Map*, PhotonMap::Photon*, RNGflt64*, unsigned int, bool);
+	// per-thread set of deferred irradiance queries
+	struct IrradianceBatch;
+	// cell of the lattice of batched queries in a tile
+	struct IrradianceCell;
+	// per-query statistics of the progressive mode
+	struct VisiblePoint;
+	// per-thread batch of photons in flight
+	struct PhotonStream;
+	// unit of work handed out while emitting photons
+	struct PhotonChunk;
+	// group of paths of a light traced in animation mode
+	struct PathGroup;
+	// per-thread queue of tiles to be ray-traced
+	struct TileQueue;
 
-	void TraceRayThread(unsigned int, SDLWindow&, const Scene&, RNGflt64*);
-	void TracePhotonThread(unsigned int, boost::barrier*, const Scene&, PhotonMap::Map*, RNGflt64*);
-	void RenderThread(unsigned int, boost::barrier*, SDLWindow&, const Scene&, RNGflt64*);
+	math::vec3f GatherIrradianceEstimate(RenderContext*, const math::RayIntersection*, const Scene&, unsigned int, math::vec3f);
+	math::vec3f GatherIrradianceRecord(RenderContext*, const math::RayIntersection*, const Scene&);
+	const ISceneObject* TraceGatherRay(RenderContext*, const Scene&, const math::RaySegment&, math::RayIntersection*, math::vec3f*);
+	math::vec3f SampleDirectIllumination(RenderContext*, const Scene&, const math::RaySegment&, const math::RayIntersection&, unsigned int) const;
+	math::vec3f ShadeRayPM(RenderContext*, const math::RaySegment&, const math::RayIntersection&, const Scene&, unsigned int, const math::vec3f&, const math::vec3f&);
+	math::vec3f ShadeRayRT(RenderContext*, const math::RaySegment&, const math::RayIntersection&, const Scene&, unsigned int, const math::vec3f&);
+	math::vec3f TraceRay(RenderContext*, const math::RaySegment&, const Scene&, unsigned int, unsigned int, const math::vec3f&, const math::RayIntersection* = NULL);
+	math::vec3f ShadeRay(RenderContext*, const math::RaySegment&, const math::RayIntersection&, const Scene&, unsigned int, math::vec3f, const math::vec3f&);
+	void PushRay(RenderContext*, const math::RaySegment&, const math::vec3f&, unsigned int, unsigned int);
+	math::vec3f TracePixel(RenderContext*, const SDLWindow&, const Scene&, unsigned int, unsigned int);
+	void TracePhoton(RenderContext*, const Scene&, PhotonMap::Map*, std::vector<PhotonMap::Photon>*, PhotonMap::Photon*, const double*, unsigned int, bool);
+	void TraceShadowPhoton(RenderContext*, const Scene&, PhotonMap::Map*, const math::vec3f&, const math::vec3f&);
+	void TraceImporton(RenderContext*, const Scene&, const math::RaySegment&, unsigned int);
+	bool ScatterPhoton(RenderContext*, const Scene&, const double*, unsigned int, math::vec3f*, math::vec3f*, math::vec3f*, bool*, PhotonMap::Photon*, bool*);
+	bool KeepPhoton(PhotonMap::Photon*, RNGflt64*) const;
+	float SampleEmission(const ISceneLight*, unsigned int, RNGflt64*, const double*, math::vec3f*, math::vec3f*) const;
+	math::vec3f SampleAreaLightPos(const ISceneLight*, const math::vec3f&, unsigned int, unsigned int, RNGflt64*) const;
+	void EmitPhotons(RenderContext*, const Scene&, PhotonMap::Map*, const ISceneLight*, unsigned int, unsigned int, unsigned int, unsigned int, unsigned int, bool, std::vector<PhotonMap::Photon>* = NULL);
+	void TracePilotPaths(RenderContext*, const Scene&, const ISceneLight*, unsigned int, unsigned int, unsigned int, unsigned int, PhotonMap::PhotonGroup*) const;
+	bool PilotPathsMoved(const PhotonMap::PhotonGroup&, const PhotonMap::PhotonGroup&) const;
+	void StorePhotonGroups(PhotonMap::Map*, unsigned int);
+
+	void ResolveIrradianceBatch(RenderContext*, IrradianceBatch*, math::vec3f*);
+	void ResolveIrradianceLattice(RenderContext*, IrradianceBatch*);
+	bool InterpolateIrradianceCell(IrradianceBatch*, const IrradianceCell&, const std::vector<int>&, std::vector<unsigned char>*);
+	void BenchmarkIrradianceQueries(const SDLWindow&, const Scene&);
+	void BenchmarkPhotonSampling(const SDLWindow&, const Scene&, RenderContext*);
+	void FindPhotonProbes(const SDLWindow&, const Scene&);
+	void EndPhotonRound(PhotonMap::Map*, unsigned int);
+
+	void TraceGBufferRows(RenderContext*, const SDLWindow&, const Scene&);
+	void ScheduleRenderTiles(const SDLWindow&);
+	bool GetRenderTile(unsigned int, unsigned int*, bool*);
+	void TraceRayThread(unsigned int, SDLWindow&, const Scene&);
+	void TracePhotonThread(unsigned int, boost::barrier*, const Scene&, PhotonMap::Map*, const SDLWindow*);
+	void TracePhotonRound(unsigned int, boost::barrier*, const Scene&, PhotonMap::Map*, unsigned int*);
+	void TracePhotonGroups(unsigned int, boost::barrier*, const Scene&, PhotonMap::Map*, unsigned int*);
+	void BuildProjectionMapsThread(unsigned int, boost::barrier*, const Scene&);
+	void TraceShadowPhotonThread(unsigned int, boost::barrier*, const Scene&);
+	void TraceImportonThread(unsigned int, boost::barrier*, const SDLWindow&, const Scene&);
+	void TraceVisiblePointsThread(unsigned int, const SDLWindow&, const Scene&);
+	void UpdateVisiblePointsThread(unsigned int, SDLWindow&, unsigned int);
+	void RenderProgressiveThread(unsigned int, boost::barrier*, SDLWindow&, const Scene&);
+	void RenderThread(unsigned int, boost::barrier*, SDLWindow&, const Scene&);
+
+	uint64_t GetPhotonMapHash(const LuaTable*, const LuaTable* = NULL, bool = true) const;
+	uint64_t GetIrradianceCacheHash() const;
+	std::string GetLightPhotonsFile(unsigned int) const;
 
 	unsigned int numThreads;
 	unsigned int maxRayDepth;
 	unsigned int maxPhotonDepth;
 	bool antiAliasing;
 	bool incrementalRender;
+	// whether every render thread is bound to one CPU
+	bool pinThreads;
+
+	// workers (and the scratch memory of each) shared by
+	// all calls to Render
+	ThreadPool* threadPool;
+	std::vector<RenderContext*> renderContexts;
 
 	bool photonMapping;
 	unsigned int photonSearchCount;
 	float photonSearchRadius;
+	// (1 + eps)-approximation factor and visited-node
+	// cap for kd-tree searches (0 means exact search)
+	float photonSearchEpsilon;
+	unsigned int photonSearchMaxNodes;
+	// if not empty, the photon-map is saved to this file
+	// once all photons have been traced, and loaded from
+	// it instead on later runs of the same scene (camera
+	// changes aside); with photonMapOutOfCore, the map is
+	// never held in memory: photons are traced into a
+	// scratch file and balanced from there into this one
+	std::string photonMapFile;
+	bool photonMapOutOfCore;
+	// if set, the map is attached from (or, once traced,
+	// published to) shared memory keyed by photonMapHash,
+	// so concurrent processes rendering the same scene in
+	// eg. other frames or crop regions only build it once;
+	// the object is removed when its last user exits unless
+	// photonMapSharedPersist is set
+	bool photonMapShared;
+	bool photonMapSharedPersist;
+	bool photonMapLoaded;
+	// identifies the scene the stored photons belong to
+	uint64_t photonMapHash;
+	// in animation mode, the photons of each light are also
+	// kept in a file of their own (next to photonMapFile) so
+	// that a frame in which only some of the lights changed
+	// re-traces just the photons of those, and of a light that
+	// only moved just the path groups whose pilot paths now
+	// hit the scene further than animationReuseRadius away
+	bool animationMode;
+	float animationReuseRadius;
+	std::vector<uint64_t> lightPhotonHashes;
+	std::vector<uint64_t> lightGroupHashes;
+	std::vector<bool> lightPhotonsCached;
+	// per light, the path groups of the previous frame (indexed
+	// by group, empty if none can be kept)
+	std::vector< std::vector<PhotonMap::PhotonGroup> > lightPhotonGroups;
+	// path groups of the light being traced
+	std::vector<PathGroup> pathGroups;
 
 	// stores all light-paths matching L(S|D)*D
 	PhotonMap::Map* photonMap;
 	// total number of photons emitted by all lights
 	unsigned int mapNumPhotons;
 
+	// adaptive photon count: if adaptivePhotonError is not
+	// 0, every light emits its photons in rounds (each into
+	// photonRoundMap, which is then merged into photonMap)
+	// until the relative standard error of the irradiance at
+	// the probe positions (primary-ray hits) falls below it
+	// or adaptivePhotonMaxRounds rounds have been traced
+	float adaptivePhotonError;
+	unsigned int adaptivePhotonMaxRounds;
+	bool photonRoundsDone;
+	PhotonMap::Map* photonRoundMap;
+	std::vector<PhotonMap::IrradianceQuery> photonProbes;
+	// per-probe sums of (squared) irradiance over all rounds
+	std::vector<double> photonProbeSums;
+	std::vector<double> photonProbeSqSums;
+
+	std::vector<IrradianceBatch*> irradianceBatches;
+
+	// tiles of the ray-tracing pass: numTilesX per row,
+	// numTiles in total, numTilesDone so far (incremented
+	// atomically)
+	std::vector<TileQueue*> tileQueues;
+	unsigned int numTilesX;
+	unsigned int numTiles;
+	unsigned int numTilesDone;
+
+	// first hit of the primary ray through every pixel (if
+	// useGBuffer), traced row by row (nextGBufferRow is the
+	// next one, incremented atomically) while the photon-map
+	// is finalized, so the ray-tracing pass only shades them
+	std::vector<math::RayIntersection> gBuffer;
+	unsigned int nextGBufferRow;
+	bool useGBuffer;
+
+	// whether PushRay plays Russian roulette this frame (only
+	// if several primary rays are averaged per pixel)
+	bool rayRoulette;
+
+	// whether an earlier call to Render already built the
+	// projection, shadow-photon, importance and photon maps
+	// (which are finalized then), so later calls only render
+	bool mapsBuilt;
+
+	// quasi-random numbers for emitting photons, and the
+	// index of the first point used by the next photon pass
+	// (so progressive passes do not repeat each other)
+	QRNGHalton* photonSequence;
+	unsigned int photonSequenceOffset;
+	// next chunk of photons to be emitted in this round
+	// (shared by all threads, incremented atomically)
+	unsigned int nextPhotonChunk;
+
+	// per-light map of emission directions that hit the
+	// scene (NULL for area-lights)
+	std::vector<ProjectionMap*> projectionMaps;
+
+	// number of importons traced from the camera (0 means
+	// all photons are stored) and the resulting importance
+	unsigned int numImportons;
+	ImportanceGrid* importanceGrid;
+
+	// final gathers are cached (and re-used by all points
+	// within irradianceCacheError of them) if the error is
+	// not 0; record radii are clamped to the min and max
+	float irradianceCacheError;
+	float irradianceCacheMinRadius;
+	float irradianceCacheMaxRadius;
+	std::string irradianceCacheFile;
+	IrradianceCache* irradianceCache;
+
+	// number of shadow photons emitted by each light (0
+	// disables them) and their kNN search radius
+	unsigned int numShadowPhotons;
+	float shadowPhotonSearchRadius;
+	// one map of direct and shadow photons per light
+	std::vector<PhotonMap::Map*> shadowPhotonMaps;
+
+	// stochastic progressive photon mapping: the irradiance
+	// queries of all pixels are made once, photon-maps of
+	// mapNumPhotons photons are then traced (and discarded)
+	// pass after pass and accumulated into the queries with
+	// shrinking radii until either limit below is reached
+	bool progressiveRender;
+	bool progressiveDone;
+	// maximum number of passes (0 means no limit)
+	unsigned int progressivePasses;
+	// maximum rendering time in seconds (0 means no limit)
+	float progressiveTimeBudget;
+	// fraction of new photons kept per pass, in (0, 1)
+	float progressiveAlpha;
+	unsigned int renderStartTime;
+
+	// everything not estimated via photons, per pixel
+	std::vector<math::vec3f> directPixels;
+
 	Profiler* profiler;
 };
 
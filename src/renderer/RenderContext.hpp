@@ -0,0 +1,65 @@
+#ifndef KIRAN_RENDER_CONTEXT_HDR
+#define KIRAN_RENDER_CONTEXT_HDR
+
+#include <vector>
+
+#include "../math/vec3fwd.hpp"
+#include "../math/vec3.hpp"
+#include "../math/Ray.hpp"
+#include "../datastructs/PhotonMap.hpp"
+#include "../system/RNG.hpp"
+
+// everything a render thread needs while tracing rays, photons
+// or importons that would otherwise be allocated per ray, per
+// query or per tile; created once per thread by the RayTracer
+// and handed down (in place of the thread number) through all
+// of its hot paths, so only its own thread ever touches it
+struct RenderContext {
+	// secondary ray waiting to be traced, with the throughput
+	// (product of the reflectances and transmittances along the
+	// path from the primary ray) its irradiance is scaled by
+	struct PendingRay {
+		PendingRay(const math::RaySegment& r, const math::vec3f& w, unsigned int d, unsigned int t):
+			ray(r), wgt(w), depth(d), type(t) {}
+
+		math::RaySegment ray;
+		math::vec3f wgt;
+
+		unsigned int depth;
+		unsigned int type;
+	};
+
+	RenderContext(unsigned int n): threadNum(n), rng(NULL) {}
+	~RenderContext() { delete rng; }
+
+	// also selects this thread's row of Profiler counters
+	unsigned int threadNum;
+
+	// seeded on the first call to RayTracer::Render
+	RNGflt64* rng;
+
+	// per-object state of the ray being stepped through the
+	// object grid, see Scene::StepRayThroughGrid
+	std::vector<int> intersectionCache;
+
+	// kNN heaps of all photon-map queries
+	PhotonMap::QueryBuffer queryBuffer;
+
+	// per-stratum estimates, hit distances and specularity of
+	// a final gather, see RayTracer::GatherIrradianceRecord
+	std::vector<math::vec3f> gatherEsts;
+	std::vector<float> gatherDists;
+	std::vector<unsigned char> gatherSpecular;
+
+	// rays spawned but not yet traced by RayTracer::TraceRay
+	std::vector<PendingRay> rayStack;
+
+	// pixels of the tile being traced
+	std::vector<math::vec3f> tilePixels;
+
+private:
+	RenderContext(const RenderContext&);
+	void operator = (const RenderContext&);
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include "./Material.hpp"
 #include "./MaterialReflectionModel.hpp"
 #include "./Camera.hpp"
+#include "./RenderContext.hpp"
 #include "../datastructs/UniformGrid.hpp"
 #include "../system/Defines.hpp"
 #include "../system/LuaParser.hpp"
@@ -234,15 +235,17 @@ void Scene::AddObjectsToGrid() {
 
 
 #if (SCENEOBJECT_GRID_PARTITIONING == 1)
-const ISceneObject* Scene::StepRayThroughGrid(unsigned int threadNum, const math::RaySegment& r, math::RayIntersection* i, float maxObjDst) const {
-	// statically allocate the intersection-test cache
-	// (Scene::Scene() does not yet know <numThreads>)
-	// note that this is a minor memory-leak
-	static const unsigned int numObjects = objects.size();
-	static std::vector<int> intersectionCache(numThreads * numObjects);
+const ISceneObject* Scene::StepRayThroughGrid(RenderContext* ctx, const math::RaySegment& r, math::RayIntersection* i, float maxObjDst) const {
+	// the intersection-test cache of the calling thread
+	// (only allocated by the first ray it steps)
+	std::vector<int>& intersectionCache = ctx->intersectionCache;
 
-	// reset the cache for this thread
-	memset(&intersectionCache[threadNum * numObjects], RAY_INTERSECTION_UNTESTED, numObjects * sizeof(int));
+	if (intersectionCache.size() != objects.size()) {
+		intersectionCache.resize(objects.size());
+	}
+
+	// reset the cache for this ray
+	memset(&intersectionCache[0], RAY_INTERSECTION_UNTESTED, objects.size() * sizeof(int));
 
 	math::vec3f pos = r.GetPos();
 	math::vec3f dir = r.GetDir();
@@ -268,7 +271,7 @@ const ISceneObject* Scene::StepRayThroughGrid(unsigned int threadNum, const math
 			// test each object in this cell for intersection
 			for (std::list<const ISceneObject*>::const_iterator it = objs.begin(); it != objs.end(); ++it) {
 				const ISceneObject* obj    = *it;
-				const unsigned int  objIdx = (threadNum * numObjects) + obj->GetID();
+				const unsigned int  objIdx = obj->GetID();
 
 				bool haveIntersection = false;
 				bool delayedIntersection = false;
@@ -384,14 +387,14 @@ const ISceneObject* Scene::StepRayThroughGrid(unsigned int threadNum, const math
 
 
 
-const ISceneObject* Scene::GetOccludingObject(unsigned int threadNum, const math::RaySegment& r, math::RayIntersection* i, const math::vec3f& pos) const {
+const ISceneObject* Scene::GetOccludingObject(RenderContext* ctx, const math::RaySegment& r, math::RayIntersection* i, const math::vec3f& pos) const {
 	#if (SCENEOBJECT_GRID_PARTITIONING == 1)
-	return (StepRayThroughGrid(threadNum, r, i, (r.GetPos() - pos).sqLen3D()));
+	return (StepRayThroughGrid(ctx, r, i, (r.GetPos() - pos).sqLen3D()));
 	#else
 	const float maxObjDst = (r.GetPos() - pos).sqLen3D();
 	      float curObjDst = 0.0f;
 
-	threadNum = -1;
+	ctx = ctx;
 	math::RayIntersection objInt;
 
 	for (std::list<ISceneObject*>::const_iterator it = objects.begin(); it != objects.end(); ++it) {
@@ -411,14 +414,14 @@ const ISceneObject* Scene::GetOccludingObject(unsigned int threadNum, const math
 	#endif
 }
 
-const ISceneObject* Scene::GetClosestObject(unsigned int threadNum, const math::RaySegment& r, math::RayIntersection* i) const {
+const ISceneObject* Scene::GetClosestObject(RenderContext* ctx, const math::RaySegment& r, math::RayIntersection* i) const {
 	#if (SCENEOBJECT_GRID_PARTITIONING == 1)
-	return (StepRayThroughGrid(threadNum, r, i, -1.0f));
+	return (StepRayThroughGrid(ctx, r, i, -1.0f));
 	#else
 	float minObjDst = FLT_MAX;
 	float curObjDst = 0.0f;
 
-	threadNum = -1;
+	ctx = ctx;
 	math::RayIntersection objInt;
 
 	for (std::list<ISceneObject*>::const_iterator it = objects.begin(); it != objects.end(); ++it) {
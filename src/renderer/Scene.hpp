@@ -16,6 +16,7 @@ namespace math {
 struct LuaParser;
 struct LuaTable;
 struct Camera;
+struct RenderContext;
 
 class Material;
 class ISceneLight;
@@ -32,9 +33,10 @@ public:
 	const std::list<ISceneObject*> GetObjects() const { return objects; }
 
 	const ISceneLight* GetClosestLight(const math::RaySegment&) const;
-	const ISceneObject* GetOccludingObject(unsigned int, const math::RaySegment&, math::RayIntersection*, const math::vec3f&) const;
-	const ISceneObject* GetClosestObject(unsigned int, const math::RaySegment&, math::RayIntersection*) const;
-	const ISceneObject* StepRayThroughGrid(unsigned int, const math::RaySegment&, math::RayIntersection*, float) const;
+	// the context provides the scratch memory of the calling thread
+	const ISceneObject* GetOccludingObject(RenderContext*, const math::RaySegment&, math::RayIntersection*, const math::vec3f&) const;
+	const ISceneObject* GetClosestObject(RenderContext*, const math::RaySegment&, math::RayIntersection*) const;
+	const ISceneObject* StepRayThroughGrid(RenderContext*, const math::RaySegment&, math::RayIntersection*, float) const;
 
 	Camera* GetCamera() const { return camera; }
 
@@ -46,8 +48,6 @@ public:
 		return true;
 	}
 
-	void SetNumThreads(unsigned int n) { numThreads = n; }
-
 private:
 	void AddMaterial(const LuaTable*);
 	void AddLight(const LuaTable*);
@@ -66,9 +66,6 @@ private:
 	math::vec3f minBounds;
 	math::vec3f maxBounds;
 
-	// set to the value of RayTracer::numThreads
-	unsigned int numThreads;
-
 	enum {
 		RAY_INTERSECTION_UNTESTED    = -1,
 		RAY_INTERSECTION_TESTED_NONE = -2,
@@ -0,0 +1,113 @@
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <cstring>
+#include <iostream>
+
+#include "./Benchmark.hpp"
+
+// note: there is no generic perf-event for the mid-level (L2)
+// cache, so the L1D and last-level cache are sampled instead
+static int OpenCacheCounter(unsigned int counter) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(perf_event_attr));
+
+	attr.size = sizeof(perf_event_attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	switch (counter) {
+		case Benchmark::COUNTER_L1D_READ_MISSES: {
+			attr.config =
+				(PERF_COUNT_HW_CACHE_L1D) |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		} break;
+		case Benchmark::COUNTER_LLC_MISSES: {
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		} break;
+		default: {
+			return -1;
+		} break;
+	}
+
+	// measure the calling thread on any cpu
+	return (syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+
+
+Benchmark::Benchmark(const std::string& s, bool cacheCounters): name(s), startTime(0.0), stopTime(0.0), running(false) {
+	for (unsigned int n = 0; n < COUNTER_LAST; n++) {
+		counterFDs[n] = (cacheCounters)? OpenCacheCounter(n): -1;
+		counterVals[n] = 0;
+
+		if (cacheCounters && counterFDs[n] < 0) {
+			std::cout << "[Benchmark::Benchmark][" << name << "]";
+			std::cout << " cache-counter " << n << " unavailable";
+			std::cout << std::endl;
+		}
+	}
+}
+
+Benchmark::~Benchmark() {
+	if (running) {
+		Stop();
+	}
+
+	for (unsigned int n = 0; n < COUNTER_LAST; n++) {
+		if (counterFDs[n] >= 0) {
+			close(counterFDs[n]);
+		}
+	}
+}
+
+void Benchmark::Start() {
+	for (unsigned int n = 0; n < COUNTER_LAST; n++) {
+		if (counterFDs[n] >= 0) {
+			ioctl(counterFDs[n], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counterFDs[n], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+
+	running = true;
+	startTime = GetTime();
+	stopTime = startTime;
+}
+
+void Benchmark::Stop() {
+	stopTime = GetTime();
+	running = false;
+
+	for (unsigned int n = 0; n < COUNTER_LAST; n++) {
+		if (counterFDs[n] >= 0) {
+			ioctl(counterFDs[n], PERF_EVENT_IOC_DISABLE, 0);
+
+			if (read(counterFDs[n], &counterVals[n], sizeof(uint64_t)) != sizeof(uint64_t)) {
+				counterVals[n] = 0;
+			}
+		}
+	}
+}
+
+// returns milliseconds
+float Benchmark::GetElapsedTime() const {
+	if (running) {
+		return ((GetTime() - startTime) * 1000.0);
+	}
+
+	return ((stopTime - startTime) * 1000.0);
+}
+
+// returns seconds
+double Benchmark::GetTime() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec + (tv.tv_usec * 0.000001));
+}
@@ -0,0 +1,52 @@
+#ifndef KIRAN_BENCHMARK_HDR
+#define KIRAN_BENCHMARK_HDR
+
+#include <string>
+#include <stdint.h>
+
+// simple wall-clock measurement harness used by the
+// (compile-time optional) data-structure benchmarks;
+// does not depend on SDL so that it can be included
+// from anywhere in the tree
+class Benchmark {
+public:
+	enum {
+		COUNTER_L1D_READ_MISSES = 0,
+		COUNTER_LLC_MISSES      = 1,
+		COUNTER_LAST            = 2,
+	};
+
+	// if <cacheCounters> is true, the hardware cache-miss
+	// counters of the calling thread are sampled between
+	// Start() and Stop() as well (requires Linux perf-event
+	// support, otherwise the counts will remain zero)
+	Benchmark(const std::string&, bool cacheCounters = false);
+	~Benchmark();
+
+	void Start();
+	void Stop();
+
+	// elapsed time between the last Start() and
+	// Stop() calls (or until now if still running)
+	float GetElapsedTime() const;
+
+	bool HaveCounter(unsigned int n) const { return (counterFDs[n] >= 0); }
+	uint64_t GetCounter(unsigned int n) const { return counterVals[n]; }
+
+	const std::string& GetName() const { return name; }
+
+private:
+	static double GetTime();
+
+	std::string name;
+
+	double startTime;
+	double stopTime;
+
+	int counterFDs[COUNTER_LAST];
+	uint64_t counterVals[COUNTER_LAST];
+
+	bool running;
+};
+
+#endif
@@ -30,18 +30,41 @@
 //! distance of the furthest photon found in the query or
 //! on the search-radius
 #define USE_FURTHEST_PHOTON_DIST           1
+#define FILTER_KERNEL_CONE                 0
+#define FILTER_KERNEL_GAUSSIAN             1
+#define FILTER_KERNEL_EPANECHNIKOV         2
+
 //! whether photons closer to the query search-position
 //! should be given a greater weight when estimating the
-//! irradiance
+//! irradiance, and by which kernel: a cone with slope
+//! FILTER_CONSTANT [Jensen, 7.2.1], a Gaussian [Jensen,
+//! 7.2.2] or an Epanechnikov (parabolic) one; kernels are
+//! evaluated at the photon distance relative to the radius
+//! of the estimate, and FILTER_NORMALIZER is their average
+//! over the disk of that radius
 #define FILTER_RADIANCE_ESTIMATE           1
+#define FILTER_KERNEL                      FILTER_KERNEL_CONE
 #define FILTER_CONSTANT                    1.25f
+#define FILTER_GAUSSIAN_ALPHA              0.918f
+#define FILTER_GAUSSIAN_BETA               1.953f
 
 #if (FILTER_RADIANCE_ESTIMATE == 1)
-#define FILTER_NORMALIZER (1.0f - (2.0f / (3.0f * FILTER_CONSTANT)))
+	#if (FILTER_KERNEL == FILTER_KERNEL_CONE)
+	#define FILTER_NORMALIZER (1.0f - (2.0f / (3.0f * FILTER_CONSTANT)))
+	#elif (FILTER_KERNEL == FILTER_KERNEL_GAUSSIAN)
+	#define FILTER_NORMALIZER (FILTER_GAUSSIAN_ALPHA * (1.0f - (1.0f - (2.0f / FILTER_GAUSSIAN_BETA) * (1.0f - expf(-0.5f * FILTER_GAUSSIAN_BETA))) / (1.0f - expf(-FILTER_GAUSSIAN_BETA))))
+	#elif (FILTER_KERNEL == FILTER_KERNEL_EPANECHNIKOV)
+	#define FILTER_NORMALIZER (0.5f)
+	#endif
 #else
 #define FILTER_NORMALIZER (1.0f)
 #endif
 
+//! whether the weighted sum over the photons gathered for
+//! an irradiance estimate is evaluated four photons at a
+//! time with SSE (only if the compiler targets SSE)
+#define SIMD_DENSITY_ESTIMATE              1
+
 
 
 // RayTracer
@@ -50,6 +73,19 @@
 //! pre-determined surface position offsets
 #define MONTE_CARLO_SOFT_SHADOWS                1
 #define NUM_MONTE_CARLO_LIGHT_SAMPLES          32
+//! whether (raytracer.numShadowPhotons per light) shadow
+//! photons should be traced to decide where shadow-rays are
+//! needed; a point whose SHADOW_PHOTON_SEARCH_COUNT nearest
+//! photons are all direct (or all shadow) photons is assumed
+//! to be fully lit (or fully occluded) by that light, only
+//! mixed (penumbra) regions fire any shadow-rays [Jensen, 9.1]
+//! SHADOW_PHOTON_MIN_COUNT is the number of (front-facing)
+//! photons that must be found before a point is classified
+//! at all; with fewer, it is shadow-tested as usual
+#define USE_SHADOW_PHOTONS                      1
+#define SHADOW_PHOTON_SEARCH_COUNT             16
+#define SHADOW_PHOTON_MIN_COUNT                (SHADOW_PHOTON_SEARCH_COUNT / 2)
+#define SHADOW_PHOTON_MAX_DEPOSITS              4
 //! whether a photon's reflected power should also be divided
 //! by the average diffuse (or specular) reflectance value of
 //! the material it struck when performing Russian-Roulette
@@ -58,6 +94,51 @@
 //! (photons that have bounced at least once) and ray-tracing
 //! is used to calculate direct illumination
 #define PHOTON_MAP_INDIRECT_ILLUMINATION_ONLY   0
+//! whether photons should be traced in batches (per thread) of
+//! PHOTON_STREAM_SIZE, one bounce of the whole batch at a time,
+//! with their deposits added to the photon-map in bulk once the
+//! batch is done (instead of one path and deposit at a time)
+#define STREAMED_PHOTON_TRACING                 1
+#define PHOTON_STREAM_SIZE                   1024U
+//! number of photons (of one light) that a thread emits at a
+//! time before taking the next chunk from the shared counter
+#define PHOTON_CHUNK_SIZE                    4096U
+//! pixel spacing of the primary rays whose hits serve as the
+//! probes of the adaptive photon count (adaptivePhotonError)
+#define ADAPTIVE_PHOTON_PROBE_STRIDE              16
+//! whether the emission (position and direction) and first
+//! bounce (Russian roulette and diffuse direction) of photons
+//! should be drawn from a Halton sequence indexed per photon
+//! rather than from the per-thread Mersenne Twisters
+#define USE_QMC_PHOTON_SAMPLING                 1
+//! in animation mode, the paths of each light are traced in
+//! ANIMATION_PATH_GROUPS groups by their Halton index modulo
+//! the number of groups; as that is 2^5 * 3^3 (the bases of
+//! the first two dimensions), the paths of a group all start
+//! from the same small box of emission samples. of a light that
+//! only moved, a group is re-traced when any of its first
+//! ANIMATION_PILOT_PATHS paths now hits the scene elsewhere
+//! (see raytracer.animationReuseRadius), else its photons of
+//! the previous frame are kept (requires QMC photon sampling)
+#define ANIMATION_PATH_GROUPS                 864U
+#define ANIMATION_PILOT_PATHS                   4U
+//! whether point-lights should emit photons only through the
+//! cells of a PROJECTION_MAP_SIZE x (PROJECTION_MAP_SIZE / 2)
+//! map of directions that are inside the light's fov and hit
+//! scene geometry (as found by PROJECTION_MAP_PROBES jittered
+//! probe rays per cell), with power scaled by their coverage
+#define USE_PROJECTION_MAPS                     1
+#define PROJECTION_MAP_SIZE                    64
+#define PROJECTION_MAP_PROBES                   4
+//! whether photons should be kept (with power compensation)
+//! only with a probability based on the density of importons
+//! (raytracer.numImportons, traced from the camera) in their
+//! cell of a coarse IMPORTANCE_GRID_SIZE^3 grid over the scene
+//! bounds; at least IMPORTANCE_MIN_PROBABILITY of the photons
+//! landing in any cell are kept, so estimates remain unbiased
+#define USE_IMPORTONS                           1
+#define IMPORTANCE_GRID_SIZE                   32
+#define IMPORTANCE_MIN_PROBABILITY              0.05f
 //! whether the irradiance estimates gathered during ray-tracing
 //! should be multiplied by the diffuse reflectance value of the
 //! material struck by a ray
@@ -67,6 +148,80 @@
 //! a given ray-surface intersection position
 #define NUM_IRRADIANCE_GATHER_RAYS              0
 #define IRRADIANCE_GATHER_RAY_WEIGHT            0.25f
+//! whether final gathers (NUM_IRRADIANCE_GATHER_RAYS > 0) should
+//! be stored as records of a world-space irradiance cache, and
+//! be interpolated from those wherever the cache already has a
+//! record within raytracer.irradianceCacheError of the shaded
+//! point (gathers then only run at a fraction of the points)
+#define USE_IRRADIANCE_CACHE                    1
+//! whether the final-gather estimates (at the surfaces hit by
+//! gather rays) should be made via a level-of-detail query on
+//! per-subtree photon aggregates (kd-tree only) instead of kNN;
+//! subtrees subtending less than IRRADIANCE_LOD_SOLID_ANGLE
+//! (in steradians, approximated as squared size over squared
+//! distance) as seen from the gather origin are not descended
+#define IRRADIANCE_LOD_QUERIES                  1
+#define IRRADIANCE_LOD_SOLID_ANGLE              0.0025f
+//! side (in pixels) of the square tiles the ray-tracing pass is
+//! split into; the tiles are dealt out to per-thread queues in
+//! Hilbert-curve order, and threads whose queue runs dry steal
+//! tiles from the back of the others' queues
+#define RENDER_TILE_SIZE                       16
+//! whether the irradiance estimates needed by all pixels of a
+//! tile should be deferred and resolved as one spatially sorted
+//! batch (only when NUM_IRRADIANCE_GATHER_RAYS is 0, since the
+//! gather rays need their estimates immediately)
+#define BATCHED_IRRADIANCE_QUERIES              1
+//! whether each kNN irradiance query should start out with the
+//! distance to the furthest photon found by the previous query
+//! in the same tile (times IRRADIANCE_RADIUS_SEED_FACTOR, which
+//! leaves room for a sparser neighborhood) as its search radius
+//! instead of the full photonSearchRadius; queries that find too
+//! few photons within it are repeated with the full radius
+#define SEED_IRRADIANCE_SEARCH_RADIUS           1
+#define IRRADIANCE_RADIUS_SEED_FACTOR        1.25f
+//! whether the batched estimates at the first surfaces seen
+//! through the pixels of a tile should be made only on a
+//! lattice (IRRADIANCE_LATTICE_SPACING pixels apart) at first,
+//! and be interpolated within every lattice cell whose pixels
+//! all lie on one object with similar normals (cosines above
+//! IRRADIANCE_INTERP_MIN_NORMAL_DOT) and depths (differing by
+//! at most IRRADIANCE_INTERP_MAX_DEPTH_CHANGE from the corner
+//! interpolation) and whose corner irradiances differ by at
+//! most IRRADIANCE_INTERP_MAX_IRRADIANCE_CHANGE; other cells
+//! are split in four until the lattice reaches every pixel;
+//! off by default, since the interpolation is biased (detail
+//! smaller than a lattice cell, eg. a thin caustic, can be
+//! lost if the corners happen to miss it)
+#define ADAPTIVE_IRRADIANCE_SAMPLING            0
+#define IRRADIANCE_LATTICE_SPACING              4
+#define IRRADIANCE_INTERP_MIN_NORMAL_DOT     0.95f
+#define IRRADIANCE_INTERP_MAX_DEPTH_CHANGE   0.05f
+#define IRRADIANCE_INTERP_MAX_IRRADIANCE_CHANGE 0.1f
+//! whether the first hits of the primary rays should be found
+//! (into a G-buffer of positions, normals and objects) by the
+//! threads that would otherwise idle while the photon-map gets
+//! finalized, rather than at the start of the ray-tracing pass;
+//! only applies to a pinhole camera without anti-aliasing (one
+//! primary ray per pixel) and when photons are traced, not read
+#define USE_PRIMARY_GBUFFER                     1
+//! reflected and refracted rays whose throughput (the product
+//! of the reflectances and transmittances on their path from
+//! the eye) is below RAY_THROUGHPUT_CUTOFF in every channel are
+//! not traced (if the irradiance they carry is at most one,
+//! they can not change a pixel by more than about one 8-bit
+//! step); this cutoff is biased, as the dropped rays make the
+//! image slightly darker, most of all where bright lights or
+//! caustics (irradiance well above one) are seen through many
+//! weak reflections. when several primary rays are averaged
+//! per pixel (anti-aliasing or depth of field), the other rays
+//! that are at least RAY_ROULETTE_MIN_DEPTH bounces deep are
+//! kept only with a probability equal to their largest
+//! throughput component (Russian roulette, which leaves the
+//! expected value intact but adds noise, which a single ray
+//! per pixel would show as speckle)
+#define RAY_THROUGHPUT_CUTOFF                0.004f
+#define RAY_ROULETTE_MIN_DEPTH                  2
 
 
 // SDLWindow
@@ -89,6 +244,26 @@
 #define DEBUG_ASSERTS_RAYTRACER 0
 #define DEBUG_RENDER_PHOTON_MAP 0
 
+// benchmarking
+//! whether to compare the configured kd-tree search
+//! (raytracer.photonSearchEpsilon, photonSearchMaxNodes)
+//! against exact kNN searches once the photon-map has
+//! been finalized
+#define BENCHMARK_PHOTON_MAP_QUERIES     0
+#define BENCHMARK_PHOTON_MAP_NUM_QUERIES 10000
+//! whether to compare per-pixel (scanline-order) queries
+//! against tiled Morton-ordered batches for all primary
+//! ray hits once the photon-map has been finalized
+#define BENCHMARK_IRRADIANCE_QUERY_BATCHING 0
+//! whether to compare the RMS irradiance error (over a grid
+//! of primary ray hits) of pseudo- and quasi-random photon
+//! maps of increasing size against a pseudo-random reference
+//! map with BENCHMARK_PHOTON_SAMPLING_REFERENCE_SCALE times
+//! as many photons, before the photon-map is traced
+#define BENCHMARK_PHOTON_SAMPLING                 0
+#define BENCHMARK_PHOTON_SAMPLING_REFERENCE_SCALE 8
+#define BENCHMARK_PHOTON_SAMPLING_PIXEL_STRIDE    8
+
 
 // #define M_INF(x) std::isinf(x)
 // #define M_NAN(x) std::isnan(x)
@@ -20,6 +20,99 @@ bool LuaTable::operator == (const LuaTable& t) const {
 	);
 }
 
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static uint64_t HashBytes(uint64_t hash, const void* data, size_t size) {
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static uint64_t HashStr(uint64_t hash, const std::string& s) { return (HashBytes(hash, s.c_str(), s.size() + 1)); }
+static uint64_t HashFlt(uint64_t hash, float f) { return (HashBytes(hash, &f, sizeof(float))); }
+static uint64_t HashInt(uint64_t hash, int i) { return (HashBytes(hash, &i, sizeof(int))); }
+
+static bool SkipKey(const std::list<std::string>* skipKeys, const std::string& key) {
+	if (skipKeys == NULL) {
+		return false;
+	}
+
+	for (std::list<std::string>::const_iterator it = skipKeys->begin(); it != skipKeys->end(); it++) {
+		if (*it == key) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint64_t LuaTable::GetHash(const std::list<std::string>* skipKeys) const {
+	uint64_t hash = FNV_OFFSET_BASIS;
+
+	// table-keyed entries are ordered by address, so their
+	// hashes are combined in an order-independent way
+	uint64_t tblKeysHash = 0;
+
+	for (std::map<LuaTable*, LuaTable*>::const_iterator it = TblTblPairs.begin(); it != TblTblPairs.end(); it++) {
+		tblKeysHash += (it->first->GetHash(skipKeys) * FNV_PRIME) ^ it->second->GetHash(skipKeys);
+	}
+	for (std::map<LuaTable*, std::string>::const_iterator it = TblStrPairs.begin(); it != TblStrPairs.end(); it++) {
+		tblKeysHash += (it->first->GetHash(skipKeys) * FNV_PRIME) ^ HashStr(FNV_OFFSET_BASIS, it->second);
+	}
+	for (std::map<LuaTable*, float>::const_iterator it = TblFltPairs.begin(); it != TblFltPairs.end(); it++) {
+		tblKeysHash += (it->first->GetHash(skipKeys) * FNV_PRIME) ^ HashFlt(FNV_OFFSET_BASIS, it->second);
+	}
+
+	hash = HashBytes(hash, &tblKeysHash, sizeof(uint64_t));
+
+	for (std::map<std::string, LuaTable*>::const_iterator it = StrTblPairs.begin(); it != StrTblPairs.end(); it++) {
+		if (SkipKey(skipKeys, it->first))
+			continue;
+
+		const uint64_t tblHash = it->second->GetHash(skipKeys);
+
+		hash = HashStr(hash, it->first);
+		hash = HashBytes(hash, &tblHash, sizeof(uint64_t));
+	}
+	for (std::map<std::string, std::string>::const_iterator it = StrStrPairs.begin(); it != StrStrPairs.end(); it++) {
+		if (SkipKey(skipKeys, it->first))
+			continue;
+
+		hash = HashStr(hash, it->first);
+		hash = HashStr(hash, it->second);
+	}
+	for (std::map<std::string, float>::const_iterator it = StrFltPairs.begin(); it != StrFltPairs.end(); it++) {
+		if (SkipKey(skipKeys, it->first))
+			continue;
+
+		hash = HashStr(hash, it->first);
+		hash = HashFlt(hash, it->second);
+	}
+
+	for (std::map<int, LuaTable*>::const_iterator it = IntTblPairs.begin(); it != IntTblPairs.end(); it++) {
+		const uint64_t tblHash = it->second->GetHash(skipKeys);
+
+		hash = HashInt(hash, it->first);
+		hash = HashBytes(hash, &tblHash, sizeof(uint64_t));
+	}
+	for (std::map<int, std::string>::const_iterator it = IntStrPairs.begin(); it != IntStrPairs.end(); it++) {
+		hash = HashInt(hash, it->first);
+		hash = HashStr(hash, it->second);
+	}
+	for (std::map<int, float>::const_iterator it = IntFltPairs.begin(); it != IntFltPairs.end(); it++) {
+		hash = HashInt(hash, it->first);
+		hash = HashFlt(hash, it->second);
+	}
+
+	return hash;
+}
+
 LuaTable::~LuaTable() {
 	for (std::map<LuaTable*, LuaTable*>::iterator it = TblTblPairs.begin(); it != TblTblPairs.end(); it++) {
 		delete it->first;
@@ -4,6 +4,7 @@
 #include <list>
 #include <map>
 #include <string>
+#include <stdint.h>
 
 #include "../math/vec3fwd.hpp"
 
@@ -19,6 +20,11 @@ public:
 	void Print(int) const;
 	void Parse(lua_State*, int);
 
+	// recursive content-hash (FNV-1a) that ignores every string
+	// key (at any depth) listed in the optional skip-list, so two
+	// tables differing only in those entries hash identically
+	uint64_t GetHash(const std::list<std::string>* skipKeys = NULL) const;
+
 	typedef std::pair<LuaTable*, LuaTable*>     TblTblPair;
 	typedef std::pair<LuaTable*, std::string>   TblStrPair;
 	typedef std::pair<LuaTable*, float>         TblFltPair;
@@ -29,7 +29,6 @@ int main(int argc, char** argv) {
 	RayTracer tracer(parser, scene);
 
 	srandom(time(NULL));
-	scene.SetNumThreads(tracer.GetNumThreads());
 	sceneDump.replace(sceneDump.find(".lua"), sceneDump.size(), ".ppm");
 
 	camera.Update();
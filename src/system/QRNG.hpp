@@ -0,0 +1,55 @@
+#ifndef KIRAN_QRNG_HDR
+#define KIRAN_QRNG_HDR
+
+#include "./RNG.hpp"
+
+// Halton low-discrepancy (quasi-random) sequence; dimension d
+// of the i-th point is the radical inverse of i in the d-th
+// prime base. every dimension is offset by a random rotation
+// (Cranley-Patterson) so that separately seeded sequences are
+// decorrelated while keeping their stratification, and since
+// points are looked up by index only, multiple threads can use
+// disjoint index ranges of one sequence without any locking
+class QRNGHalton {
+public:
+	enum {
+		NUM_DIMS = 8,
+	};
+
+	QRNGHalton(RNGflt64* rng) {
+		for (unsigned int dim = 0; dim < NUM_DIMS; dim++) {
+			rotations[dim] = (*rng)();
+		}
+	}
+
+	// returns dimension <dim> (< NUM_DIMS) of point <index>
+	// as a number in the half-open interval [0, 1)
+	double operator () (unsigned int index, unsigned int dim) const {
+		const double r = RadicalInverse(GetBase(dim), index) + rotations[dim];
+		return ((r >= 1.0)? (r - 1.0): r);
+	}
+
+	static double RadicalInverse(unsigned int base, unsigned int index) {
+		const double invBase = 1.0 / base;
+
+		double invDigit = invBase;
+		double r = 0.0;
+
+		for (; index > 0; index /= base) {
+			r += (index % base) * invDigit;
+			invDigit *= invBase;
+		}
+
+		return r;
+	}
+
+private:
+	static unsigned int GetBase(unsigned int dim) {
+		static const unsigned int primes[NUM_DIMS] = {2, 3, 5, 7, 11, 13, 17, 19};
+		return primes[dim];
+	}
+
+	double rotations[NUM_DIMS];
+};
+
+#endif
@@ -118,6 +118,12 @@ void SDLWindow::NormalizeBuffers() {
 	}
 }
 
+void SDLWindow::ResetPixelStats() {
+	maxPixel = math::NVECf;
+	sumPixel = math::NVECf;
+	avgPixel = math::NVECf;
+}
+
 void SDLWindow::Show() {
 	if (surface == NULL) {
 		return;
@@ -20,6 +20,9 @@ public:
 	bool InitSDL(unsigned int, unsigned int, const char*);
 	void SwapBuffers(unsigned int);
 	void NormalizeBuffers();
+	// forget the statistics of all pixels set so far (used
+	// before every pixel is about to be set again)
+	void ResetPixelStats();
 
 	void DrawRect(unsigned int, unsigned int, unsigned int, unsigned int, unsigned int);
 	void SetPixel(unsigned int, unsigned int, const math::vec3f&);
@@ -0,0 +1,114 @@
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <iostream>
+
+#include "./ThreadPool.hpp"
+
+ThreadPool::ThreadPool(unsigned int numThreads, bool pinThreads): taskNum(0), numBusyThreads(0), quit(false) {
+	if (pinThreads) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+
+		// the process may be restricted to a subset of the CPUs
+		// (not necessarily the first ones)
+		if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &cpus)) {
+					threadCPUs.push_back(cpu);
+				}
+			}
+		}
+
+		if (threadCPUs.empty()) {
+			std::cout << "[ThreadPool::ThreadPool] cannot get the allowed CPUs, threads will not be pinned" << std::endl;
+			pinThreads = false;
+		} else if (numThreads > threadCPUs.size()) {
+			std::cout << "[ThreadPool::ThreadPool] " << numThreads << " threads pinned to " << threadCPUs.size() << " CPUs, some will share one" << std::endl;
+		}
+	}
+
+	for (unsigned int threadNum = 0; threadNum < numThreads; threadNum++) {
+		threads.push_back(new boost::thread(boost::bind(&ThreadPool::WorkerThread, this, threadNum, pinThreads)));
+	}
+
+	std::cout << "[ThreadPool::ThreadPool]" << std::endl;
+	std::cout << "\tnumThreads: " << numThreads << std::endl;
+	std::cout << "\tpinThreads: " << pinThreads << std::endl;
+	std::cout << "\tnumCPUs:    " << threadCPUs.size() << std::endl;
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		boost::mutex::scoped_lock lock(taskMutex);
+		quit = true;
+		taskStarted.notify_all();
+	}
+
+	for (unsigned int threadNum = 0; threadNum < threads.size(); threadNum++) {
+		threads[threadNum]->join();
+		delete threads[threadNum];
+	}
+}
+
+
+
+void ThreadPool::Run(const Task& t) {
+	boost::mutex::scoped_lock lock(taskMutex);
+
+	task = t;
+	taskNum += 1;
+	numBusyThreads = threads.size();
+	taskStarted.notify_all();
+
+	while (numBusyThreads > 0) {
+		taskFinished.wait(lock);
+	}
+
+	// do not keep the task's bound arguments alive
+	task.clear();
+}
+
+void ThreadPool::WorkerThread(unsigned int threadNum, bool pinThread) {
+	if (pinThread) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(threadCPUs[threadNum % threadCPUs.size()], &cpus);
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0) {
+			std::cout << "[ThreadPool::WorkerThread] thread " << threadNum << " could not be pinned" << std::endl;
+		}
+	}
+
+	unsigned int lastTaskNum = 0;
+
+	while (true) {
+		Task currTask;
+
+		{
+			boost::mutex::scoped_lock lock(taskMutex);
+
+			while (!quit && taskNum == lastTaskNum) {
+				taskStarted.wait(lock);
+			}
+
+			if (quit) {
+				break;
+			}
+
+			lastTaskNum = taskNum;
+			currTask = task;
+		}
+
+		currTask(threadNum);
+
+		{
+			boost::mutex::scoped_lock lock(taskMutex);
+
+			if ((numBusyThreads -= 1) == 0) {
+				taskFinished.notify_all();
+			}
+		}
+	}
+}
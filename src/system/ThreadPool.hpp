@@ -0,0 +1,53 @@
+#ifndef KIRAN_THREADPOOL_HDR
+#define KIRAN_THREADPOOL_HDR
+
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+namespace boost {
+	class thread;
+}
+
+// fixed set of worker threads that live as long as the pool,
+// so that successive passes (and frames) do not pay for thread
+// creation and keep whatever per-thread state they warmed up;
+// a task is run by every worker at once (each gets its own
+// thread number, like the threads of a barrier-synchronized
+// pass) and Run returns when all of them have finished it
+class ThreadPool {
+public:
+	typedef boost::function<void(unsigned int)> Task;
+
+	// if <pinThreads> is set, worker i only runs on the i'th
+	// CPU (modulo their number) the process is allowed to use,
+	// eg. within a cpuset or taskset
+	ThreadPool(unsigned int numThreads, bool pinThreads);
+	~ThreadPool();
+
+	void Run(const Task& task);
+
+	unsigned int GetNumThreads() const { return threads.size(); }
+
+private:
+	void WorkerThread(unsigned int threadNum, bool pinThread);
+
+	std::vector<boost::thread*> threads;
+	// CPUs the workers are pinned to (if pinned)
+	std::vector<int> threadCPUs;
+
+	boost::mutex taskMutex;
+	boost::condition_variable taskStarted;
+	boost::condition_variable taskFinished;
+
+	Task task;
+	// incremented for every task, so workers can tell a new
+	// one from the one they just finished
+	unsigned int taskNum;
+	unsigned int numBusyThreads;
+
+	bool quit;
+};
+
+#endif